@@ -0,0 +1,44 @@
+/* eyeseq.c
+ *
+ * Eye sequence tracking, see eyeseq.h.
+ * */
+
+#include "eyeseq.h"
+
+void
+nvstusb_eyeseq_init(
+  struct nvstusb_eyeseq *seq
+) {
+  seq->last_msc = 0;
+  seq->phase = 0;
+  seq->primed = 0;
+}
+
+void
+nvstusb_eyeseq_observe(
+  struct nvstusb_eyeseq *seq,
+  int64_t msc,
+  int eye,
+  int frames,
+  struct nvstusb_eyeseq_result *result
+) {
+  int phase = (eye ^ (int) (msc & 1)) & 1;
+
+  result->dropped = 0;
+  result->duplicated = 0;
+  result->resync = 0;
+
+  if (seq->primed) {
+    int64_t delta = msc - seq->last_msc;
+    if (delta > frames) result->dropped = delta - frames;
+    if (delta < frames) result->duplicated = 1;
+
+    /* an odd number of skipped refreshes or a frame that was never shown,
+     * from here on the app's eyes land on the other parity */
+    if (phase != seq->phase) result->resync = 1;
+  }
+
+  seq->last_msc = msc;
+  seq->phase = phase;
+  seq->primed = 1;
+}
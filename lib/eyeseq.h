@@ -0,0 +1,41 @@
+/* eyeseq.h
+ *
+ * Checks the eyes of alternating frames against the vblank counter they
+ * flipped on. The emitter toggles the shutters on every refresh by itself,
+ * so as long as one frame flips per refresh the eye follows the counter's
+ * parity. A skipped refresh (the previous frame is scanned out again) or a
+ * frame that never reached the screen shifts the app's eye sequence against
+ * that parity. Internal to the library.
+ * */
+
+#ifndef __NVSTUSB_EYESEQ_H__
+#define __NVSTUSB_EYESEQ_H__
+
+#include <stdint.h>
+
+struct nvstusb_eyeseq {
+  /* counter the previous frame flipped on, valid once primed */
+  int64_t last_msc;
+
+  /* eye xor counter parity, the same for every frame while in step */
+  int phase;
+
+  int primed;
+};
+
+/* what a frame did to the sequence, see nvstusb_eyeseq_observe() */
+struct nvstusb_eyeseq_result {
+  int64_t dropped;      /* refreshes the previous frame was repeated for */
+  int duplicated;       /* this frame flipped on the previous one's vblank */
+  int resync;           /* eye and parity moved apart, the shutters need a
+                         * command right away */
+};
+
+void nvstusb_eyeseq_init(struct nvstusb_eyeseq *seq);
+
+/* feed the newest of frames frames, for eye (0 = left, 1 = right), that
+ * flipped on vblank msc. the older ones completed unobserved since the last
+ * call and are taken to have flipped on the vblanks before it */
+void nvstusb_eyeseq_observe(struct nvstusb_eyeseq *seq, int64_t msc, int eye, int frames, struct nvstusb_eyeseq_result *result);
+
+#endif // __NVSTUSB_EYESEQ_H__
@@ -7,6 +7,8 @@
  * under certain conditions. See the file COPYING for details
  * */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -17,6 +19,11 @@
 #include <assert.h>
 #include <math.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include <GL/gl.h>
 #include <GL/glx.h>
@@ -25,15 +32,25 @@
 
 #include "nvstusb.h"
 #include "usb.h"
+#include "telemetry.h"
+#include "vblank.h"
+#include "eyeseq.h"
+#include "ratetrack.h"
+#include "ring.h"
 
 static PFNGLXGETVIDEOSYNCSGIPROC glXGetVideoSyncSGI = NULL;
 static PFNGLXWAITVIDEOSYNCSGIPROC glXWaitVideoSyncSGI = NULL;
 static PFNGLXSWAPINTERVALSGIPROC glXSwapIntervalSGI = NULL;
 static PFNGLXSWAPINTERVALEXTPROC glXSwapIntervalEXT = NULL;
+static PFNGLXGETSYNCVALUESOMLPROC glXGetSyncValuesOML = NULL;
+static PFNGLFENCESYNCPROC glFenceSync = NULL;
+static PFNGLCLIENTWAITSYNCPROC glClientWaitSync = NULL;
+static PFNGLDELETESYNCPROC glDeleteSync = NULL;
 
 /* Static functions */
-static void nvstusb_print_refresh_rate(void);
 static void * nvstusb_stereo_thread(void * in_pv_arg);
+static void * nvstusb_emitter_thread(void * in_pv_arg);
+static int nvstusb_sync_from_env(void);
 
 /* cpu clock */
 #define NVSTUSB_CLOCK           48000000LL
@@ -55,10 +72,73 @@ static void * nvstusb_stereo_thread(void * in_pv_arg);
 #define NVSTUSB_CMD_SET_EYE     (0xAA)  /* set current eye */
 #define NVSTUSB_CMD_CALL_X0199  (0xBE)  /* call routine at 0x0199 */
 
-/* state of the controller */
+/* eye command lead when no usb latency was measured yet */
+#define NVSTUSB_DEFAULT_EYE_LEAD_US  500
+
+/* swaps the readback sync strategy lets the GPU run ahead by at most, see
+ * nvstusb_set_render_ahead() */
+#define NVSTUSB_MAX_RENDER_AHEAD     4
+
+/* entries of nvstusb_sync_strategies */
+#define NVSTUSB_SYNC_COUNT           5
+
+/* values of sync_request besides a strategy */
+#define NVSTUSB_SYNC_KEEP            (-1)
+#define NVSTUSB_SYNC_CALIBRATE       (-2)
+
+/* frames every sync strategy is measured for at startup, after a few to
+ * let it settle */
+#define NVSTUSB_CALIBRATION_SETTLE   4
+#define NVSTUSB_CALIBRATION_FRAMES   30
+
+/* the emitter is retuned when the display is this far off its rate, see
+ * nvstusb_set_rate_tracking() */
+#define NVSTUSB_DEFAULT_RATE_TRACK_PPM  100
+
+/* rate corrections kept for nvstusb_get_rate_corrections() */
+#define NVSTUSB_RATE_HISTORY         16
+
+/* a swap fence that doesn't signal within this long is given up on */
+#define NVSTUSB_FENCE_TIMEOUT_NS     100000000ull
+
+/* keys are polled at this rate unless nvstusb_start_key_poller() says
+ * otherwise, the device stalls if it isn't polled regularly */
+#define NVSTUSB_DEFAULT_KEY_POLL_HZ  60
+
+/* a key read takes a usb round trip, don't start one this close to an eye
+ * command deadline */
+#define NVSTUSB_KEY_POLL_GUARD_US    2000
+
+/* register writes the usb queue had no room for are retried this often,
+ * one reprogramming is at most this many transfers */
+#define NVSTUSB_REGISTER_RETRY_US    500
+#define NVSTUSB_REGISTER_BACKLOG     4
+
+/* a swap whose completion the readback sync strategy is waiting for */
+struct nvstusb_fence {
+  GLsync sync;
+  enum nvstusb_eye eye;
+};
+
+/* A way for nvstusb_swap() to find out when an alternating frame reaches
+ * the screen and to send its eye command then, see nvstusb_sync_strategies.
+ * init and teardown (both may be 0) run on the swapping thread with the GL
+ * context current when the strategy is taken up or given up. */
+struct nvstusb_context;
+struct nvstusb_sync_strategy {
+  const char *name;
+  int method;           /* its number for NVSTUSB_VBLANK_METHOD */
+  int (*available)(struct nvstusb_context *ctx);
+  void (*init)(struct nvstusb_context *ctx);
+  void (*swap)(struct nvstusb_context *ctx, enum nvstusb_eye eye, void (*swapfunc)());
+  void (*teardown)(struct nvstusb_context *ctx);
+};
+
+/* state of the controller. the device is only used by the emitter thread,
+ * everything else that more than one thread touches is atomic */
 struct nvstusb_context {
-  /* currently selected refresh rate */
-  float rate;
+  /* currently programmed refresh rate, written by the emitter thread */
+  _Atomic float rate;
 
   /* currently active eye */
   enum nvstusb_eye eye;
@@ -67,86 +147,449 @@ struct nvstusb_context {
   struct nvstusb_usb_device *device;
 
   /* Toggled state */
-  int toggled3D;
-
-  /* Vblank method */
-  int vblank_method;
+  atomic_int toggled3D;
+
+  /* Sync strategy of alternating frames, 0 until the first swap took one
+   * up. Only the swapping thread uses it and the calibration; other
+   * threads leave a request for the next swap */
+  const struct nvstusb_sync_strategy *sync;
+  atomic_int sync_request;
+  int trial;
+  int trial_frames;
+  struct nvstusb_sync_result calibration[NVSTUSB_SYNC_COUNT];
+  int calibration_count;
 
   /* Invert eyes command status */
-  int invert_eyes;
+  atomic_int invert_eyes;
 
   /* Stereo Thread handler */
   pthread_t s_thread;
 
   /* Stereo thread state */
-  char b_thread_running;
+  atomic_bool b_thread_running;
+
+  /* Quad buffered stereo: a vblank that scanned out the left eye and the
+   * refresh period, from the swaps, for the stereo thread. The ring has a
+   * single producer, stereo_posts says it is the stereo thread: from its
+   * start until it was joined. The swapping thread only posts with it
+   * clear, under quad_lock */
+  pthread_mutex_t quad_lock;
+  uint64_t quad_left_us;
+  double quad_period_us;
+  bool stereo_posts;
+
+  /* Key poll period of the emitter thread, see nvstusb_start_key_poller() */
+  atomic_uint_fast64_t key_poll_period_us;
+
+  /* Key input accumulated by the poller since the last nvstusb_get_keys() */
+  atomic_int acc_wheel;
+  atomic_int acc_pressed_wheel;
+  atomic_int acc_toggled3D;
+
+  /* Frame timing histograms */
+  struct nvstusb_telemetry telemetry;
+
+  /* Emitter bring-up, see nvstusb_init_async() */
+  pthread_t init_thread;
+  int init_thread_running;
+  atomic_int init_state;
+  pthread_mutex_t init_lock;
+  pthread_cond_t init_cond;
+  char *init_backend;
+  char *init_device;
+
+  /* Timings for the emitter thread to program in one go, packed by
+   * nvstusb_pack_timings(), 0 = none */
+  atomic_uint_fast64_t pending_timings;
+
+  /* Register writes the usb queue was full for, oldest first, only used by
+   * the emitter thread. Nothing is programmed until they are out */
+  struct {
+    uint8_t buf[NVSTUSB_USB_ASYNC_MAX_SIZE];
+    int size;
+  } register_backlog[NVSTUSB_REGISTER_BACKLOG];
+  int register_backlog_count;
+
+  /* Usb transfers sent and saved, see nvstusb_get_transfer_stats() */
+  atomic_uint_fast64_t register_transfers;
+  atomic_uint_fast64_t register_saved;
+  atomic_uint_fast64_t timings_replaced;
+  atomic_uint_fast64_t eye_transfers;
+  atomic_uint_fast64_t eye_saved;
+
+  /* Emitter thread, owns the device. Eye commands reach it through the
+   * ring, it sleeps on a futex on wake_seq, which goes up with every eye
+   * command posted and every setting changed for it */
+  pthread_t emitter_thread;
+  int emitter_running;
+  atomic_int emitter_stop;
+  atomic_int emitter_waiting;
+  atomic_uint wake_seq;
+  struct nvstusb_ring ring;
+  atomic_uint_fast64_t dropped_events;
+  atomic_uint_fast64_t replaced_events;
+
+  /* Emitter thread scheduling, SCHED_FIFO priority (0 = normal) and cpu
+   * (-1 = any) */
+  int rt_priority;
+  int rt_cpu;
+
+  /* Vblank prediction, only used by the swapping thread. vblank_rate is
+   * the nominal rate it started from */
+  struct nvstusb_vblank vblank;
+  float vblank_rate;
+  int oml_ok;
+
+  /* Timings the app asked for, the emitter may be retuned off the rate */
+  _Atomic float nominal_rate;
+  atomic_int nominal_active_us;
+
+  /* Refresh rate tracking, fed by the swapping thread (0 ppm = off). The
+   * estimate and the corrections are under rate_lock for the getters */
+  struct nvstusb_ratetrack ratetrack;
+  atomic_int rate_track_ppm;
+  pthread_mutex_t rate_lock;
+  double measured_period_us;
+  struct nvstusb_rate_correction corrections[NVSTUSB_RATE_HISTORY];
+  unsigned long long correction_count;
+
+  /* Swap interval set to 1 on this context */
+  int swap_interval_set;
+
+  /* Eyes of alternating frames against the vblank counter, only used by the
+   * swapping thread */
+  struct nvstusb_eyeseq eyeseq;
+
+  /* Swap completion fences (readback sync), only used by the swapping
+   * thread. fence_ok is -1 until a swap could check for GL_ARB_sync; the
+   * oldest swap in flight is at fence_head */
+  int fence_ok;
+  atomic_int render_ahead;
+  struct nvstusb_fence fences[NVSTUSB_MAX_RENDER_AHEAD + 1];
+  int fence_head;
+  int fence_count;
+
+  /* How long before its deadline an eye command is sent, -1 = measured usb
+   * latency */
+  atomic_int eye_lead_us;
+  atomic_uint_fast64_t usb_latency_us;
+
+  /* Startup timing (monotonic, us) */
+  uint64_t t_init;
+  uint64_t t_ready;
+  uint64_t first_frame_us;
+};
+
+/* values of init_state */
+enum {
+  nvstusb_init_pending = 0,
+  nvstusb_init_ready = 1,
+  nvstusb_init_failed = -1,
 };
 
-/* initialize controller */
+/* asynchronous eye command finished, runs on the usb event thread */
+static void
+nvstusb_usb_completed(
+    void *user,
+    int endpoint,
+    int status,
+    uint64_t latency_us
+    ) {
+  struct nvstusb_context *ctx = (struct nvstusb_context *) user;
+
+  /* register writes go this way too, only eye commands are timed */
+  if (1 != endpoint) return;
+  nvstusb_telemetry_record(&ctx->telemetry, nvstusb_timing_usb_completion, latency_us);
+
+  /* running average for the eye command lead, only this thread writes it */
+  uint64_t avg = atomic_load_explicit(&ctx->usb_latency_us, memory_order_relaxed);
+  avg = avg ? avg + ((int64_t)latency_us - (int64_t)avg) / 8 : latency_us;
+  atomic_store_explicit(&ctx->usb_latency_us, avg, memory_order_relaxed);
+}
+
+/* initialize controller, the usb backend comes from NVSTUSB_BACKEND */
 struct nvstusb_context *
 nvstusb_init(void) 
 {
+  return nvstusb_init_backend(getenv("NVSTUSB_BACKEND"));
+}
 
-  /* initialize usb */
-  if (!nvstusb_usb_init()) return 0;
-
-  /* open device */
-  struct nvstusb_usb_device *dev = nvstusb_usb_open_device("nvstusb.fw");
-  if (0 == dev) return 0;
-
-  /* allocate context */
-  struct nvstusb_context *ctx = malloc(sizeof(*ctx));
+/* allocate a context whose device is not open yet */
+static struct nvstusb_context *
+nvstusb_alloc_context(const char *backend, const char *device)
+{
+  /* the ring's indices are cache line aligned */
+  struct nvstusb_context *ctx = 0;
+  if (posix_memalign((void **) &ctx, 64, sizeof(*ctx)) != 0) ctx = 0;
   if (0 == ctx) {
     fprintf(stderr, "nvstusb: Could not allocate %d bytes for nvstusb_context...\n", (int)sizeof(*ctx));
-    nvstusb_usb_close_device(dev);
-    nvstusb_usb_deinit();
     return 0;
   }
-  ctx->rate = 0.0;
+  atomic_init(&ctx->rate, 0.0f);
   ctx->eye = 0;
-  ctx->device = dev;
-  ctx->vblank_method = 0;
-  ctx->toggled3D = 0;
-  ctx->invert_eyes = 0;
-  ctx->b_thread_running = 0;
-
+  ctx->device = 0;
+  ctx->sync = 0;
+  atomic_init(&ctx->sync_request, nvstusb_sync_from_env());
+  ctx->trial = -1;
+  ctx->trial_frames = 0;
+  ctx->calibration_count = 0;
+  atomic_init(&ctx->toggled3D, 0);
+  atomic_init(&ctx->invert_eyes, 0);
+  atomic_init(&ctx->b_thread_running, false);
+  pthread_mutex_init(&ctx->quad_lock, NULL);
+  ctx->quad_left_us = 0;
+  ctx->quad_period_us = 0;
+  ctx->stereo_posts = false;
+  atomic_init(&ctx->key_poll_period_us, 1000000 / NVSTUSB_DEFAULT_KEY_POLL_HZ);
+  atomic_init(&ctx->acc_wheel, 0);
+  atomic_init(&ctx->acc_pressed_wheel, 0);
+  atomic_init(&ctx->acc_toggled3D, 0);
+  nvstusb_telemetry_init(&ctx->telemetry);
+  if (getenv("NVSTUSB_TIMING_DUMP")) {
+    nvstusb_set_timing_dump(ctx, atof(getenv("NVSTUSB_TIMING_DUMP")));
+  }
 
-  /* Vblank init */
-  /* NVIDIA VBlank syncing environment variable defined, signal it and disable
-   * any attempt to application side method */
-  if (getenv ("__GL_SYNC_TO_VBLANK"))
-  {
-    fprintf (stderr, "__GL_SYNC_TO_VBLANK defined in environment\n");
-    ctx->vblank_method = 2;
-    goto out_err;
+  ctx->emitter_running = 0;
+  atomic_init(&ctx->emitter_stop, 0);
+  atomic_init(&ctx->emitter_waiting, 0);
+  atomic_init(&ctx->wake_seq, 0);
+  nvstusb_ring_init(&ctx->ring);
+  atomic_init(&ctx->dropped_events, 0);
+  atomic_init(&ctx->replaced_events, 0);
+  ctx->rt_priority = getenv("NVSTUSB_RT_PRIORITY") ? atoi(getenv("NVSTUSB_RT_PRIORITY")) : 0;
+  ctx->rt_cpu = getenv("NVSTUSB_CPU") ? atoi(getenv("NVSTUSB_CPU")) : -1;
+
+  nvstusb_vblank_init(&ctx->vblank, 1e6 / 120.0);
+  nvstusb_eyeseq_init(&ctx->eyeseq);
+  ctx->vblank_rate = 0.0;
+  ctx->oml_ok = 0;
+  atomic_init(&ctx->nominal_rate, 0.0f);
+  atomic_init(&ctx->nominal_active_us, 0);
+  nvstusb_ratetrack_init(&ctx->ratetrack, 0);
+  atomic_init(&ctx->rate_track_ppm, getenv("NVSTUSB_RATE_TRACK_PPM") ?
+    atoi(getenv("NVSTUSB_RATE_TRACK_PPM")) : NVSTUSB_DEFAULT_RATE_TRACK_PPM);
+  pthread_mutex_init(&ctx->rate_lock, NULL);
+  ctx->measured_period_us = 0;
+  ctx->correction_count = 0;
+  ctx->swap_interval_set = 0;
+  atomic_init(&ctx->eye_lead_us, getenv("NVSTUSB_EYE_LEAD_US") ? atoi(getenv("NVSTUSB_EYE_LEAD_US")) : -1);
+  atomic_init(&ctx->usb_latency_us, 0);
+  ctx->fence_ok = -1;
+  atomic_init(&ctx->render_ahead, 0);
+  if (getenv("NVSTUSB_RENDER_AHEAD")) {
+    nvstusb_set_render_ahead(ctx, atoi(getenv("NVSTUSB_RENDER_AHEAD")));
   }
+  ctx->fence_head = 0;
+  ctx->fence_count = 0;
+
+  ctx->init_thread_running = 0;
+  atomic_init(&ctx->init_state, nvstusb_init_pending);
+  pthread_mutex_init(&ctx->init_lock, NULL);
+  pthread_cond_init(&ctx->init_cond, NULL);
+  ctx->init_backend = backend ? strdup(backend) : 0;
+  ctx->init_device = device ? strdup(device) : 0;
+  atomic_init(&ctx->pending_timings, 0);
+  ctx->register_backlog_count = 0;
+  atomic_init(&ctx->register_transfers, 0);
+  atomic_init(&ctx->register_saved, 0);
+  atomic_init(&ctx->timings_replaced, 0);
+  atomic_init(&ctx->eye_transfers, 0);
+  atomic_init(&ctx->eye_saved, 0);
+  ctx->t_init = nvstusb_time_us();
+  ctx->t_ready = 0;
+  ctx->first_frame_us = 0;
+  return ctx;
+}
 
+/* look up the vsync extensions the sync strategies use */
+static void
+nvstusb_probe_sync(struct nvstusb_context *ctx)
+{
   /* Swap interval */
   glXSwapIntervalSGI = (PFNGLXSWAPINTERVALSGIPROC)glXGetProcAddress("glXSwapIntervalSGI");
 
-  if (NULL != glXSwapIntervalSGI) {
-    fprintf(stderr, "nvstusb: forcing vsync\n");
-    ctx->vblank_method = 3;
-  }
-
   /* Sync Video */
   glXGetVideoSyncSGI = (PFNGLXGETVIDEOSYNCSGIPROC)glXGetProcAddress("glXGetVideoSyncSGI");
   glXWaitVideoSyncSGI = (PFNGLXWAITVIDEOSYNCSGIPROC)glXGetProcAddress("glXWaitVideoSyncSGI");
   if (NULL == glXWaitVideoSyncSGI) {
     glXGetVideoSyncSGI = 0;
-  } else {
-    ctx->vblank_method = 1;
   }
 
   if (NULL != glXGetVideoSyncSGI ) {
     fprintf(stderr, "nvstusb: GLX_SGI_video_sync supported!\n");
   }
 
-  fprintf(stderr, "nvstusb:selected vblank method: %d\n", ctx->vblank_method);
-out_err:
+  /* Vblank timestamps, with those (or at least a forced vsync to predict
+   * from) eye commands can be scheduled instead of sent after a blocking
+   * wait */
+  glXGetSyncValuesOML = (PFNGLXGETSYNCVALUESOMLPROC)glXGetProcAddress("glXGetSyncValuesOML");
+  ctx->oml_ok = (NULL != glXGetSyncValuesOML);
+
+  /* swap completion fences for the readback strategy, whether the context
+   * has them is only known once a swap makes it current */
+  glFenceSync = (PFNGLFENCESYNCPROC)glXGetProcAddress("glFenceSync");
+  glClientWaitSync = (PFNGLCLIENTWAITSYNCPROC)glXGetProcAddress("glClientWaitSync");
+  glDeleteSync = (PFNGLDELETESYNCPROC)glXGetProcAddress("glDeleteSync");
+}
+
+static bool nvstusb_start_emitter_thread(struct nvstusb_context *ctx);
+static void nvstusb_wake_emitter(struct nvstusb_context *ctx);
+
+/* open the device and make the context usable, returns false on failure */
+static bool
+nvstusb_bring_up(struct nvstusb_context *ctx)
+{
+  struct nvstusb_usb_device *dev = 0;
+
+  /* open the device */
+  dev = nvstusb_usb_open_device(ctx->init_backend, "nvstusb.fw", ctx->init_device);
+
+  if (0 != dev) {
+    nvstusb_usb_set_completion_callback(dev, nvstusb_usb_completed, ctx);
+    nvstusb_probe_sync(ctx);
+
+    /* from here on only the emitter thread talks to the device, it also
+     * programs a rate set in the meantime */
+    ctx->device = dev;
+    if (!nvstusb_start_emitter_thread(ctx)) {
+      nvstusb_usb_set_completion_callback(dev, 0, 0);
+      nvstusb_usb_close_device(dev);
+      ctx->device = dev = 0;
+    }
+  }
+
+  /* publish the result */
+  pthread_mutex_lock(&ctx->init_lock);
+  ctx->t_ready = nvstusb_time_us();
+  atomic_store_explicit(&ctx->init_state, dev ? nvstusb_init_ready : nvstusb_init_failed,
+    memory_order_release);
+  pthread_cond_broadcast(&ctx->init_cond);
+  pthread_mutex_unlock(&ctx->init_lock);
+
+  if (0 != dev) {
+    fprintf(stderr, "nvstusb: Emitter up after %.1f ms\n", (ctx->t_ready - ctx->t_init) / 1000.0);
+  }
+  return 0 != dev;
+}
+
+static void *
+nvstusb_init_thread(void *in_pv_arg)
+{
+  nvstusb_bring_up((struct nvstusb_context *) in_pv_arg);
+  return NULL;
+}
+
+static void nvstusb_free_context(struct nvstusb_context *ctx);
+
+/* initialize controller on a specific usb backend */
+struct nvstusb_context *
+nvstusb_init_backend(const char *backend)
+{
+  return nvstusb_init_device(backend, getenv("NVSTUSB_DEVICE"));
+}
+
+/* initialize a particular controller */
+struct nvstusb_context *
+nvstusb_init_device(const char *backend, const char *device)
+{
+  struct nvstusb_context *ctx = nvstusb_alloc_context(backend, device);
+  if (0 == ctx) return 0;
+
+  if (!nvstusb_bring_up(ctx)) {
+    nvstusb_free_context(ctx);
+    return 0;
+  }
+  return ctx;
+}
+
+/* initialize controller, opening the device on a worker thread */
+struct nvstusb_context *
+nvstusb_init_async(const char *backend)
+{
+  return nvstusb_init_device_async(backend, getenv("NVSTUSB_DEVICE"));
+}
+
+/* initialize a particular controller, opening it on a worker thread */
+struct nvstusb_context *
+nvstusb_init_device_async(const char *backend, const char *device)
+{
+  struct nvstusb_context *ctx = nvstusb_alloc_context(backend ? backend : getenv("NVSTUSB_BACKEND"), device);
+  if (0 == ctx) return 0;
+
+  if (pthread_create(&ctx->init_thread, NULL, nvstusb_init_thread, (void *)ctx) != 0) {
+    fprintf(stderr, "nvstusb: Unable to start init thread, initializing in place\n");
+    nvstusb_bring_up(ctx);
+    return ctx;
+  }
+  ctx->init_thread_running = 1;
   return ctx;
 }
 
+/* list the controllers on a usb backend */
+int
+nvstusb_enumerate(
+    const char *backend,
+    struct nvstusb_device_info *devices,
+    int max
+    ) {
+  assert(devices != 0 || max == 0);
+
+  return nvstusb_usb_enumerate(backend ? backend : getenv("NVSTUSB_BACKEND"), devices, max);
+}
+
+/* state of the bring-up, without waiting */
+int
+nvstusb_init_poll(
+    struct nvstusb_context *ctx
+    ) {
+  assert(ctx != 0);
+
+  return atomic_load_explicit(&ctx->init_state, memory_order_acquire);
+}
+
+/* wait until the bring-up finished */
+int
+nvstusb_init_wait(
+    struct nvstusb_context *ctx
+    ) {
+  assert(ctx != 0);
+
+  int state = atomic_load_explicit(&ctx->init_state, memory_order_acquire);
+  if (state != nvstusb_init_pending) return state;
+
+  pthread_mutex_lock(&ctx->init_lock);
+  while ((state = atomic_load_explicit(&ctx->init_state, memory_order_acquire)) == nvstusb_init_pending) {
+    pthread_cond_wait(&ctx->init_cond, &ctx->init_lock);
+  }
+  pthread_mutex_unlock(&ctx->init_lock);
+  return state;
+}
+
+/* time from init to the first stereo frame */
+unsigned long long
+nvstusb_get_time_to_first_frame(
+    struct nvstusb_context *ctx
+    ) {
+  assert(ctx != 0);
+
+  return ctx->first_frame_us;
+}
+
+/* release what nvstusb_alloc_context() set up */
+static void
+nvstusb_free_context(
+    struct nvstusb_context *ctx
+    ) {
+  pthread_mutex_destroy(&ctx->quad_lock);
+  pthread_mutex_destroy(&ctx->rate_lock);
+  pthread_mutex_destroy(&ctx->init_lock);
+  pthread_cond_destroy(&ctx->init_cond);
+  free(ctx->init_backend);
+  free(ctx->init_device);
+  memset(ctx, 0, sizeof(*ctx));
+  free(ctx);
+}
+
 /* deinitialize controller */
 void
 nvstusb_deinit(
@@ -154,21 +597,84 @@ nvstusb_deinit(
     ) {
   if (0 == ctx) return;
 
-  /* Close thread if running */
-  if(ctx->b_thread_running) {
+  /* Let a bring-up in progress finish first */
+  if (ctx->init_thread_running) {
+    pthread_join(ctx->init_thread, NULL);
+    ctx->init_thread_running = 0;
+  }
+
+  /* Close threads if running */
+  if(atomic_load(&ctx->b_thread_running)) {
     nvstusb_stop_stereo_thread(ctx);
   }
+  if (ctx->emitter_running) {
+    atomic_store(&ctx->emitter_stop, 1);
+    nvstusb_wake_emitter(ctx);
+    pthread_join(ctx->emitter_thread, NULL);
+    ctx->emitter_running = 0;
+  }
 
   /* close device */
-  if (0 != ctx->device) nvstusb_usb_close_device(ctx->device);
+  if (0 != ctx->device) {
+    nvstusb_usb_set_completion_callback(ctx->device, 0, 0);
+    nvstusb_usb_close_device(ctx->device);
+  }
   ctx->device = 0;
 
-  /* close usb */
-  nvstusb_usb_deinit();
-
   /* free context */
-  memset(ctx, 0, sizeof(*ctx));
-  free(ctx);
+  nvstusb_free_context(ctx);
+}
+
+/* timings travel to the emitter thread as one word, the rate's bits above
+ * the active time, so a reprogram is never seen half done. a rate is never
+ * 0, so neither is the word */
+static uint64_t
+nvstusb_pack_timings(
+    const struct nvstusb_timings *timings
+    ) {
+  uint32_t bits;
+  memcpy(&bits, &timings->rate, sizeof(bits));
+  return ((uint64_t) bits << 32) | (uint32_t) timings->active_us;
+}
+
+static void
+nvstusb_unpack_timings(
+    uint64_t packed,
+    struct nvstusb_timings *timings
+    ) {
+  uint32_t bits = packed >> 32;
+  memcpy(&timings->rate, &bits, sizeof(bits));
+  timings->active_us = (int32_t) (packed & 0xffffffff);
+}
+
+/* hand timings to the emitter thread, it programs them once the device is
+ * up if it isn't yet. ones it hasn't got to yet are replaced as a whole */
+static void
+nvstusb_queue_timings(
+    struct nvstusb_context *ctx,
+    const struct nvstusb_timings *timings
+    ) {
+  if (0 != atomic_exchange(&ctx->pending_timings, nvstusb_pack_timings(timings))) {
+    atomic_fetch_add_explicit(&ctx->timings_replaced, 1, memory_order_relaxed);
+  }
+  nvstusb_wake_emitter(ctx);
+}
+
+/* reprogram the emitter timings, never blocks */
+void
+nvstusb_reprogram_timings(
+    struct nvstusb_context *ctx,
+    const struct nvstusb_timings *timings
+    ) {
+  assert(ctx != 0);
+  assert(timings != 0);
+  assert(timings->rate > 60);
+  assert(timings->active_us >= 0);
+
+  /* rate tracking starts over from the new nominal rate */
+  atomic_store(&ctx->nominal_active_us, timings->active_us);
+  atomic_store(&ctx->nominal_rate, timings->rate);
+  nvstusb_queue_timings(ctx, timings);
 }
 
 /* set controller refresh rate (should be monitor refresh rate) */
@@ -177,26 +683,116 @@ nvstusb_set_rate(
     struct nvstusb_context *ctx,
     float rate
     ) {
+  struct nvstusb_timings timings = { rate, 0 };
+  nvstusb_reprogram_timings(ctx, &timings);
+}
+
+/* Register writes gathered into as few transfers as possible. The firmware
+ * takes one command per transfer, so only writes to adjacent registers can
+ * share one; anything else starts the next transfer. Transfers go out
+ * asynchronously, in order, so the emitter thread doesn't wait for the
+ * round trips. */
+struct nvstusb_batch {
+  uint8_t buf[NVSTUSB_USB_ASYNC_MAX_SIZE];
+  int size;               /* 0 = empty */
+  int writes;
+};
+
+/* send the register writes the usb queue was full for, in order. returns
+ * the number still waiting */
+static int
+nvstusb_register_retry(
+    struct nvstusb_context *ctx
+    ) {
+  int sent = 0;
+  while (sent < ctx->register_backlog_count) {
+    int res = nvstusb_usb_write_bulk_async(ctx->device, 2,
+        ctx->register_backlog[sent].buf, ctx->register_backlog[sent].size);
+    if (NVSTUSB_USB_ERROR_BUSY == res) break;
+    if (res < 0) fprintf(stderr, "nvstusb: Register write failed (%d)\n", res);
+    sent++;
+  }
+  ctx->register_backlog_count -= sent;
+  memmove(ctx->register_backlog, ctx->register_backlog + sent,
+      ctx->register_backlog_count * sizeof(ctx->register_backlog[0]));
+  return ctx->register_backlog_count;
+}
+
+static void
+nvstusb_batch_flush(
+    struct nvstusb_context *ctx,
+    struct nvstusb_batch *batch
+    ) {
+  if (0 == batch->size) return;
+
+  /* the queue is shared with the eye commands. if it is full the write waits
+   * for the emitter thread to retry it, behind any older ones */
+  assert(ctx->register_backlog_count < NVSTUSB_REGISTER_BACKLOG);
+  int n = ctx->register_backlog_count++;
+  memcpy(ctx->register_backlog[n].buf, batch->buf, batch->size);
+  ctx->register_backlog[n].size = batch->size;
+  nvstusb_register_retry(ctx);
+
+  atomic_fetch_add_explicit(&ctx->register_transfers, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&ctx->register_saved, batch->writes - 1, memory_order_relaxed);
+  batch->size = 0;
+  batch->writes = 0;
+}
+
+/* write size bytes to register address (0x2007 + address) */
+static void
+nvstusb_batch_write(
+    struct nvstusb_context *ctx,
+    struct nvstusb_batch *batch,
+    uint8_t address,
+    const uint8_t *data,
+    int size
+    ) {
+  assert(4 + size <= NVSTUSB_USB_ASYNC_MAX_SIZE);
+
+  if (0 != batch->size &&
+      (batch->buf[1] + batch->buf[2] != address ||
+       batch->size + size > NVSTUSB_USB_ASYNC_MAX_SIZE)) {
+    nvstusb_batch_flush(ctx, batch);
+  }
+
+  if (0 == batch->size) {
+    batch->buf[0] = NVSTUSB_CMD_WRITE;  /* write data */
+    batch->buf[1] = address;            /* to address 0x2007+address */
+    batch->buf[2] = 0;                  /* n bytes follow */
+    batch->buf[3] = 0;
+    batch->size = 4;
+  }
+  memcpy(batch->buf + batch->size, data, size);
+  batch->size += size;
+  batch->buf[2] += size;
+  batch->writes++;
+}
+
+/* send the timings to the device */
+static void
+nvstusb_program_rate(
+    struct nvstusb_context *ctx,
+    const struct nvstusb_timings *timings
+    ) {
   assert(ctx != 0);
   assert(ctx->device != 0);
-  assert(rate > 60);
+  float rate = timings->rate;
 
   /* send some magic data to device, this function is mainly black magic */
 
   /* some timing voodoo */
   int32_t frameTime   = (1000000.0/rate);     /* 8.33333 ms if 120 Hz */
-  int32_t activeTime  = 2080;                 /* 2.08000 ms time each eye is on*/
+  int32_t activeTime  = timings->active_us ?
+    timings->active_us : 2080;                /* 2.08000 ms time each eye is on*/
 
   int32_t w = NVSTUSB_T2_COUNT(4568.50);      /* 4.56800 ms */
   int32_t x = NVSTUSB_T0_COUNT(4774.25);      /* 4.77425 ms */
   int32_t y = NVSTUSB_T0_COUNT(activeTime);
   int32_t z = NVSTUSB_T2_COUNT(frameTime);    
 
+  /* to address 0x2007 (0x2007+0x00) = ?? */
   uint8_t cmdTimings[] = { 
-    NVSTUSB_CMD_WRITE,      /* write data */
-    0x00,                   /* to address 0x2007 (0x2007+0x00) = ?? */
-    0x18, 0x00,             /* 24 bytes follow */
-
     /* original: e1 29 ff ff (-54815; -55835) */
     w, w>>8, w>>16, w>>24,    /* 2007: ?? some timer 2 counter, 1020 is subtracted from this
                                *       loaded at startup with:
@@ -228,57 +824,66 @@ nvstusb_set_rate(
 
     z, z>>8, z>>16, z>>24     /* 201b: timer 2 reload value */
   }; 
-  nvstusb_usb_write_bulk(ctx->device, 2, cmdTimings, sizeof(cmdTimings));
 
-  uint8_t cmd0x1c[] = {
-    NVSTUSB_CMD_WRITE,      /* write data */
-    0x1c,                   /* to address 0x2023 (0x2007+0x1c) = ?? */
-    0x02, 0x00,             /* 2 bytes follow */
+  /* to address 0x2022 (0x2007+0x1b) = ?? */
+  uint8_t cmd0x1b[] = {
+    0x07                    /* ?? compared with byte at 0x29 in TD_Poll()
+                               bit 0-1: index to a table of 4 bytes at 0x17d4 (0x00,0x08,0x04,0x0C),
+                               PB1 is set in TD_Poll() if this index is 0, cleared otherwise
+                               bit 2:   set bool21_4, start timer 1, enable ext. int. 5
+                               bit 3:   PC1 is set to the inverted value of this bit in TD_Poll()
+                               bit 4-5: index to a table of 4 bytes at 0x2a 
+                               bit 6:   restart t0 on some conditions in TD_Poll()
+                             */
+  };
 
+  /* to address 0x2023 (0x2007+0x1c) = ?? */
+  uint8_t cmd0x1c[] = {
     0x02, 0x00              /* ?? seems to be the start value of some 
                                counter. runs up to 6, some things happen
                                when it is lower, that will stop if when
                                it reaches 6. could be the index to 6 byte values 
                                at 0x17ce that are loaded into TH0*/
   };
-  nvstusb_usb_write_bulk(ctx->device, 2, cmd0x1c, sizeof(cmd0x1c));
 
   /* wait at most 2 seconds before going into idle */
   uint16_t timeout = rate * 4;  
 
+  /* to address 0x2025 (0x2007+0x1e) = timeout */
   uint8_t cmdTimeout[] = {
-    NVSTUSB_CMD_WRITE,      /* write data */
-    0x1e,                   /* to address 0x2025 (0x2007+0x1e) = timeout */
-    0x02, 0x00,             /* 2 bytes follow */
-
     timeout, timeout>>8     /* idle timeout (number of frames) */
   };
-  nvstusb_usb_write_bulk(ctx->device, 2, cmdTimeout, sizeof(cmdTimeout));
 
-  uint8_t cmd0x1b[] = {
-    NVSTUSB_CMD_WRITE,      /* write data */
-    0x1b,                   /* to address 0x2022 (0x2007+0x1b) = ?? */
-    0x01, 0x00,             /* 1 byte follows */
-
-    0x07                    /* ?? compared with byte at 0x29 in TD_Poll()
-                               bit 0-1: index to a table of 4 bytes at 0x17d4 (0x00,0x08,0x04,0x0C),
-                               PB1 is set in TD_Poll() if this index is 0, cleared otherwise
-                               bit 2:   set bool21_4, start timer 1, enable ext. int. 5
-                               bit 3:   PC1 is set to the inverted value of this bit in TD_Poll()
-                               bit 4-5: index to a table of 4 bytes at 0x2a 
-                               bit 6:   restart t0 on some conditions in TD_Poll()
-                             */
-  };
-  nvstusb_usb_write_bulk(ctx->device, 2, cmd0x1b, sizeof(cmd0x1b));
-
-  ctx->rate = rate;
+  /* 0x18-0x1a are the key status the poller reads and clears, so 0x1c and
+   * the timeout share a transfer but not the timings. 0x1b goes last on its
+   * own, as it always has */
+  struct nvstusb_batch batch = { .size = 0, .writes = 0 };
+  nvstusb_batch_write(ctx, &batch, 0x00, cmdTimings, sizeof(cmdTimings));
+  nvstusb_batch_write(ctx, &batch, 0x1c, cmd0x1c, sizeof(cmd0x1c));
+  nvstusb_batch_write(ctx, &batch, 0x1e, cmdTimeout, sizeof(cmdTimeout));
+  nvstusb_batch_flush(ctx, &batch);
+  nvstusb_batch_write(ctx, &batch, 0x1b, cmd0x1b, sizeof(cmd0x1b));
+  nvstusb_batch_flush(ctx, &batch);
+
+  atomic_store(&ctx->rate, rate);
 }
 
 void
 nvstusb_invert_eyes(
     struct nvstusb_context *ctx
     ) {
-  ctx->invert_eyes = !ctx->invert_eyes;
+  atomic_fetch_xor(&ctx->invert_eyes, 1);
+}
+
+/* lead of scheduled eye commands, -1 = measured usb latency */
+void
+nvstusb_set_eye_lead(
+    struct nvstusb_context *ctx,
+    int us
+    ) {
+  assert(ctx != 0);
+
+  atomic_store(&ctx->eye_lead_us, us < 0 ? -1 : us);
 }
 
 /* set currently open eye */
@@ -291,6 +896,7 @@ nvstusb_set_eye(
   assert(ctx->device != 0);
   assert(eye == nvstusb_left || eye == nvstusb_right || eye == nvstusb_quad);
   uint32_t r;
+  float rate = atomic_load(&ctx->rate);
 
   //#define FF_TEST_R
 #ifdef FF_TEST_R
@@ -299,24 +905,24 @@ nvstusb_set_eye(
   static int j = 0;
   static uint32_t r_tmp = NVSTUSB_T2_COUNT(0);;
 
-  if(ctx->toggled3D) {
+  if(atomic_load(&ctx->toggled3D)) {
     r = r_tmp;
   } else {
-    r = NVSTUSB_T2_COUNT((1e6/ctx->rate)/1.8);
+    r = NVSTUSB_T2_COUNT((1e6/rate)/1.8);
   }
 
   if(i%32 == 0) {
-    if(ctx->toggled3D) {
+    if(atomic_load(&ctx->toggled3D)) {
       r_tmp -= 500;
     }
 
-    if(((int)r_tmp) < NVSTUSB_T2_COUNT((1e6/ctx->rate))) {
+    if(((int)r_tmp) < NVSTUSB_T2_COUNT((1e6/rate))) {
       r_tmp = NVSTUSB_T2_COUNT(0);
     }
     printf("r:%08x %d %lld %lld\n",r, r,NVSTUSB_T0_US(r), NVSTUSB_T2_US(r));
   }
 #else
-  r = NVSTUSB_T2_COUNT((1e6/ctx->rate)/1.8);
+  r = NVSTUSB_T2_COUNT((1e6/rate)/1.8);
 #endif
 
   switch(eye) {
@@ -325,136 +931,775 @@ nvstusb_set_eye(
     {
       uint8_t buf[8] = { 
         NVSTUSB_CMD_SET_EYE,      /* set shutter state */
-        ((eye==nvstusb_right)^(ctx->invert_eyes))?0xFE:0xFF,        /* eye selection */
+        ((eye==nvstusb_right)^atomic_load(&ctx->invert_eyes))?0xFE:0xFF,        /* eye selection */
         0x00, 0x00,               /* unused */
         r, r>>8, r>>16, r>>24
       };
-      nvstusb_usb_write_bulk(ctx->device, 1, buf, 8);		
+      /* don't wait for the device, the render thread is between vblank and swap */
+      uint64_t t = nvstusb_time_us();
+      nvstusb_usb_write_bulk_async(ctx->device, 1, buf, 8);
+      nvstusb_telemetry_lap(&ctx->telemetry, nvstusb_timing_eye_submit, t);
+      atomic_fetch_add_explicit(&ctx->eye_transfers, 1, memory_order_relaxed);
     }
     break;
   case nvstusb_quad:
     {
-      nvstusb_set_eye(ctx, nvstusb_right);
+      /* the emitter switches to the right eye a period later by itself, a
+       * right eye command first would only be overridden */
       nvstusb_set_eye(ctx, nvstusb_left);
+      atomic_fetch_add_explicit(&ctx->eye_saved, 1, memory_order_relaxed);
     }
     break;
   }
 }
 
 
-/* perform swap and toggle eyes hopefully with correct timing */
-void
-nvstusb_swap(
-    struct nvstusb_context *ctx,
-    enum nvstusb_eye eye,
-    void (*swapfunc)()
+/* convert monotonic microseconds to a timespec */
+static struct timespec
+nvstusb_timespec(
+    uint64_t us
     ) {
-  assert(ctx != 0);
-  assert(ctx->device != 0);
-  assert(eye == nvstusb_left || eye == nvstusb_right || eye == nvstusb_quad);
-
-  /* if we have the GLX_SGI_video_sync extension, we just wait
-   * for vertical blanking, then issue swap. */
-  switch(ctx->vblank_method) {
-  case 0:
-    {
-      /* Swap buffers */
-      if(swapfunc) {
-        swapfunc();
-      }
-
-      /* Sw Vsync method: read from front buffer.
-       * this operation can only finish after swapping is complete. 
-       * (seems like it won't work if page flipping is disabled) */
-      uint8_t pixels[4] = { 255, 0, 255, 255 };
-      glReadBuffer(GL_FRONT);
-      glReadPixels(1,1,1,1,GL_RGB, GL_UNSIGNED_BYTE, pixels);
-      nvstusb_set_eye(ctx, eye);
-    }
-    break;
-  case 1:
-    {
-      unsigned int count;
-
-
-      if(eye == nvstusb_quad) {
-        int before_count;
-        /* Waiting OpenGL sync, Do not use current count to */
-        /* prevent eyes from being inverted */
-        glXGetVideoSyncSGI(&count);
-        glXWaitVideoSyncSGI(2, 0, &count);
-
-      } else {
-        /* Waiting OpenGL sync */
-        glXGetVideoSyncSGI(&count);
-        glXWaitVideoSyncSGI(2, (count+1)%2, &count);
-      }
-
-      /* Change eye */
-      nvstusb_set_eye(ctx, eye);
+  struct timespec ts;
+  ts.tv_sec = us / 1000000;
+  ts.tv_nsec = (us % 1000000) * 1000;
+  return ts;
+}
 
-      /* Swap buffers */
-      if(swapfunc) {
-        swapfunc();
-      }
-    }
-    break;
-  case 2:
-    {
-      /* case __GL_SYNC_TO_VBLANK is defined */
+/* tell the emitter thread something changed for it, after the change. it
+ * looks again before it goes to sleep, or wakes up if it already sleeps */
+static void
+nvstusb_wake_emitter(
+    struct nvstusb_context *ctx
+    ) {
+  atomic_fetch_add(&ctx->wake_seq, 1);
+  syscall(SYS_futex, &ctx->wake_seq, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, 1, NULL, NULL, 0);
+}
 
-      /* Swap buffers */
-      if(swapfunc) {
-        swapfunc();
-      }
+/* hand an eye command to the emitter thread, to be sent at deadline. never
+ * blocks; only one thread may post: the one calling nvstusb_swap(), or the
+ * stereo thread while it runs (see stereo_posts) */
+static void
+nvstusb_post_eye(
+    struct nvstusb_context *ctx,
+    enum nvstusb_eye eye,
+    uint64_t deadline
+    ) {
+  struct nvstusb_eye_event event;
+  event.submit_us = nvstusb_time_us();
+  event.deadline_us = deadline;
+  event.eye = eye;
+
+  if (!nvstusb_ring_push(&ctx->ring, &event)) {
+    atomic_fetch_add_explicit(&ctx->dropped_events, 1, memory_order_relaxed);
+    return;
+  }
 
-      /* Change eye */
-      nvstusb_set_eye(ctx, eye);
-    }
-    break;
-  case 3:
-    {
-      static int i_current_interval = -1;
-      int i_interval;
-      if(eye == nvstusb_quad) {
-        i_interval = 2;
-      } else {
-        i_interval = 1;
-      }
+  /* like nvstusb_wake_emitter(), but only a sleeping emitter thread costs a
+   * syscall. the increment and the load pair with the emitter thread's store
+   * and fence before it goes to sleep, one of the two sees the other's store */
+  atomic_fetch_add(&ctx->wake_seq, 1);
+  if (atomic_load(&ctx->emitter_waiting)) {
+    syscall(SYS_futex, &ctx->wake_seq, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, 1, NULL, NULL, 0);
+  }
+}
 
-      /* Swap interval */
-      if(i_current_interval != i_interval) {
-        glXSwapIntervalSGI(i_interval);
-        i_current_interval = i_interval;
-      }
+/* Retune the emitter's frame timer when the predictor finds the display
+ * running at another rate than the emitter was programmed for */
+static void
+nvstusb_track_rate(
+    struct nvstusb_context *ctx,
+    int64_t msc,
+    uint64_t t
+    ) {
+  struct nvstusb_ratetrack *rt = &ctx->ratetrack;
+  double before = rt->programmed_us;
+  double period = nvstusb_ratetrack_update(rt, msc, t,
+    atomic_load_explicit(&ctx->rate_track_ppm, memory_order_relaxed));
+
+  pthread_mutex_lock(&ctx->rate_lock);
+  ctx->measured_period_us = rt->period_us;
+  if (period > 0) {
+    struct nvstusb_rate_correction *c = &ctx->corrections[ctx->correction_count % NVSTUSB_RATE_HISTORY];
+    c->time_us = t - ctx->t_init;
+    c->from_hz = 1e6 / before;
+    c->to_hz = 1e6 / period;
+    ctx->correction_count++;
+  }
+  pthread_mutex_unlock(&ctx->rate_lock);
 
-      /* Swap buffers */
-      if(swapfunc) {
-        swapfunc();
-      }
+  if (period > 0) {
+    struct nvstusb_timings timings = { 1e6 / period, atomic_load(&ctx->nominal_active_us) };
+    fprintf(stderr, "nvstusb: display runs at %.4f Hz, retuning the emitter from %.4f Hz\n",
+      1e6 / period, 1e6 / before);
+    nvstusb_queue_timings(ctx, &timings);
+  }
+}
 
-      /* Change eye */
-      nvstusb_set_eye(ctx, eye);
+/* Feed the vblank predictor with the swap that just completed at now */
+static void
+nvstusb_observe_vblank(
+    struct nvstusb_context *ctx,
+    uint64_t now
+    ) {
+  struct nvstusb_vblank *vb = &ctx->vblank;
+  int64_t error = 0;
+  uint64_t t = now;
+  int observed = 0;
+
+  /* start predicting and tracking over when the app set another rate, the
+   * counter starts over with it. retuning the emitter doesn't count */
+  float rate = atomic_load(&ctx->nominal_rate);
+  if (rate > 0 && rate != ctx->vblank_rate) {
+    nvstusb_vblank_init(vb, 1e6 / rate);
+    nvstusb_eyeseq_init(&ctx->eyeseq);
+    nvstusb_ratetrack_init(&ctx->ratetrack, 1e6 / rate);
+    ctx->vblank_rate = rate;
+  }
 
+  if (ctx->oml_ok) {
+    int64_t ust = 0, msc = 0, sbc = 0;
+    Display *dpy = glXGetCurrentDisplay();
+    if (NULL != dpy &&
+        glXGetSyncValuesOML(dpy, glXGetCurrentDrawable(), &ust, &msc, &sbc) &&
+        ust > 0 && llabs(ust - (int64_t)now) < 1000000) {
+      error = nvstusb_vblank_observe_msc(vb, ust, msc);
+      t = ust;
+      observed = 1;
+    } else {
+      /* not supported by this drawable or not on our clock */
+      fprintf(stderr, "nvstusb: no usable OML sync values, predicting vblanks from swaps\n");
+      ctx->oml_ok = 0;
+      nvstusb_eyeseq_init(&ctx->eyeseq);
     }
-    break;
-  default:
-    fprintf(stderr, "nvstusb: unknown vblank method\n");
   }
+  if (!observed) {
+    error = nvstusb_vblank_observe_swap(vb, now);
+  }
+  if (vb->samples > 1) {
+    nvstusb_telemetry_record(&ctx->telemetry, nvstusb_timing_vblank_error, llabs(error));
+    nvstusb_track_rate(ctx, vb->base_msc, t);
+  }
+}
 
+/* how long before its vblank an eye command has to be sent */
+static uint64_t
+nvstusb_eye_lead(
+    struct nvstusb_context *ctx
+    ) {
+  int lead_us = atomic_load_explicit(&ctx->eye_lead_us, memory_order_relaxed);
+  if (lead_us >= 0) return lead_us;
 
-
+  uint64_t lead = atomic_load_explicit(&ctx->usb_latency_us, memory_order_relaxed);
+  return (0 == lead) ? NVSTUSB_DEFAULT_EYE_LEAD_US : lead;
 }
 
-/* get key status from controller */
+/* Check the eye of the frame just swapped against the vblank counter the
+ * predictor saw it flip on, frames is 1 unless older swaps completed along
+ * with it. Returns 1 when a skipped refresh or a lost frame
+ * moved the app's eyes to the other vblank parity; the shutters, which
+ * toggle on every refresh, are out of step until the next eye command. */
+static int
+nvstusb_check_eye(
+    struct nvstusb_context *ctx,
+    enum nvstusb_eye eye,
+    int frames
+    ) {
+  struct nvstusb_telemetry *tel = &ctx->telemetry;
+  struct nvstusb_eyeseq_result r;
+
+  nvstusb_eyeseq_observe(&ctx->eyeseq, ctx->vblank.base_msc, eye == nvstusb_right, frames, &r);
+  if (r.dropped > 0) {
+    atomic_fetch_add_explicit(&tel->dropped_frames, r.dropped, memory_order_relaxed);
+  }
+  if (r.duplicated) {
+    atomic_fetch_add_explicit(&tel->duplicated_frames, 1, memory_order_relaxed);
+  }
+  if (r.resync) {
+    atomic_fetch_add_explicit(&tel->eye_resyncs, 1, memory_order_relaxed);
+  }
+  return r.resync;
+}
+
+/* Predict the flip of the frame just swapped and have the emitter thread
+ * send its eye command so that it reaches the emitter at the vblank before
+ * the flip, which is where the blocking methods send it too. With a swap
+ * that blocks until the previous flip that deadline is now, so the command
+ * goes out right away; if the driver queued the frame it is held back
+ * instead of switching the eye early. The swap has to be observed first. */
+static void
+nvstusb_schedule_eye(
+    struct nvstusb_context *ctx,
+    enum nvstusb_eye eye,
+    uint64_t now
+    ) {
+  struct nvstusb_vblank *vb = &ctx->vblank;
+  uint64_t flip = nvstusb_vblank_next(vb, now);
+  uint64_t lead = nvstusb_eye_lead(ctx);
+
+  uint64_t deadline = now;
+  if (0 != flip && flip > vb->period_us + lead + now) {
+    deadline = flip - (uint64_t) vb->period_us - lead;
+  }
+
+  nvstusb_post_eye(ctx, eye, deadline);
+}
+
+/* the first vblank after t that scans out the left eye, they come every
+ * other refresh starting at left */
+static uint64_t
+nvstusb_next_left(
+    uint64_t left,
+    double period_us,
+    uint64_t t
+    ) {
+  double pair = 2 * period_us;
+  double n = (t < left) ? 0 : floor((t - left) / pair) + 1;
+  return left + (uint64_t) (n * pair);
+}
+
+/* swap on every vblank from here on, where the extension is there */
+static void
+nvstusb_set_swap_interval(
+    struct nvstusb_context *ctx
+    ) {
+  if (!ctx->swap_interval_set) {
+    if (NULL != glXSwapIntervalSGI) glXSwapIntervalSGI(1);
+    ctx->swap_interval_set = 1;
+  }
+}
+
+/* Quad buffered swap: both eyes flip at once and the display scans them out
+ * on alternating vblanks, left first. Only the left eye needs a command, the
+ * emitter switches to the right one on its own a period later. */
+static void
+nvstusb_swap_quad(
+    struct nvstusb_context *ctx,
+    void (*swapfunc)()
+    ) {
+  struct nvstusb_telemetry *tel = &ctx->telemetry;
+  uint64_t t = nvstusb_time_us();
+
+  nvstusb_set_swap_interval(ctx);
+
+  if(swapfunc) {
+    swapfunc();
+  }
+  t = nvstusb_telemetry_lap(tel, nvstusb_timing_swap, t);
+
+  /* the swap returns at the flip, which is the left eye's vblank */
+  nvstusb_observe_vblank(ctx, t);
+  uint64_t left = (uint64_t) ctx->vblank.base_us;
+  double period = ctx->vblank.period_us;
+
+  /* the stereo thread takes it from here if it runs */
+  pthread_mutex_lock(&ctx->quad_lock);
+  ctx->quad_left_us = left;
+  ctx->quad_period_us = period;
+  if (!ctx->stereo_posts) {
+    uint64_t lead = nvstusb_eye_lead(ctx);
+    uint64_t deadline = nvstusb_next_left(left, period, t + lead) - lead;
+    nvstusb_post_eye(ctx, nvstusb_quad, deadline);
+  }
+  pthread_mutex_unlock(&ctx->quad_lock);
+}
+
+/* whether the current context has GL_ARB_sync (core since 3.2) */
+static int
+nvstusb_fences_supported(void)
+{
+  if (NULL == glFenceSync || NULL == glClientWaitSync || NULL == glDeleteSync) return 0;
+
+  int major = 0, minor = 0;
+  const char *version = (const char *) glGetString(GL_VERSION);
+  if (NULL != version) sscanf(version, "%d.%d", &major, &minor);
+  if (major > 3 || (major == 3 && minor >= 2)) return 1;
+
+  const char *extensions = (const char *) glGetString(GL_EXTENSIONS);
+  return NULL != extensions && NULL != strstr(extensions, "GL_ARB_sync");
+}
+
+/* Sw Vsync method: read from front buffer.
+ * this operation can only finish after swapping is complete. 
+ * (seems like it won't work if page flipping is disabled) */
+static void
+nvstusb_read_front_buffer(void)
+{
+  uint8_t pixels[4] = { 255, 0, 255, 255 };
+  glReadBuffer(GL_FRONT);
+  glReadPixels(1,1,1,1,GL_RGB, GL_UNSIGNED_BYTE, pixels);
+}
+
+/* The oldest swap in flight completed, returns its eye */
+static enum nvstusb_eye
+nvstusb_retire_fence(
+    struct nvstusb_context *ctx
+    ) {
+  struct nvstusb_fence *fence = &ctx->fences[ctx->fence_head];
+
+  glDeleteSync(fence->sync);
+  ctx->fence_head = (ctx->fence_head + 1) % (NVSTUSB_MAX_RENDER_AHEAD + 1);
+  ctx->fence_count--;
+  return fence->eye;
+}
+
+/* Send the eye command of the swaps that completed and block until no more
+ * than depth are in flight. The swaps found complete together are seen as
+ * one vblank observation, only the newest one's eye is sent. */
+static void
+nvstusb_complete_fences(
+    struct nvstusb_context *ctx,
+    int depth
+    ) {
+  enum nvstusb_eye eye = nvstusb_left;
+  int retired = 0;
+
+  while (ctx->fence_count > 0) {
+    int block = ctx->fence_count > depth;
+    GLenum result = glClientWaitSync(ctx->fences[ctx->fence_head].sync,
+      GL_SYNC_FLUSH_COMMANDS_BIT, block ? NVSTUSB_FENCE_TIMEOUT_NS : 0);
+
+    if (GL_WAIT_FAILED == result) {
+      /* no fences on this context after all (or it is gone), read the front
+       * buffer from now on. the swaps in flight are dropped, but the newest
+       * one is the current frame and still gets its eye command once the
+       * front buffer read says it is through */
+      fprintf(stderr, "nvstusb: waiting for a swap fence failed, reading the front buffer instead\n");
+      ctx->fence_ok = 0;
+      eye = ctx->fences[(ctx->fence_head + ctx->fence_count - 1) %
+        (NVSTUSB_MAX_RENDER_AHEAD + 1)].eye;
+      while (ctx->fence_count > 0) nvstusb_retire_fence(ctx);
+
+      nvstusb_read_front_buffer();
+      uint64_t now = nvstusb_time_us();
+      nvstusb_observe_vblank(ctx, now);
+      nvstusb_check_eye(ctx, eye, 1);
+      nvstusb_post_eye(ctx, eye, now);
+      return;
+    }
+    if (GL_TIMEOUT_EXPIRED == result && !block) break;
+
+    /* a fence that timed out is retired too, the eye command is late but
+     * the GPU won't stall every swap from here on */
+    eye = nvstusb_retire_fence(ctx);
+    retired++;
+  }
+  if (0 == retired) return;
+
+  uint64_t now = nvstusb_time_us();
+  nvstusb_observe_vblank(ctx, now);
+  nvstusb_check_eye(ctx, eye, retired);
+  nvstusb_post_eye(ctx, eye, now);
+}
+
+/* readback: find out from the GPU when it is through the swap */
+static int
+nvstusb_sync_readback_available(
+    struct nvstusb_context *ctx
+    ) {
+  return 1;
+}
+
+static void
+nvstusb_sync_readback_init(
+    struct nvstusb_context *ctx
+    ) {
+  if (ctx->fence_ok < 0) {
+    ctx->fence_ok = nvstusb_fences_supported();
+    fprintf(stderr, "nvstusb: waiting for swaps with %s\n",
+      ctx->fence_ok ? "GL_ARB_sync fences" : "front buffer reads");
+  }
+}
+
+static void
+nvstusb_sync_readback_swap(
+    struct nvstusb_context *ctx,
+    enum nvstusb_eye eye,
+    void (*swapfunc)()
+    ) {
+  struct nvstusb_telemetry *tel = &ctx->telemetry;
+  uint64_t t = nvstusb_time_us();
+
+  /* Swap buffers */
+  if(swapfunc) {
+    swapfunc();
+  }
+  t = nvstusb_telemetry_lap(tel, nvstusb_timing_swap, t);
+
+  /* the fence signals once the GPU is through the swap, like the front
+   * buffer read below returns, but nothing is drained and the GPU may run
+   * up to the render-ahead depth of swaps behind. the eye command goes out
+   * when the fence signals */
+  if (ctx->fence_ok) {
+    int i = (ctx->fence_head + ctx->fence_count) % (NVSTUSB_MAX_RENDER_AHEAD + 1);
+    ctx->fences[i].sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    ctx->fences[i].eye = eye;
+    ctx->fence_count++;
+    glFlush();
+
+    nvstusb_complete_fences(ctx, atomic_load(&ctx->render_ahead));
+    nvstusb_telemetry_lap(tel, nvstusb_timing_vblank_wait, t);
+    return;
+  }
+
+  /* otherwise wait for the swap by reading the front buffer */
+  nvstusb_read_front_buffer();
+  t = nvstusb_telemetry_lap(tel, nvstusb_timing_vblank_wait, t);
+  nvstusb_observe_vblank(ctx, t);
+  nvstusb_check_eye(ctx, eye, 1);
+  nvstusb_post_eye(ctx, eye, nvstusb_time_us());
+}
+
+/* the swaps still in flight get their eye commands before another strategy
+ * takes over */
+static void
+nvstusb_sync_readback_teardown(
+    struct nvstusb_context *ctx
+    ) {
+  if (ctx->fence_ok > 0) nvstusb_complete_fences(ctx, 0);
+}
+
+/* video_sync: with the GLX_SGI_video_sync extension, we just wait for
+ * vertical blanking, then issue swap */
+static int
+nvstusb_sync_video_sync_available(
+    struct nvstusb_context *ctx
+    ) {
+  return NULL != glXGetVideoSyncSGI;
+}
+
+static void
+nvstusb_sync_video_sync_swap(
+    struct nvstusb_context *ctx,
+    enum nvstusb_eye eye,
+    void (*swapfunc)()
+    ) {
+  struct nvstusb_telemetry *tel = &ctx->telemetry;
+  uint64_t t = nvstusb_time_us();
+  unsigned int count;
+
+  /* Waiting OpenGL sync */
+  glXGetVideoSyncSGI(&count);
+  glXWaitVideoSyncSGI(2, (count+1)%2, &count);
+  t = nvstusb_telemetry_lap(tel, nvstusb_timing_vblank_wait, t);
+
+  /* Change eye */
+  nvstusb_post_eye(ctx, eye, nvstusb_time_us());
+
+  /* Swap buffers */
+  t = nvstusb_time_us();
+  if(swapfunc) {
+    swapfunc();
+  }
+  t = nvstusb_telemetry_lap(tel, nvstusb_timing_swap, t);
+
+  /* the command went out at the vblank already, which keeps the shutters in
+   * step whatever the check finds */
+  nvstusb_observe_vblank(ctx, t);
+  nvstusb_check_eye(ctx, eye, 1);
+}
+
+/* driver: __GL_SYNC_TO_VBLANK is defined, the driver syncs the swap and
+ * nothing is attempted on the application side */
+static int
+nvstusb_sync_driver_available(
+    struct nvstusb_context *ctx
+    ) {
+  return NULL != getenv("__GL_SYNC_TO_VBLANK");
+}
+
+/* swap_interval: force vsync and send the eye command after the swap */
+static int
+nvstusb_sync_swap_interval_available(
+    struct nvstusb_context *ctx
+    ) {
+  return NULL != glXSwapIntervalSGI;
+}
+
+/* both of them swap, then change the eye */
+static void
+nvstusb_sync_vsynced_swap(
+    struct nvstusb_context *ctx,
+    enum nvstusb_eye eye,
+    void (*swapfunc)()
+    ) {
+  struct nvstusb_telemetry *tel = &ctx->telemetry;
+  uint64_t t = nvstusb_time_us();
+
+  /* Swap buffers */
+  if(swapfunc) {
+    swapfunc();
+  }
+  t = nvstusb_telemetry_lap(tel, nvstusb_timing_swap, t);
+  nvstusb_observe_vblank(ctx, t);
+  nvstusb_check_eye(ctx, eye, 1);
+
+  /* Change eye */
+  nvstusb_post_eye(ctx, eye, nvstusb_time_us());
+}
+
+/* scheduled: vblank timestamps (or a forced vsync to predict from), the eye
+ * command is scheduled for the predicted flip */
+static int
+nvstusb_sync_scheduled_available(
+    struct nvstusb_context *ctx
+    ) {
+  return ctx->oml_ok || NULL != glXSwapIntervalSGI;
+}
+
+static void
+nvstusb_sync_scheduled_swap(
+    struct nvstusb_context *ctx,
+    enum nvstusb_eye eye,
+    void (*swapfunc)()
+    ) {
+  struct nvstusb_telemetry *tel = &ctx->telemetry;
+  uint64_t t = nvstusb_time_us();
+
+  if(swapfunc) {
+    swapfunc();
+  }
+  t = nvstusb_telemetry_lap(tel, nvstusb_timing_swap, t);
+  nvstusb_observe_vblank(ctx, t);
+
+  /* out of step, don't leave the shutters wrong until the predicted flip */
+  if (nvstusb_check_eye(ctx, eye, 1)) {
+    nvstusb_post_eye(ctx, eye, t);
+  } else {
+    nvstusb_schedule_eye(ctx, eye, t);
+  }
+}
+
+/* in the order they are calibrated in, the ones that set a swap interval
+ * last since it can't be taken back (and a tie goes to the later one) */
+static const struct nvstusb_sync_strategy nvstusb_sync_strategies[NVSTUSB_SYNC_COUNT] = {
+  { "readback", 0, nvstusb_sync_readback_available, nvstusb_sync_readback_init,
+    nvstusb_sync_readback_swap, nvstusb_sync_readback_teardown },
+  { "video_sync", 1, nvstusb_sync_video_sync_available, 0,
+    nvstusb_sync_video_sync_swap, 0 },
+  { "driver", 2, nvstusb_sync_driver_available, 0,
+    nvstusb_sync_vsynced_swap, 0 },
+  { "swap_interval", 3, nvstusb_sync_swap_interval_available, nvstusb_set_swap_interval,
+    nvstusb_sync_vsynced_swap, 0 },
+  { "scheduled", 4, nvstusb_sync_scheduled_available, nvstusb_set_swap_interval,
+    nvstusb_sync_scheduled_swap, 0 },
+};
+
+/* index of a sync strategy, -1 if there is none of that name */
+static int
+nvstusb_find_sync(
+    const char *name
+    ) {
+  int i;
+
+  for (i = 0; i < NVSTUSB_SYNC_COUNT; i++) {
+    if (0 == strcmp(nvstusb_sync_strategies[i].name, name)) return i;
+  }
+  return -1;
+}
+
+/* the strategy the environment asks for, NVSTUSB_SYNC_CALIBRATE if none */
+static int
+nvstusb_sync_from_env(void)
+{
+  int i;
+
+  /* NVIDIA VBlank syncing environment variable defined, signal it and
+   * disable any attempt to application side method */
+  if (getenv ("__GL_SYNC_TO_VBLANK"))
+  {
+    fprintf (stderr, "__GL_SYNC_TO_VBLANK defined in environment\n");
+    return nvstusb_find_sync("driver");
+  }
+
+  const char *name = getenv("NVSTUSB_SYNC");
+  if (NULL != name && 0 != strcmp(name, "auto")) {
+    i = nvstusb_find_sync(name);
+    if (i >= 0) return i;
+    fprintf(stderr, "nvstusb: unknown sync strategy %s, calibrating\n", name);
+  }
+
+  /* the vblank methods of old, by number */
+  if (getenv("NVSTUSB_VBLANK_METHOD")) {
+    int method = atoi(getenv("NVSTUSB_VBLANK_METHOD"));
+    for (i = 0; i < NVSTUSB_SYNC_COUNT; i++) {
+      if (nvstusb_sync_strategies[i].method == method) return i;
+    }
+  }
+  return NVSTUSB_SYNC_CALIBRATE;
+}
+
+/* give up the strategy in use and take up strategy i */
+static void
+nvstusb_use_sync(
+    struct nvstusb_context *ctx,
+    int i
+    ) {
+  const struct nvstusb_sync_strategy *sync = &nvstusb_sync_strategies[i];
+
+  if (ctx->sync == sync) return;
+  if (0 != ctx->sync && 0 != ctx->sync->teardown) ctx->sync->teardown(ctx);
+  ctx->sync = sync;
+  if (0 != sync->init) sync->init(ctx);
+}
+
+/* put the next available strategy after the current trial on trial, returns
+ * false when all were */
+static bool
+nvstusb_next_trial(
+    struct nvstusb_context *ctx
+    ) {
+  for (ctx->trial++; ctx->trial < NVSTUSB_SYNC_COUNT; ctx->trial++) {
+    const struct nvstusb_sync_strategy *sync = &nvstusb_sync_strategies[ctx->trial];
+    if (!sync->available(ctx)) continue;
+
+    struct nvstusb_sync_result *r = &ctx->calibration[ctx->calibration_count];
+    memset(r, 0, sizeof(*r));
+    r->strategy = sync->name;
+    ctx->trial_frames = 0;
+    nvstusb_use_sync(ctx, ctx->trial);
+    return true;
+  }
+  ctx->trial = -1;
+  return false;
+}
+
+/* Take up the strategy asked for since the previous swap */
+static void
+nvstusb_update_sync(
+    struct nvstusb_context *ctx
+    ) {
+  int request = atomic_exchange(&ctx->sync_request, NVSTUSB_SYNC_KEEP);
+
+  if (request >= 0 && !nvstusb_sync_strategies[request].available(ctx)) {
+    fprintf(stderr, "nvstusb: sync strategy %s isn't available\n", nvstusb_sync_strategies[request].name);
+    request = (0 != ctx->sync) ? NVSTUSB_SYNC_KEEP : NVSTUSB_SYNC_CALIBRATE;
+  }
+
+  if (NVSTUSB_SYNC_CALIBRATE == request) {
+    /* readback is always there, so something gets measured */
+    ctx->trial = -1;
+    ctx->calibration_count = 0;
+    nvstusb_next_trial(ctx);
+  } else if (request >= 0) {
+    ctx->trial = -1;
+    nvstusb_use_sync(ctx, request);
+    fprintf(stderr, "nvstusb: using sync strategy %s\n", ctx->sync->name);
+  }
+}
+
+/* Score a calibration trial's frame: how long the swap blocked and how long
+ * it was since the previous one. Once every strategy had its frames the one
+ * with the fewest missed frames, then the least jitter and stall wins. */
+static void
+nvstusb_calibrate(
+    struct nvstusb_context *ctx,
+    uint64_t stall,
+    uint64_t interval
+    ) {
+  if (ctx->trial < 0) return;
+  if (++ctx->trial_frames <= NVSTUSB_CALIBRATION_SETTLE || 0 == interval) return;
+
+  struct nvstusb_sync_result *r = &ctx->calibration[ctx->calibration_count];
+  double period = ctx->vblank.period_us;
+  r->frames++;
+  if (interval > 1.5 * period) r->missed++;
+  r->jitter_us += fabs(interval - period);
+  r->stall_us += stall;
+  if (r->frames < NVSTUSB_CALIBRATION_FRAMES) return;
+
+  r->jitter_us /= r->frames;
+  r->stall_us /= r->frames;
+  fprintf(stderr, "nvstusb: sync %-13s missed %2u/%u  jitter %7.1f us  stall %7.1f us\n",
+    r->strategy, r->missed, r->frames, r->jitter_us, r->stall_us);
+  ctx->calibration_count++;
+  if (nvstusb_next_trial(ctx)) return;
+
+  /* a missed frame weighs ten refreshes of jitter, blocking in the swap is
+   * only a quarter as bad as jitter since the app can't overlap it */
+  int i, best = 0;
+  double best_score = 0;
+  for (i = 0; i < ctx->calibration_count; i++) {
+    const struct nvstusb_sync_result *c = &ctx->calibration[i];
+    double score = 10.0 * period * c->missed / c->frames + c->jitter_us + c->stall_us / 4;
+    if (0 == i || score <= best_score) {
+      best = i;
+      best_score = score;
+    }
+  }
+  nvstusb_use_sync(ctx, nvstusb_find_sync(ctx->calibration[best].strategy));
+  fprintf(stderr, "nvstusb: using sync strategy %s (calibrated)\n", ctx->sync->name);
+}
+
+/* perform swap and toggle eyes hopefully with correct timing */
 void
-nvstusb_get_keys(
+nvstusb_swap(
     struct nvstusb_context *ctx,
-    struct nvstusb_keys *keys
+    enum nvstusb_eye eye,
+    void (*swapfunc)()
     ) {
-  assert(ctx  != 0);
-  assert(keys != 0);
+  assert(ctx != 0);
+  assert(eye == nvstusb_left || eye == nvstusb_right || eye == nvstusb_quad);
+
+  /* the first swap is where the app waits for the emitter to come up, if it
+   * never does just swap so the app keeps running */
+  if (nvstusb_init_wait(ctx) != nvstusb_init_ready) {
+    if (swapfunc) {
+      swapfunc();
+    }
+    return;
+  }
+  assert(ctx->device != 0);
+
+  struct nvstusb_telemetry *tel = &ctx->telemetry;
+  uint64_t t = nvstusb_time_us();
+
+  if (eye == nvstusb_quad) {
+    nvstusb_swap_quad(ctx, swapfunc);
+  } else {
+    nvstusb_update_sync(ctx);
+    ctx->sync->swap(ctx, eye, swapfunc);
+  }
+
+  /* frame interval and missed vblanks, a quad buffered swap covers two
+   * refreshes */
+  uint64_t now = nvstusb_time_us();
+  uint64_t interval = 0;
+  if (0 != tel->last_swap) {
+    interval = now - tel->last_swap;
+    nvstusb_telemetry_record(tel, nvstusb_timing_frame, interval);
+    float rate = atomic_load_explicit(&ctx->rate, memory_order_relaxed);
+    if (rate > 0) {
+      double expected = 1e6 / rate * ((eye == nvstusb_quad) ? 2 : 1);
+      if (interval > 1.5 * expected) {
+        atomic_fetch_add_explicit(&tel->missed_vblanks,
+          (uint64_t)(interval / expected + 0.5) - 1, memory_order_relaxed);
+      }
+    }
+  }
+  tel->last_swap = now;
+
+  if (eye != nvstusb_quad) {
+    nvstusb_calibrate(ctx, now - t, interval);
+  }
 
+  if (0 == ctx->first_frame_us) {
+    ctx->first_frame_us = now - ctx->t_init;
+    fprintf(stderr, "nvstusb: First stereo frame %.1f ms after init\n", ctx->first_frame_us / 1000.0);
+  }
+
+  if (0 != tel->dump_interval && now - tel->last_dump >= tel->dump_interval) {
+    nvstusb_telemetry_print(tel);
+    tel->last_dump = now;
+  }
+}
+
+/* read key status from controller, blocks on the device */
+static void
+nvstusb_read_keys(
+    struct nvstusb_context *ctx,
+    struct nvstusb_keys *keys
+    ) {
+  uint64_t t = nvstusb_time_us();
   uint8_t cmd1[] = { 
     NVSTUSB_CMD_READ |      /* read and clear data */
       NVSTUSB_CMD_CLEAR,
@@ -465,6 +1710,7 @@ nvstusb_get_keys(
   nvstusb_usb_write_bulk(ctx->device, 2, cmd1, sizeof(cmd1));
 
   uint8_t readBuf[4+cmd1[2]];
+  memset(readBuf, 0, sizeof(readBuf));
   nvstusb_usb_read_bulk(ctx->device, 4, readBuf, sizeof(readBuf));
 
   /* readBuf[0] contains the offset (0x18),
@@ -489,140 +1735,503 @@ nvstusb_get_keys(
    */
   keys->toggled3D  = readBuf[6] & 0x01; 
 
-  if(keys->toggled3D) {
-    ctx->toggled3D = !ctx->toggled3D;
-  } 
+  nvstusb_telemetry_lap(&ctx->telemetry, nvstusb_timing_key_poll, t);
+}
+
+/* clamp an accumulated wheel delta to what fits in nvstusb_keys */
+static char
+nvstusb_clamp_wheel(
+    int delta
+    ) {
+  if (delta > 127) return 127;
+  if (delta < -128) return -128;
+  return delta;
+}
+
+/* get key status from controller */
+void
+nvstusb_get_keys(
+    struct nvstusb_context *ctx,
+    struct nvstusb_keys *keys
+    ) {
+  assert(ctx  != 0);
+  assert(keys != 0);
+
+  /* the emitter thread polls the device, just take what it accumulated
+   * since the last call */
+  keys->deltaWheel = nvstusb_clamp_wheel(atomic_exchange(&ctx->acc_wheel, 0));
+  keys->pressedDeltaWheel = nvstusb_clamp_wheel(atomic_exchange(&ctx->acc_pressed_wheel, 0));
+  keys->toggled3D = atomic_exchange(&ctx->acc_toggled3D, 0);
+}
+
+/* Poll the keys at a different rate */
+void
+nvstusb_start_key_poller(
+    struct nvstusb_context *ctx,
+    float rate
+    ) {
+  assert(ctx != 0);
+  assert(rate > 0);
+
+  atomic_store(&ctx->key_poll_period_us, (uint64_t) (1e6 / rate));
+  nvstusb_wake_emitter(ctx);
+}
+
+/* Go back to the default key poll rate */
+void
+nvstusb_stop_key_poller(
+    struct nvstusb_context *ctx
+    ) {
+  assert(ctx != 0);
+
+  atomic_store(&ctx->key_poll_period_us, 1000000 / NVSTUSB_DEFAULT_KEY_POLL_HZ);
+  nvstusb_wake_emitter(ctx);
+}
+
+/* give the emitter thread the configured priority and cpu */
+static void
+nvstusb_apply_emitter_scheduling(
+    struct nvstusb_context *ctx
+    ) {
+  int err;
+
+  if (ctx->rt_priority > 0) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = ctx->rt_priority;
+    err = pthread_setschedparam(ctx->emitter_thread, SCHED_FIFO, &param);
+    if (err != 0) {
+      fprintf(stderr, "nvstusb: Could not make the emitter thread real-time (%s)\n", strerror(err));
+    }
+  }
+
+  if (ctx->rt_cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(ctx->rt_cpu, &cpus);
+    err = pthread_setaffinity_np(ctx->emitter_thread, sizeof(cpus), &cpus);
+    if (err != 0) {
+      fprintf(stderr, "nvstusb: Could not pin the emitter thread to cpu %d (%s)\n", ctx->rt_cpu, strerror(err));
+    }
+  }
+}
+
+/* Set the emitter thread's SCHED_FIFO priority (0 = normal scheduling) and
+ * the cpu it runs on (-1 = any) */
+void
+nvstusb_set_emitter_scheduling(
+    struct nvstusb_context *ctx,
+    int priority,
+    int cpu
+    ) {
+  assert(ctx != 0);
+
+  ctx->rt_priority = priority;
+  ctx->rt_cpu = cpu;
+  if (nvstusb_init_poll(ctx) == nvstusb_init_ready) {
+    nvstusb_apply_emitter_scheduling(ctx);
+  }
+}
+
+/* Start the emitter thread on a device that was just opened */
+static bool
+nvstusb_start_emitter_thread(
+    struct nvstusb_context *ctx
+    ) {
+  atomic_store(&ctx->emitter_stop, 0);
+  if (pthread_create(&ctx->emitter_thread, NULL, nvstusb_emitter_thread, (void *)ctx) != 0) {
+    fprintf(stderr, "nvstusb: Unable to start emitter thread\n");
+    return false;
+  }
+  ctx->emitter_running = 1;
+  nvstusb_apply_emitter_scheduling(ctx);
+  return true;
+}
+
+/* Emitter thread, the only one talking to the device. Sends the eye commands
+ * posted to the ring at their deadlines, programs the rate and polls the keys
+ * in between. Sleeps on wake_seq, so a post or a new setting wakes it right
+ * away. */
+static void * nvstusb_emitter_thread(void * in_pv_arg)
+{
+  struct nvstusb_context *ctx = (struct nvstusb_context *) in_pv_arg;
+  struct nvstusb_telemetry *tel = &ctx->telemetry;
+  uint64_t poll_period = atomic_load(&ctx->key_poll_period_us);
+  uint64_t next_poll = nvstusb_time_us();
+
+  while (!atomic_load(&ctx->emitter_stop)) {
+    const struct nvstusb_eye_event *event;
+
+    /* take the sequence before looking at anything it announces, a change
+     * after that makes the futex return right away */
+    unsigned seq = atomic_load(&ctx->wake_seq);
+    uint64_t now = nvstusb_time_us();
+
+    /* a new key poll rate counts from the last poll */
+    uint64_t period = atomic_load(&ctx->key_poll_period_us);
+    if (period != poll_period) {
+      next_poll = next_poll - poll_period + period;
+      poll_period = period;
+    }
+
+    /* the eye commands depend on the rate, program it first. new timings
+     * wait until the last ones are all out */
+    int backlog = nvstusb_register_retry(ctx);
+    uint64_t packed = backlog ? 0 : atomic_exchange(&ctx->pending_timings, 0);
+    if (0 != packed) {
+      struct nvstusb_timings timings;
+      nvstusb_unpack_timings(packed, &timings);
+      nvstusb_program_rate(ctx, &timings);
+      now = nvstusb_time_us();
+    }
+
+    /* if several commands are due only the newest matters, the older ones
+     * belong to frames that were replaced already */
+    struct nvstusb_eye_event due;
+    int have_due = 0;
+    while ((event = nvstusb_ring_peek(&ctx->ring)) != 0 && event->deadline_us <= now) {
+      if (have_due) atomic_fetch_add_explicit(&ctx->replaced_events, 1, memory_order_relaxed);
+      due = *event;
+      have_due = 1;
+      nvstusb_ring_pop(&ctx->ring);
+    }
+    if (have_due) {
+      nvstusb_set_eye(ctx, due.eye);
+      nvstusb_telemetry_record(tel, nvstusb_timing_eye_jitter, now - due.deadline_us);
+      continue;
+    }
+
+    /* a key read is a usb round trip, don't start one right before an eye
+     * command is due */
+    if (now >= next_poll &&
+        (0 == event || event->deadline_us > now + NVSTUSB_KEY_POLL_GUARD_US)) {
+      struct nvstusb_keys k;
+      nvstusb_read_keys(ctx, &k);
+
+      if (k.deltaWheel) atomic_fetch_add(&ctx->acc_wheel, k.deltaWheel);
+      if (k.pressedDeltaWheel) atomic_fetch_add(&ctx->acc_pressed_wheel, k.pressedDeltaWheel);
+      if (k.toggled3D) {
+        atomic_fetch_add(&ctx->acc_toggled3D, 1);
+        atomic_fetch_xor(&ctx->toggled3D, 1);
+      }
+
+      /* skip the periods we overran */
+      now = nvstusb_time_us();
+      do {
+        next_poll += poll_period;
+      } while (next_poll <= now);
+      continue;
+    }
+
+    /* sleep until the next deadline */
+    event = nvstusb_ring_peek(&ctx->ring);
+    uint64_t wake = next_poll;
+    if (event != 0 && event->deadline_us < wake) wake = event->deadline_us;
+    if (ctx->register_backlog_count && now + NVSTUSB_REGISTER_RETRY_US < wake) {
+      wake = now + NVSTUSB_REGISTER_RETRY_US;
+    }
+    if (wake <= now) continue;
+
+    atomic_store(&ctx->emitter_waiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&ctx->wake_seq) == seq && !atomic_load(&ctx->emitter_stop)) {
+      struct timespec ts = nvstusb_timespec(wake);
+      syscall(SYS_futex, &ctx->wake_seq, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG,
+          seq, &ts, NULL, FUTEX_BITSET_MATCH_ANY);
+    }
+    atomic_store(&ctx->emitter_waiting, 0);
+  }
+  return NULL;
 }
 
 /* Start Stereo Thread - For GL_STEREO */
 void nvstusb_start_stereo_thread(struct nvstusb_context *ctx) 
 {
   assert(ctx != 0);
-  assert(ctx->device != 0);
 
-  ctx->b_thread_running = true;
+  if(atomic_load(&ctx->b_thread_running)) return;
+
+  /* no swap posts from here on, until the thread is joined again */
+  pthread_mutex_lock(&ctx->quad_lock);
+  atomic_store(&ctx->b_thread_running, true);
+  ctx->stereo_posts = true;
   if ( pthread_create(&ctx->s_thread, NULL, nvstusb_stereo_thread, (void *)ctx) != 0 ) {
-    fprintf(stderr, "nvstusb: Unable to start stereo stread");
+    fprintf(stderr, "nvstusb: Unable to start stereo stread\n");
+    atomic_store(&ctx->b_thread_running, false);
+    ctx->stereo_posts = false;
   }
+  pthread_mutex_unlock(&ctx->quad_lock);
 }
 
 /* End Stereo Thread - For GL_STEREO  */
 void nvstusb_stop_stereo_thread(struct nvstusb_context *ctx) 
 {
   assert(ctx != 0);
-  assert(ctx->device != 0);
 
-  if(!ctx->b_thread_running) return;
+  if(!atomic_load(&ctx->b_thread_running)) return;
 
-  ctx->b_thread_running = false;
+  atomic_store(&ctx->b_thread_running, false);
   if ( pthread_join(ctx->s_thread, NULL) != 0 ) {
-    fprintf(stderr, "nvstusb: Unable to wait end of stereo stread");
+    fprintf(stderr, "nvstusb: Unable to wait end of stereo stread\n");
   }
+
+  /* the thread is done posting, the swaps take over */
+  pthread_mutex_lock(&ctx->quad_lock);
+  ctx->stereo_posts = false;
+  pthread_mutex_unlock(&ctx->quad_lock);
 }
 
-/* Stereo thread - For GL_STEREO  */
+/* Stereo thread - For GL_STEREO. Sends the left eye command ahead of every
+ * other vblank, at the phase the app's quad buffered swaps reported (free
+ * running at the programmed rate until the first one). Needs no GL context
+ * and doesn't depend on the app rendering in time. */
 static void * nvstusb_stereo_thread(void * in_pv_arg)
 {
   struct nvstusb_context *ctx = (struct nvstusb_context *) in_pv_arg;
-  Display *dpy;
-  Window win;
-
-  /* Openning X display */
-  dpy = XOpenDisplay(0);
-
-  /* Preparing new X window */
-  Window s_window;
-  static int attributeList[] =
-  { GLX_RGBA,
-    GLX_DOUBLEBUFFER,
-    GLX_RED_SIZE,
-    1,
-    GLX_GREEN_SIZE,
-    1,
-    GLX_BLUE_SIZE,
-    1,
-    None };
-  XVisualInfo *vi = glXChooseVisual(dpy, DefaultScreen(dpy), attributeList);
-  s_window = RootWindow(dpy, vi->screen);
-  XSetWindowAttributes swa;
-  swa.colormap = XCreateColormap(dpy, s_window, vi->visual, AllocNone);
-  swa.override_redirect = true;
-
-  /* Create X window 1x1 top left of screen */
-  win = XCreateWindow(dpy,
-      s_window ,
-      0,
-      0,
-      1,
-      1,
-      0,
-      vi->depth,
-      InputOutput,
-      vi->visual,
-      CWColormap|CWOverrideRedirect,
-      &swa);
-
-  XMapWindow(dpy, win);
-
-  /* Create glX context */
-  GLXContext glx_ctx = glXCreateContext(dpy, vi, 0, true);
-  glXMakeCurrent(dpy, win, glx_ctx);
-
-  /* Loop until stop */
-  while (ctx->b_thread_running) {
-    /* Send swap to usb controler */
-    nvstusb_swap(ctx, nvstusb_quad, NULL /*f_swap*/);
-
-    /* Read status from usb controler */
-    struct nvstusb_keys k;
-    nvstusb_get_keys(ctx, &k);
-    if (k.toggled3D) {
-      nvstusb_invert_eyes(ctx);
+
+  if (nvstusb_init_wait(ctx) != nvstusb_init_ready) return NULL;
+
+  uint64_t start = nvstusb_time_us();
+  while (atomic_load(&ctx->b_thread_running)) {
+    pthread_mutex_lock(&ctx->quad_lock);
+    uint64_t left = ctx->quad_left_us;
+    double period = ctx->quad_period_us;
+    pthread_mutex_unlock(&ctx->quad_lock);
+
+    if (0 == left) left = start;
+    if (period <= 0) {
+      float rate = atomic_load(&ctx->rate);
+      period = 1e6 / ((rate > 0) ? rate : 120.0);
     }
+
+    uint64_t lead = nvstusb_eye_lead(ctx);
+    uint64_t deadline = nvstusb_next_left(left, period, nvstusb_time_us() + lead) - lead;
+    struct timespec ts = nvstusb_timespec(deadline);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+
+    if (!atomic_load(&ctx->b_thread_running)) break;
+    nvstusb_post_eye(ctx, nvstusb_quad, deadline);
   }
-  /* Destroy context */
-  glx_ctx = glXGetCurrentContext();
-  glXDestroyContext(dpy, glx_ctx);
 
   return NULL;
 }
 
-/* Refresh rate calculation */
-static void nvstusb_print_refresh_rate(void)
-{
-  static int i_it = 0;
-  static uint64_t i_last = 0;
-  static uint64_t i_first = 0;
-  static uint64_t i_acc_var = 0;
-  double f_mean, f_var;
-
-  /* First frame */
-  if(i_it == 0) {
-    struct timespec s_tmp;
-    clock_gettime(CLOCK_REALTIME, &s_tmp);
-    i_first = (uint64_t)s_tmp.tv_sec*1000000+(uint64_t)s_tmp.tv_nsec/1000;
-    i_last = i_first;
-    f_mean = 0;
-    f_var = 0;
+/* summarize one of the frame timings */
+void
+nvstusb_get_timing_stats(
+    struct nvstusb_context *ctx,
+    enum nvstusb_timing which,
+    struct nvstusb_timing_stats *stats
+    ) {
+  assert(ctx != 0);
+  assert(stats != 0);
+  assert(which >= 0 && which < nvstusb_timing_count);
 
-  } else {
-    struct timespec s_tmp;
-    clock_gettime(CLOCK_REALTIME, &s_tmp);
-    uint64_t i_new = (uint64_t)s_tmp.tv_sec*1000000+(uint64_t)s_tmp.tv_nsec/1000;
-    /* Update average */
-    f_mean = (double)(i_new-i_first)/(i_it);
-    /* Calculate variance */
-    i_acc_var += pow((double)(i_new-i_last)-f_mean, 2);
-
-    /* std dev */
-    f_var = (double)sqrt(i_acc_var/i_it);
-    i_last = i_new;
-
-    /* Display each 512 frame */
-    if(i_it % 512 == 0) {
-      fprintf(stderr,"nvstusb: frame:%d (%0.2f s) mean: %f Hz (%0.2f us) sqrt(var): %0.2f us (%0.1f %%)\n",i_it,f_mean*i_it/1000000.0, 1000000/f_mean, f_mean, f_var, 100.0*f_var/f_mean);
-    }
+  nvstusb_telemetry_stats(&ctx->telemetry, which, stats);
+}
+
+/* swaps the readback strategy may have in flight */
+void
+nvstusb_set_render_ahead(
+    struct nvstusb_context *ctx,
+    int depth
+    ) {
+  assert(ctx != 0);
+
+  if (depth < 0) depth = 0;
+  if (depth > NVSTUSB_MAX_RENDER_AHEAD) depth = NVSTUSB_MAX_RENDER_AHEAD;
+  atomic_store(&ctx->render_ahead, depth);
+}
+
+/* send the eye commands of swaps that completed since, never blocks */
+void
+nvstusb_poll_swaps(
+    struct nvstusb_context *ctx
+    ) {
+  assert(ctx != 0);
+
+  if (ctx->fence_ok > 0) nvstusb_complete_fences(ctx, NVSTUSB_MAX_RENDER_AHEAD + 1);
+}
+
+/* switch sync strategies on the next swap, "auto" calibrates again */
+int
+nvstusb_set_sync_strategy(
+    struct nvstusb_context *ctx,
+    const char *name
+    ) {
+  assert(ctx != 0);
+
+  int request = NVSTUSB_SYNC_CALIBRATE;
+  if (NULL != name && 0 != strcmp(name, "auto")) {
+    request = nvstusb_find_sync(name);
+    if (request < 0) return -1;
+  }
+  atomic_store(&ctx->sync_request, request);
+  return 0;
+}
+
+/* the sync strategy in use (or on trial) */
+const char *
+nvstusb_get_sync_strategy(
+    struct nvstusb_context *ctx
+    ) {
+  assert(ctx != 0);
+
+  return (0 != ctx->sync) ? ctx->sync->name : 0;
+}
+
+/* what the calibration measured */
+int
+nvstusb_get_sync_calibration(
+    struct nvstusb_context *ctx,
+    struct nvstusb_sync_result *results,
+    int max
+    ) {
+  assert(ctx != 0);
+
+  int i;
+  for (i = 0; i < ctx->calibration_count && i < max; i++) {
+    results[i] = ctx->calibration[i];
+  }
+  return ctx->calibration_count;
+}
+
+/* retune the emitter when the display is threshold_ppm off, 0 = never */
+void
+nvstusb_set_rate_tracking(
+    struct nvstusb_context *ctx,
+    int threshold_ppm
+    ) {
+  assert(ctx != 0);
+
+  atomic_store(&ctx->rate_track_ppm, threshold_ppm < 0 ? 0 : threshold_ppm);
+}
+
+/* the rate the display is measured at and the one the emitter runs at */
+void
+nvstusb_get_rate_estimate(
+    struct nvstusb_context *ctx,
+    struct nvstusb_rate_estimate *estimate
+    ) {
+  assert(ctx != 0);
+  assert(estimate != 0);
+
+  estimate->nominal_hz = atomic_load(&ctx->nominal_rate);
+  estimate->programmed_hz = atomic_load(&ctx->rate);
+  pthread_mutex_lock(&ctx->rate_lock);
+  estimate->measured_hz = (ctx->measured_period_us > 0) ? 1e6 / ctx->measured_period_us : 0;
+  estimate->corrections = ctx->correction_count;
+  pthread_mutex_unlock(&ctx->rate_lock);
+}
+
+/* the latest corrections, oldest first */
+int
+nvstusb_get_rate_corrections(
+    struct nvstusb_context *ctx,
+    struct nvstusb_rate_correction *corrections,
+    int max
+    ) {
+  assert(ctx != 0);
+
+  pthread_mutex_lock(&ctx->rate_lock);
+  unsigned long long total = ctx->correction_count;
+  unsigned long long first = (total > NVSTUSB_RATE_HISTORY) ? total - NVSTUSB_RATE_HISTORY : 0;
+  if (max >= 0 && total - first > (unsigned long long) max) first = total - max;
+  int n = 0;
+  for (; first < total; first++) {
+    corrections[n++] = ctx->corrections[first % NVSTUSB_RATE_HISTORY];
   }
-  /* Increment frame counter */
-  i_it++;
+  pthread_mutex_unlock(&ctx->rate_lock);
+  return n;
+}
+
+/* usb transfers sent and the ones coalescing saved */
+void
+nvstusb_get_transfer_stats(
+    struct nvstusb_context *ctx,
+    struct nvstusb_transfer_stats *stats
+    ) {
+  assert(ctx != 0);
+  assert(stats != 0);
+
+  stats->register_transfers = atomic_load(&ctx->register_transfers);
+  stats->register_saved = atomic_load(&ctx->register_saved);
+  stats->timings_replaced = atomic_load(&ctx->timings_replaced);
+  stats->eye_transfers = atomic_load(&ctx->eye_transfers);
+  stats->eye_saved = atomic_load(&ctx->eye_saved) + atomic_load(&ctx->replaced_events);
+}
+
+/* alternating frames that went wrong */
+void
+nvstusb_get_frame_stats(
+    struct nvstusb_context *ctx,
+    struct nvstusb_frame_stats *stats
+    ) {
+  assert(ctx != 0);
+  assert(stats != 0);
+
+  struct nvstusb_telemetry *tel = &ctx->telemetry;
+  stats->dropped = atomic_load_explicit(&tel->dropped_frames, memory_order_relaxed);
+  stats->duplicated = atomic_load_explicit(&tel->duplicated_frames, memory_order_relaxed);
+  stats->resyncs = atomic_load_explicit(&tel->eye_resyncs, memory_order_relaxed);
+}
+
+/* when the next refresh starts, from the swapping thread */
+unsigned long long
+nvstusb_predict_vblank(
+    struct nvstusb_context *ctx
+    ) {
+  assert(ctx != 0);
+
+  return nvstusb_vblank_next(&ctx->vblank, nvstusb_time_us());
+}
+
+/* number of refreshes that passed without a swap */
+unsigned long long
+nvstusb_get_missed_vblanks(
+    struct nvstusb_context *ctx
+    ) {
+  assert(ctx != 0);
+
+  return atomic_load_explicit(&ctx->telemetry.missed_vblanks, memory_order_relaxed);
+}
+
+/* start the frame timings over */
+void
+nvstusb_reset_timings(
+    struct nvstusb_context *ctx
+    ) {
+  assert(ctx != 0);
+
+  nvstusb_telemetry_reset(&ctx->telemetry);
+}
+
+/* print the frame timings to stderr */
+void
+nvstusb_print_timings(
+    struct nvstusb_context *ctx
+    ) {
+  assert(ctx != 0);
+
+  nvstusb_telemetry_print(&ctx->telemetry);
+  fprintf(stderr, "nvstusb: eye commands dropped %llu, replaced %llu\n",
+      (unsigned long long) atomic_load(&ctx->dropped_events),
+      (unsigned long long) atomic_load(&ctx->replaced_events));
+
+  struct nvstusb_transfer_stats ts;
+  nvstusb_get_transfer_stats(ctx, &ts);
+  fprintf(stderr, "nvstusb: usb transfers: register writes %llu (%llu saved, %llu reprograms replaced), eye commands %llu (%llu saved)\n",
+      ts.register_transfers, ts.register_saved, ts.timings_replaced, ts.eye_transfers, ts.eye_saved);
+}
+
+/* print the frame timings every few seconds from nvstusb_swap(), 0 = never */
+void
+nvstusb_set_timing_dump(
+    struct nvstusb_context *ctx,
+    float seconds
+    ) {
+  assert(ctx != 0);
+
+  ctx->telemetry.dump_interval = (seconds > 0) ? (uint64_t)(seconds * 1e6) : 0;
+  ctx->telemetry.last_dump = nvstusb_time_us();
 }
@@ -19,16 +19,240 @@ enum nvstusb_eye {
 struct nvstusb_keys {
   char deltaWheel;
   char pressedDeltaWheel;
-  int  toggled3D;
+  int  toggled3D;         /* number of button presses, 0 if none */
+};
+
+/* timings recorded on every swap, see nvstusb_get_timing_stats() */
+enum nvstusb_timing {
+  nvstusb_timing_vblank_wait = 0, /* blocked waiting for vertical blank */
+  nvstusb_timing_eye_submit,      /* handing the eye command to usb */
+  nvstusb_timing_usb_completion,  /* eye command submit to completion */
+  nvstusb_timing_swap,            /* the swapfunc() call */
+  nvstusb_timing_key_poll,        /* reading the keys from the device */
+  nvstusb_timing_frame,           /* interval between consecutive swaps */
+  nvstusb_timing_eye_jitter,      /* scheduled eye command sent after its deadline */
+  nvstusb_timing_vblank_error,    /* observed vblank vs. the predicted one */
+  nvstusb_timing_count
+};
+
+struct nvstusb_timing_stats {
+  unsigned long long count;
+  double mean_us;
+  unsigned long long p50_us;
+  unsigned long long p99_us;
+  unsigned long long max_us;
+};
+
+/* alternating frames checked against the vblank counter, see
+ * nvstusb_get_frame_stats() */
+struct nvstusb_frame_stats {
+  unsigned long long dropped;     /* refreshes that scanned out the previous
+                                   * frame again */
+  unsigned long long duplicated;  /* frames that never reached the screen */
+  unsigned long long resyncs;     /* times the eyes were put back in step */
+};
+
+/* emitter timings, see nvstusb_reprogram_timings() */
+struct nvstusb_timings {
+  float rate;             /* refresh rate in Hz, above 60 */
+  int active_us;          /* how long each eye is open, 0 = 2080 */
+};
+
+/* the refresh rate, see nvstusb_get_rate_estimate() */
+struct nvstusb_rate_estimate {
+  float nominal_hz;               /* what the app set */
+  float programmed_hz;            /* what the emitter runs at */
+  double measured_hz;             /* what the display runs at, 0 until
+                                   * measured */
+  unsigned long long corrections; /* times the emitter was retuned */
+};
+
+/* the emitter retuned to the measured rate */
+struct nvstusb_rate_correction {
+  unsigned long long time_us;     /* since nvstusb_init*() */
+  float from_hz;
+  float to_hz;
+};
+
+/* usb transfers to the emitter, see nvstusb_get_transfer_stats() */
+struct nvstusb_transfer_stats {
+  unsigned long long register_transfers;  /* register writes sent */
+  unsigned long long register_saved;      /* writes that shared a transfer */
+  unsigned long long timings_replaced;    /* reprograms replaced by a newer
+                                           * one before they were sent */
+  unsigned long long eye_transfers;       /* eye commands sent */
+  unsigned long long eye_saved;           /* eye commands replaced by a newer
+                                           * due one, or not needed (quad) */
+};
+
+/* a sync strategy measured at startup, see nvstusb_get_sync_calibration() */
+struct nvstusb_sync_result {
+  const char *strategy;
+  unsigned frames;
+  unsigned missed;        /* frames that took over 1.5 refreshes */
+  double jitter_us;       /* mean distance of the frame interval from the
+                           * refresh period */
+  double stall_us;        /* mean time nvstusb_swap() blocked */
+};
+
+/* an emitter on the bus, see nvstusb_enumerate() */
+struct nvstusb_device_info {
+  char port[32];          /* "bus-port[.port...]", as the kernel names it */
+  char serial[64];        /* empty if the emitter reports none */
 };
 
 struct nvstusb_context *nvstusb_init();
+
+/* like nvstusb_init(), but on the named usb backend instead of the one in the
+ * NVSTUSB_BACKEND environment variable: "libusb" talks to a real emitter,
+ * "daemon" shares the one nvstusbd owns (at NVSTUSBD_SOCKET), "mock"
+ * emulates one in-process for hardware-free testing. without a name the
+ * daemon is used if it is running, libusb otherwise */
+struct nvstusb_context *nvstusb_init_backend(const char *backend);
+
+/* like nvstusb_init_backend(), but brings the emitter up (usb enumeration,
+ * firmware upload, resets) on a worker thread and returns right away, so the
+ * window and GL context can be created in the meantime. a backend of 0 comes
+ * from NVSTUSB_BACKEND. the context is usable immediately: nvstusb_set_rate()
+ * and nvstusb_start_key_poller() take effect once the emitter is up,
+ * nvstusb_get_keys() reports nothing until then and the first nvstusb_swap()
+ * blocks until it is. returns 0 only if the context can't be allocated */
+struct nvstusb_context *nvstusb_init_async(const char *backend);
+
+/* list the emitters on a usb backend (0 = NVSTUSB_BACKEND), up to max of them
+ * into devices. returns how many there are, which may be more than max, or
+ * -1 if the backend is unknown */
+int nvstusb_enumerate(const char *backend, struct nvstusb_device_info *devices, int max);
+
+/* like nvstusb_init_backend() and nvstusb_init_async(), but on a particular
+ * emitter. device is a port ("1-2.3") or "serial:<serial number>", 0 or ""
+ * takes the first one found; the calls above use NVSTUSB_DEVICE. contexts
+ * share no state: each has its own device, rate, emitter thread and
+ * telemetry, so several emitters can be driven from their own render threads
+ * in one process */
+struct nvstusb_context *nvstusb_init_device(const char *backend, const char *device);
+struct nvstusb_context *nvstusb_init_device_async(const char *backend, const char *device);
+
+/* result of the bring-up: 1 once the emitter is up, 0 while it is still in
+ * progress, -1 if it failed (nvstusb_swap() then only calls swapfunc).
+ * poll never blocks, wait blocks until the bring-up is over */
+int nvstusb_init_poll(struct nvstusb_context *ctx);
+int nvstusb_init_wait(struct nvstusb_context *ctx);
+
+/* microseconds from nvstusb_init*() to the end of the first nvstusb_swap()
+ * with the emitter up, 0 before that */
+unsigned long long nvstusb_get_time_to_first_frame(struct nvstusb_context *ctx);
 void nvstusb_deinit(struct nvstusb_context *ctx);
 void nvstusb_set_rate(struct nvstusb_context *ctx, float rate);
+
+/* nvstusb_set_rate() with every timing: the emitter thread programs them all
+ * in one go, with as few usb transfers as the firmware allows, before it
+ * sends the next eye command. never blocks, can be called from any thread;
+ * timings it hasn't got to yet are replaced as a whole */
+void nvstusb_reprogram_timings(struct nvstusb_context *ctx, const struct nvstusb_timings *timings);
 void nvstusb_swap(struct nvstusb_context *ctx, enum nvstusb_eye eye, void (*swapfunc)());
 void nvstusb_get_keys(struct nvstusb_context *ctx, struct nvstusb_keys *keys);
+
+/* the keys are polled by the emitter thread, 60 times a second unless
+ * nvstusb_start_key_poller() sets another rate (Hz), nvstusb_stop_key_poller()
+ * goes back to the default. nvstusb_get_keys() never touches the device, it
+ * returns (and resets) what was accumulated since the previous call and can
+ * be called from any thread */
+void nvstusb_start_key_poller(struct nvstusb_context *ctx, float rate);
+void nvstusb_stop_key_poller(struct nvstusb_context *ctx);
 void nvstusb_invert_eyes(struct nvstusb_context *ctx);
+
+/* with the "scheduled" sync strategy eye commands are scheduled against the
+ * predicted flip and sent this many microseconds early. -1 (the default, or
+ * NVSTUSB_EYE_LEAD_US in the environment) uses the measured usb latency */
+void nvstusb_set_eye_lead(struct nvstusb_context *ctx, int us);
+
+/* the "readback" sync strategy finds out when a swap completed
+ * with a GL_ARB_sync fence behind it, or by reading the front buffer where
+ * the context has no fences. by default every swap waits for its fence; with
+ * a render-ahead depth (0 to 4, or NVSTUSB_RENDER_AHEAD) up to that many
+ * swaps stay in flight and only the oldest beyond that is waited for. a
+ * swap's eye command goes out when its fence signals, which the swapping
+ * thread notices in nvstusb_swap() or by calling nvstusb_poll_swaps() while
+ * it renders the next frame; polling never blocks */
+void nvstusb_set_render_ahead(struct nvstusb_context *ctx, int depth);
+void nvstusb_poll_swaps(struct nvstusb_context *ctx);
+
+/* how nvstusb_swap() finds out an alternating frame reached the screen:
+ *
+ *   "readback"       a fence behind the swap, or a front buffer read
+ *   "video_sync"     wait for the vblank (GLX_SGI_video_sync), then swap
+ *   "driver"         the driver syncs (__GL_SYNC_TO_VBLANK, always used
+ *                    when that is set)
+ *   "swap_interval"  vsynced swap (GLX_SGI_swap_control)
+ *   "scheduled"      vsynced swap, the eye command is scheduled for the
+ *                    flip predicted from vblank timestamps
+ *
+ * unless NVSTUSB_SYNC (a name, or "auto") or NVSTUSB_VBLANK_METHOD (0-4, in
+ * the order above) picks one, the first swaps try every strategy the host
+ * has for 30 frames each, print what they measured and keep the best. the
+ * trials that force vsync leave it on. nvstusb_set_sync_strategy() switches
+ * on the next swap ("auto" calibrates again) and returns -1 for an unknown
+ * name. the getters are for the swapping thread; the strategy is 0 before
+ * the first swap and the one on trial while calibrating */
+int nvstusb_set_sync_strategy(struct nvstusb_context *ctx, const char *name);
+const char *nvstusb_get_sync_strategy(struct nvstusb_context *ctx);
+int nvstusb_get_sync_calibration(struct nvstusb_context *ctx, struct nvstusb_sync_result *results, int max);
+
+/* the rate set above is taken as nominal. the vblank times (best from
+ * GLX_OML_sync_control timestamps) are fitted over windows of 4 seconds and
+ * more to measure the real one; when that is more than threshold_ppm off
+ * what the emitter's frame timer runs at (default 100, or
+ * NVSTUSB_RATE_TRACK_PPM; 0 turns tracking off), the emitter is reprogrammed
+ * for the measured rate. the getters work from any thread, corrections
+ * returns up to the last 16 (oldest first) */
+void nvstusb_set_rate_tracking(struct nvstusb_context *ctx, int threshold_ppm);
+void nvstusb_get_rate_estimate(struct nvstusb_context *ctx, struct nvstusb_rate_estimate *estimate);
+int nvstusb_get_rate_corrections(struct nvstusb_context *ctx, struct nvstusb_rate_correction *corrections, int max);
+
+/* run the emitter thread, which does all the usb transfers, as SCHED_FIFO
+ * with the given priority (0 = normal scheduling) and pinned to cpu (-1 =
+ * any). defaults come from NVSTUSB_RT_PRIORITY and NVSTUSB_CPU. real-time
+ * priority needs CAP_SYS_NICE or an rtprio limit, a warning is printed
+ * otherwise. nvstusb_swap() must only be called from one thread */
+void nvstusb_set_emitter_scheduling(struct nvstusb_context *ctx, int priority, int cpu);
+
+/* quad buffered stereo (GL_STEREO): render GL_BACK_LEFT and GL_BACK_RIGHT and
+ * call nvstusb_swap(ctx, nvstusb_quad, swapfunc) once per stereo frame. the
+ * stereo thread then keeps the shutters in step with the display on its own,
+ * one eye command per left vblank, whether or not the app keeps up. it needs
+ * no GL context; start and stop it from the thread that swaps. without it
+ * the swap sends that command itself. if the eyes come out swapped, call
+ * nvstusb_invert_eyes() */
 void nvstusb_start_stereo_thread(struct nvstusb_context *ctx);
 void nvstusb_stop_stereo_thread(struct nvstusb_context *ctx);
 
+/* frame timing telemetry, always on. stats can be queried from any thread;
+ * a frame counts as missed when the swap interval exceeds 1.5 refresh
+ * periods. NVSTUSB_TIMING_DUMP=<seconds> in the environment (or
+ * nvstusb_set_timing_dump()) prints everything to stderr periodically */
+void nvstusb_get_timing_stats(struct nvstusb_context *ctx, enum nvstusb_timing which, struct nvstusb_timing_stats *stats);
+unsigned long long nvstusb_get_missed_vblanks(struct nvstusb_context *ctx);
+void nvstusb_reset_timings(struct nvstusb_context *ctx);
+void nvstusb_print_timings(struct nvstusb_context *ctx);
+void nvstusb_set_timing_dump(struct nvstusb_context *ctx, float seconds);
+
+/* every alternating frame is checked against the vblank counter it flipped
+ * on (GLX_OML_sync_control, or counted from the swap intervals). the
+ * shutters toggle on every refresh, so a skipped refresh or a frame that
+ * never showed puts the app's eyes on the other parity; that is detected on
+ * the next swap and the frame's eye command goes out right away, so the eyes
+ * are back in step within a frame instead of staying inverted. reset with
+ * the timings */
+void nvstusb_get_frame_stats(struct nvstusb_context *ctx, struct nvstusb_frame_stats *stats);
+
+/* when the next vblank is predicted to start, in microseconds of
+ * CLOCK_MONOTONIC, for pacing the render loop. 0 until the swaps gave a
+ * prediction. call it from the thread that swaps */
+unsigned long long nvstusb_predict_vblank(struct nvstusb_context *ctx);
+
+/* transfers sent to the emitter and the ones coalescing saved, from any
+ * thread */
+void nvstusb_get_transfer_stats(struct nvstusb_context *ctx, struct nvstusb_transfer_stats *stats);
+
 #endif // __NVSTUSB_NVSTUSB_H__
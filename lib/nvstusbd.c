@@ -0,0 +1,568 @@
+/* nvstusbd.c
+ *
+ * Owns an emitter (firmware, configuration, key polling) and lets several
+ * stereo applications use it at once through the "daemon" usb backend, so
+ * they start without touching the device and share one pair of glasses.
+ * See nvstusbd.h for the protocol.
+ *
+ * usage: nvstusbd [-s socket] [-b backend] [-d device] [-f firmware]
+ * */
+
+#define _GNU_SOURCE
+
+#include "nvstusbd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define NVSTUSBD_MAX_CLIENTS    16
+
+/* keys are polled at this rate and handed to every client */
+#define NVSTUSBD_KEY_POLL_HZ    60
+
+/* submitted transfers whose completion hasn't come back yet, per endpoint */
+#define NVSTUSBD_MAX_PENDING    256
+
+/* transfers go out on endpoints 1 (eye commands) and 2 (registers) */
+#define NVSTUSBD_ENDPOINTS      3
+
+/* refused register writes kept per client, reprogramming the timings takes
+ * three */
+#define NVSTUSBD_DEFERRED       4
+
+/* same command bits as in nvstusb.c */
+#define NVSTUSBD_CMD_READ       (0x02)
+
+struct nvstusbd_client {
+  int fd;                     /* -1 if the slot is free */
+  struct nvstusbd_shm *shm;   /* 0 until the client said hello */
+  pthread_t thread;
+  unsigned generation;        /* tells completions of a previous client apart */
+
+  /* register writes refused while another client drove the shutters,
+   * oldest first, under grant_lock */
+  struct nvstusbd_transfer deferred[NVSTUSBD_DEFERRED];
+  int deferred_count;
+  bool refused;
+};
+
+static struct nvstusb_usb_device *device = 0;
+static struct nvstusb_device_info device_info;
+static volatile sig_atomic_t quit = 0;
+static pthread_t key_thread;
+
+/* a client's shm is only set and cleared under pending_lock, the
+ * completions and the key poller look at it from their threads */
+static struct nvstusbd_client clients[NVSTUSBD_MAX_CLIENTS];
+
+/* register reads and writes are request/reply pairs on the device */
+static pthread_mutex_t device_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* which client each submitted transfer came from, one queue per endpoint:
+ * the completions of an endpoint come back in its submission order, but the
+ * endpoints complete independently of each other. also serializes the
+ * producers of the clients' cq */
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+  struct {
+    int client;
+    unsigned generation;
+  } slot[NVSTUSBD_MAX_PENDING];
+  unsigned head, tail;
+} pending[NVSTUSBD_ENDPOINTS];
+
+/* the client driving the shutters (-1 = none) and when it last sent
+ * something, see nvstusbd_grant() */
+static pthread_mutex_t grant_lock = PTHREAD_MUTEX_INITIALIZER;
+static int owner = -1;
+static uint64_t owner_last_us;
+
+static void
+on_signal(
+  int sig
+) {
+  quit = 1;
+}
+
+static uint64_t
+nvstusbd_time_us(
+) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* whether client i may send a transfer to the device. reads always may,
+ * eye commands and register writes only from the client driving the
+ * shutters; it is the first to send one, until it leaves or goes quiet.
+ * refused register writes are kept and sent once the client takes over */
+static bool
+nvstusbd_grant(
+  int i,
+  int endpoint,
+  const uint8_t *data,
+  int size
+) {
+  if (endpoint == 2 && size > 0 && (data[0] & NVSTUSBD_CMD_READ)) return true;
+
+  struct nvstusbd_transfer replay[NVSTUSBD_DEFERRED];
+  int replay_count = 0;
+  uint64_t now = nvstusbd_time_us();
+
+  pthread_mutex_lock(&grant_lock);
+  if (owner != i &&
+      (owner < 0 || now - owner_last_us > NVSTUSBD_GRANT_IDLE_MS * 1000ull)) {
+    fprintf(stderr, "nvstusbd: Client %d drives the shutters\n", i);
+    owner = i;
+    clients[i].refused = false;
+    replay_count = clients[i].deferred_count;
+    memcpy(replay, clients[i].deferred, replay_count * sizeof(replay[0]));
+    clients[i].deferred_count = 0;
+  }
+
+  bool granted = (owner == i);
+  if (granted) {
+    owner_last_us = now;
+  } else {
+    if (!clients[i].refused) {
+      fprintf(stderr, "nvstusbd: Client %d drives the shutters, refusing client %d\n", owner, i);
+      clients[i].refused = true;
+    }
+    if (endpoint == 2) {
+      struct nvstusbd_client *client = &clients[i];
+      if (NVSTUSBD_DEFERRED == client->deferred_count) {
+        memmove(client->deferred, client->deferred + 1, (NVSTUSBD_DEFERRED - 1) * sizeof(client->deferred[0]));
+        client->deferred_count--;
+      }
+      struct nvstusbd_transfer *t = &client->deferred[client->deferred_count++];
+      t->endpoint = endpoint;
+      t->size = size;
+      memcpy(t->data, data, size);
+    }
+  }
+  pthread_mutex_unlock(&grant_lock);
+
+  /* the emitter runs at this client's timings from now on */
+  int k;
+  for (k = 0; k < replay_count; k++) {
+    pthread_mutex_lock(&device_lock);
+    nvstusb_usb_write_bulk(device, replay[k].endpoint, replay[k].data, replay[k].size);
+    pthread_mutex_unlock(&device_lock);
+  }
+  return granted;
+}
+
+/* hand a completion to a client, call with pending_lock held */
+static void
+nvstusbd_complete(
+  struct nvstusbd_client *client,
+  int endpoint,
+  int status,
+  uint64_t latency_us
+) {
+  struct nvstusbd_shm *shm = client->shm;
+  if (0 == shm) return;
+
+  unsigned tail = atomic_load_explicit(&shm->cq_tail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit(&shm->cq_head, memory_order_acquire);
+  if (tail - head == NVSTUSBD_CQ_SIZE) return;   /* the client isn't keeping up */
+
+  struct nvstusbd_completion *c = &shm->cq[tail & (NVSTUSBD_CQ_SIZE - 1)];
+  c->endpoint = endpoint;
+  c->status = status;
+  c->latency_us = latency_us;
+  atomic_store_explicit(&shm->cq_tail, tail + 1, memory_order_release);
+
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&shm->cq_waiting, memory_order_relaxed)) {
+    nvstusbd_futex_wake(&shm->cq_tail);
+  }
+}
+
+/* completion of a forwarded transfer, on the device's event thread */
+static void
+nvstusbd_completed(
+  void *user,
+  int endpoint,
+  int status,
+  uint64_t latency_us
+) {
+  if (endpoint < 0 || endpoint >= NVSTUSBD_ENDPOINTS) return;
+
+  pthread_mutex_lock(&pending_lock);
+  unsigned head = pending[endpoint].head;
+  if (head != pending[endpoint].tail) {
+    int i = pending[endpoint].slot[head % NVSTUSBD_MAX_PENDING].client;
+    unsigned generation = pending[endpoint].slot[head % NVSTUSBD_MAX_PENDING].generation;
+    pending[endpoint].head++;
+    if (clients[i].generation == generation) {
+      nvstusbd_complete(&clients[i], endpoint, status, latency_us);
+    }
+  }
+  pthread_mutex_unlock(&pending_lock);
+}
+
+/* forwards the eye commands of one client to the device */
+static void *
+nvstusbd_client_thread(
+  void *arg
+) {
+  int i = (int) (intptr_t) arg;
+  struct nvstusbd_shm *shm = clients[i].shm;
+  unsigned generation = clients[i].generation;
+
+  while (!quit && !atomic_load(&shm->closed)) {
+    unsigned head = atomic_load_explicit(&shm->tx_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&shm->tx_tail, memory_order_acquire);
+
+    if (head == tail) {
+      atomic_store(&shm->tx_waiting, 1);
+      atomic_thread_fence(memory_order_seq_cst);
+      if (atomic_load(&shm->tx_tail) == tail && !atomic_load(&shm->closed)) {
+        nvstusbd_futex_wait(&shm->tx_tail, tail, 100);
+      }
+      atomic_store(&shm->tx_waiting, 0);
+      continue;
+    }
+
+    struct nvstusbd_transfer t = shm->tx[head & (NVSTUSBD_TX_SIZE - 1)];
+    atomic_store_explicit(&shm->tx_head, head + 1, memory_order_release);
+    if (t.size < 0 || t.size > NVSTUSB_USB_ASYNC_MAX_SIZE) continue;
+    if (t.endpoint < 0 || t.endpoint >= NVSTUSBD_ENDPOINTS) continue;
+    bool granted = nvstusbd_grant(i, t.endpoint, t.data, t.size);
+
+    /* record the owner first, the completion may beat the submit's return */
+    pthread_mutex_lock(&pending_lock);
+    int res = granted ? NVSTUSB_USB_ERROR_BUSY : NVSTUSB_USB_ERROR_ACCESS;
+    unsigned slot = pending[t.endpoint].tail;
+    if (granted && slot - pending[t.endpoint].head < NVSTUSBD_MAX_PENDING) {
+      pending[t.endpoint].slot[slot % NVSTUSBD_MAX_PENDING].client = i;
+      pending[t.endpoint].slot[slot % NVSTUSBD_MAX_PENDING].generation = generation;
+      pending[t.endpoint].tail++;
+      res = nvstusb_usb_write_bulk_async(device, t.endpoint, t.data, t.size);
+      if (res < 0) pending[t.endpoint].tail--;
+    }
+    if (res < 0) nvstusbd_complete(&clients[i], t.endpoint, res, 0);
+    pthread_mutex_unlock(&pending_lock);
+  }
+  return NULL;
+}
+
+/* polls the keys and adds them to every client's */
+static void *
+nvstusbd_key_thread(
+  void *arg
+) {
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  while (!quit) {
+    uint8_t cmd[] = { 0x02 | 0x40, 0x18, 0x03, 0x00 };   /* read and clear 0x201F */
+    uint8_t reply[4 + 3];
+    memset(reply, 0, sizeof(reply));
+
+    pthread_mutex_lock(&device_lock);
+    nvstusb_usb_write_bulk(device, 2, cmd, sizeof(cmd));
+    nvstusb_usb_read_bulk(device, 4, reply, sizeof(reply));
+    pthread_mutex_unlock(&device_lock);
+
+    int8_t wheel = reply[4], pressed_wheel = reply[5];
+    int toggled = reply[6] & 0x01;
+    if (wheel || pressed_wheel || toggled) {
+      int i;
+      pthread_mutex_lock(&pending_lock);
+      for (i = 0; i < NVSTUSBD_MAX_CLIENTS; i++) {
+        struct nvstusbd_shm *shm = clients[i].shm;
+        if (0 == shm) continue;
+        atomic_fetch_add(&shm->wheel, wheel);
+        atomic_fetch_add(&shm->pressed_wheel, pressed_wheel);
+        atomic_fetch_add(&shm->toggled, toggled);
+      }
+      pthread_mutex_unlock(&pending_lock);
+    }
+
+    next.tv_nsec += 1000000000L / NVSTUSBD_KEY_POLL_HZ;
+    if (next.tv_nsec >= 1000000000L) {
+      next.tv_nsec -= 1000000000L;
+      next.tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+  }
+  return NULL;
+}
+
+/* give a client its shared memory */
+static void
+nvstusbd_hello(
+  int i
+) {
+  struct nvstusbd_client *client = &clients[i];
+  struct nvstusbd_msg msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.type = NVSTUSBD_HELLO;
+  msg.result = -1;
+  msg.info = device_info;
+
+  int fd = -1;
+  if (0 == client->shm) {
+    fd = memfd_create("nvstusbd", MFD_CLOEXEC);
+    void *p = MAP_FAILED;
+    if (fd >= 0 && ftruncate(fd, sizeof(struct nvstusbd_shm)) == 0) {
+      p = mmap(0, sizeof(struct nvstusbd_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (MAP_FAILED != p) {
+      struct nvstusbd_shm *shm = (struct nvstusbd_shm *) p;
+      shm->magic = NVSTUSBD_MAGIC;
+      shm->version = NVSTUSBD_VERSION;
+
+      pthread_mutex_lock(&pending_lock);
+      client->shm = shm;
+      pthread_mutex_unlock(&pending_lock);
+
+      if (pthread_create(&client->thread, NULL, nvstusbd_client_thread, (void *) (intptr_t) i) == 0) {
+        msg.result = 0;
+      } else {
+        pthread_mutex_lock(&pending_lock);
+        client->shm = 0;
+        pthread_mutex_unlock(&pending_lock);
+        munmap(p, sizeof(struct nvstusbd_shm));
+      }
+    }
+  }
+
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = { &msg, sizeof(msg) };
+  struct msghdr hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memset(control, 0, sizeof(control));
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+  if (msg.result == 0) {
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+  sendmsg(client->fd, &hdr, MSG_NOSIGNAL);
+  if (fd >= 0) close(fd);
+}
+
+/* drop a client, its thread and shared memory */
+static void
+nvstusbd_disconnect(
+  int i
+) {
+  struct nvstusbd_client *client = &clients[i];
+
+  if (0 != client->shm) {
+    atomic_store(&client->shm->closed, 1);
+    nvstusbd_futex_wake(&client->shm->tx_tail);
+    nvstusbd_futex_wake(&client->shm->cq_tail);
+    pthread_join(client->thread, NULL);
+
+    pthread_mutex_lock(&pending_lock);
+    struct nvstusbd_shm *shm = client->shm;
+    client->shm = 0;
+    client->generation++;
+    pthread_mutex_unlock(&pending_lock);
+    munmap(shm, sizeof(*shm));
+  }
+
+  /* the next client to send an eye command takes over */
+  pthread_mutex_lock(&grant_lock);
+  if (owner == i) owner = -1;
+  client->deferred_count = 0;
+  client->refused = false;
+  pthread_mutex_unlock(&grant_lock);
+
+  close(client->fd);
+  client->fd = -1;
+  fprintf(stderr, "nvstusbd: Client %d left\n", i);
+}
+
+/* handle a message from a client, false if it went away */
+static bool
+nvstusbd_serve(
+  int i
+) {
+  struct nvstusbd_msg msg;
+  ssize_t n = recv(clients[i].fd, &msg, sizeof(msg), 0);
+  if (n <= 0) return false;
+  if (n != sizeof(msg)) return true;
+
+  switch (msg.type) {
+  case NVSTUSBD_HELLO:
+    nvstusbd_hello(i);
+    break;
+  case NVSTUSBD_WRITE:
+    if (msg.size < 0 || msg.size > NVSTUSB_USB_ASYNC_MAX_SIZE) {
+      msg.result = NVSTUSB_USB_ERROR_IO;
+    } else if (!nvstusbd_grant(i, msg.endpoint, msg.data, msg.size)) {
+      msg.result = NVSTUSB_USB_ERROR_ACCESS;
+    } else {
+      pthread_mutex_lock(&device_lock);
+      msg.result = nvstusb_usb_write_bulk(device, msg.endpoint, msg.data, msg.size);
+      pthread_mutex_unlock(&device_lock);
+    }
+    send(clients[i].fd, &msg, sizeof(msg), MSG_NOSIGNAL);
+    break;
+  case NVSTUSBD_INFO:
+    msg.result = 0;
+    msg.info = device_info;
+    send(clients[i].fd, &msg, sizeof(msg), MSG_NOSIGNAL);
+    break;
+  }
+  return true;
+}
+
+int
+main(
+  int argc,
+  char *argv[]
+) {
+  const char *socket_path = nvstusbd_socket_path();
+  const char *backend = "libusb";
+  const char *select = getenv("NVSTUSB_DEVICE");
+  const char *firmware = "nvstusb.fw";
+  int opt, i;
+
+  while ((opt = getopt(argc, argv, "s:b:d:f:")) != -1) {
+    switch (opt) {
+      case 's': socket_path = optarg; break;
+      case 'b': backend = optarg; break;
+      case 'd': select = optarg; break;
+      case 'f': firmware = optarg; break;
+      default:
+        fprintf(stderr, "usage: %s [-s socket] [-b backend] [-d device] [-f firmware]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (strcmp(backend, "daemon") == 0) {
+    fprintf(stderr, "nvstusbd: Can't serve an emitter of another daemon\n");
+    return EXIT_FAILURE;
+  }
+
+  struct sockaddr_un addr;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "nvstusbd: Socket path %s is too long\n", socket_path);
+    return EXIT_FAILURE;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+
+  /* a socket left behind by a daemon that died is replaced below, one that
+   * still answers belongs to a daemon that has the emitter */
+  int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (probe >= 0 && connect(probe, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+    fprintf(stderr, "nvstusbd: Another nvstusbd is serving at %s\n", socket_path);
+    close(probe);
+    return EXIT_FAILURE;
+  }
+  if (probe >= 0) close(probe);
+
+  device = nvstusb_usb_open_device(backend, firmware, select);
+  if (0 == device) {
+    fprintf(stderr, "nvstusbd: Could not open the emitter\n");
+    return EXIT_FAILURE;
+  }
+  nvstusb_usb_set_completion_callback(device, nvstusbd_completed, 0);
+
+  /* the clients select by it, it is the first match like the open's */
+  struct nvstusb_device_info infos[64];
+  int count = nvstusb_usb_enumerate(backend, infos, 64);
+  for (i = 0; i < count && i < 64; i++) {
+    if (nvstusb_usb_select_matches(select, &infos[i])) {
+      device_info = infos[i];
+      break;
+    }
+  }
+
+  unlink(socket_path);
+  int listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (listener < 0 ||
+      bind(listener, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+      listen(listener, NVSTUSBD_MAX_CLIENTS) < 0) {
+    perror("nvstusbd: Could not listen on socket");
+    nvstusb_usb_close_device(device);
+    return EXIT_FAILURE;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  for (i = 0; i < NVSTUSBD_MAX_CLIENTS; i++) clients[i].fd = -1;
+  if (pthread_create(&key_thread, NULL, nvstusbd_key_thread, NULL) != 0) {
+    fprintf(stderr, "nvstusbd: Unable to start key poller thread\n");
+    return EXIT_FAILURE;
+  }
+  fprintf(stderr, "nvstusbd: Serving the emitter at %s\n", socket_path);
+
+  while (!quit) {
+    struct pollfd fds[1 + NVSTUSBD_MAX_CLIENTS];
+    int slot[1 + NVSTUSBD_MAX_CLIENTS];
+    int n = 0;
+
+    fds[n].fd = listener;
+    fds[n].events = POLLIN;
+    slot[n++] = -1;
+    for (i = 0; i < NVSTUSBD_MAX_CLIENTS; i++) {
+      if (clients[i].fd < 0) continue;
+      fds[n].fd = clients[i].fd;
+      fds[n].events = POLLIN;
+      slot[n++] = i;
+    }
+
+    if (poll(fds, n, -1) < 0) {
+      if (errno == EINTR) continue;
+      perror("nvstusbd: poll");
+      break;
+    }
+
+    for (i = 1; i < n; i++) {
+      if (0 == fds[i].revents) continue;
+      if (!nvstusbd_serve(slot[i])) nvstusbd_disconnect(slot[i]);
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+      if (fd < 0) continue;
+      for (i = 0; i < NVSTUSBD_MAX_CLIENTS && clients[i].fd >= 0; i++);
+      if (i == NVSTUSBD_MAX_CLIENTS) {
+        fprintf(stderr, "nvstusbd: Too many clients, refusing one\n");
+        close(fd);
+        continue;
+      }
+      clients[i].fd = fd;
+      fprintf(stderr, "nvstusbd: Client %d connected\n", i);
+    }
+  }
+
+  fprintf(stderr, "nvstusbd: Shutting down\n");
+  quit = 1;
+  for (i = 0; i < NVSTUSBD_MAX_CLIENTS; i++) {
+    if (clients[i].fd >= 0) nvstusbd_disconnect(i);
+  }
+  pthread_join(key_thread, NULL);
+  close(listener);
+  unlink(socket_path);
+
+  nvstusb_usb_set_completion_callback(device, 0, 0);
+  nvstusb_usb_close_device(device);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,110 @@
+/* nvstusbd.h
+ *
+ * Protocol between nvstusbd, the daemon that owns an emitter, and the
+ * "daemon" usb backend its clients use. Internal to the library.
+ *
+ * A client connects to the daemon's UNIX socket and sends NVSTUSBD_HELLO.
+ * The reply carries a shared memory file descriptor (SCM_RIGHTS) with a
+ * struct nvstusbd_shm for that client:
+ *
+ *   tx     asynchronous writes (eye commands), client -> daemon
+ *   cq     their completions, daemon -> client
+ *   keys   button and wheel input the daemon polled, per client
+ *
+ * Both rings have a single producer and a single consumer. The consumer
+ * sleeps on a futex on the ring's tail after setting its waiting flag, the
+ * producer wakes it if the flag is set. Synchronous register writes go over
+ * the socket as NVSTUSBD_WRITE and are answered with the result.
+ * NVSTUSBD_INFO, and the reply to NVSTUSBD_HELLO, carry the port and serial
+ * of the daemon's emitter.
+ *
+ * One client drives the shutters at a time: the first to send an eye
+ * command or register write. Those of the others fail with
+ * NVSTUSB_USB_ERROR_ACCESS until it leaves or sends nothing for
+ * NVSTUSBD_GRANT_IDLE_MS; their last register writes are replayed when they
+ * take over, so the emitter runs at their timings.
+ * */
+
+#ifndef __NVSTUSB_NVSTUSBD_H__
+#define __NVSTUSB_NVSTUSBD_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "usb.h"
+
+#define NVSTUSBD_MAGIC          (0x4e565344)  /* "NVSD" */
+#define NVSTUSBD_VERSION        (2)
+
+/* the socket is this in $XDG_RUNTIME_DIR (/tmp without it), NVSTUSBD_SOCKET
+ * overrides the whole path */
+#define NVSTUSBD_SOCKET_NAME    "nvstusbd.sock"
+
+/* both must be powers of two */
+#define NVSTUSBD_TX_SIZE        (64)
+#define NVSTUSBD_CQ_SIZE        (64)
+
+/* the shutters go to another client after this long without a transfer */
+#define NVSTUSBD_GRANT_IDLE_MS  (2000)
+
+/* socket messages */
+enum nvstusbd_msg_type {
+  NVSTUSBD_HELLO = 1,
+  NVSTUSBD_WRITE,
+  NVSTUSBD_INFO,
+};
+
+struct nvstusbd_msg {
+  uint32_t type;
+  int32_t endpoint;
+  int32_t size;
+  int32_t result;       /* in replies */
+  uint8_t data[NVSTUSB_USB_ASYNC_MAX_SIZE];
+  struct nvstusb_device_info info;  /* in HELLO and INFO replies */
+};
+
+struct nvstusbd_transfer {
+  int32_t endpoint;
+  int32_t size;
+  uint8_t data[NVSTUSB_USB_ASYNC_MAX_SIZE];
+};
+
+struct nvstusbd_completion {
+  int32_t endpoint;
+  int32_t status;
+  uint64_t latency_us;
+};
+
+struct nvstusbd_shm {
+  uint32_t magic;
+  uint32_t version;
+
+  /* set by either side when it goes away */
+  atomic_uint closed;
+
+  _Alignas(64) atomic_uint tx_head;
+  _Alignas(64) atomic_uint tx_tail;
+  atomic_uint tx_waiting;
+  struct nvstusbd_transfer tx[NVSTUSBD_TX_SIZE];
+
+  _Alignas(64) atomic_uint cq_head;
+  _Alignas(64) atomic_uint cq_tail;
+  atomic_uint cq_waiting;
+  struct nvstusbd_completion cq[NVSTUSBD_CQ_SIZE];
+
+  /* key input since the client last took it */
+  _Alignas(64) atomic_int wheel;
+  atomic_int pressed_wheel;
+  atomic_int toggled;
+};
+
+/* the socket to use */
+const char *nvstusbd_socket_path(void);
+
+/* futex on a word of the shared memory, the timeout is relative (0 =
+ * forever) */
+void nvstusbd_futex_wait(atomic_uint *word, unsigned value, int timeout_ms);
+void nvstusbd_futex_wake(atomic_uint *word);
+
+#endif // __NVSTUSB_NVSTUSBD_H__
@@ -0,0 +1,90 @@
+/* ratetrack.c
+ *
+ * Refresh rate tracking, see ratetrack.h.
+ * */
+
+#include "ratetrack.h"
+#include <math.h>
+
+/* a window is judged once it spans this long, and started over when it
+ * gets this long so a rate that wanders is still followed */
+#define NVSTUSB_RATETRACK_MIN_SPAN_US   4000000
+#define NVSTUSB_RATETRACK_MAX_SPAN_US  60000000
+
+/* further off than this is another mode (or garbage), not drift */
+#define NVSTUSB_RATETRACK_MAX_ERROR   0.02
+
+static void
+nvstusb_ratetrack_restart(
+  struct nvstusb_ratetrack *rt
+) {
+  rt->sx = rt->sy = rt->sxx = rt->sxy = 0;
+  rt->last_x = 0;
+  rt->samples = 0;
+}
+
+void
+nvstusb_ratetrack_init(
+  struct nvstusb_ratetrack *rt,
+  double programmed_us
+) {
+  rt->programmed_us = programmed_us;
+  rt->period_us = 0;
+  nvstusb_ratetrack_restart(rt);
+}
+
+double
+nvstusb_ratetrack_update(
+  struct nvstusb_ratetrack *rt,
+  int64_t msc,
+  uint64_t t,
+  double threshold_ppm
+) {
+  if (rt->programmed_us <= 0) return 0;
+
+  if (rt->samples == 0) {
+    rt->msc0 = msc;
+    rt->t0 = t;
+  }
+
+  /* the counter went backwards or the clock did, the window is no good. the
+   * same vblank again adds nothing */
+  int64_t x = msc - rt->msc0;
+  if (t < rt->t0 || x < rt->last_x) {
+    nvstusb_ratetrack_restart(rt);
+    return 0;
+  }
+  if (rt->samples > 0 && x == rt->last_x) return 0;
+
+  double y = (double) (t - rt->t0);
+  rt->sx += x;
+  rt->sy += y;
+  rt->sxx += (double) x * x;
+  rt->sxy += x * y;
+  rt->last_x = x;
+  rt->samples++;
+  if (rt->samples < 3) return 0;
+
+  double n = rt->samples;
+  double d = n * rt->sxx - rt->sx * rt->sx;
+  if (d <= 0) return 0;
+  double period = (n * rt->sxy - rt->sx * rt->sy) / d;
+  if (fabs(period - rt->programmed_us) > rt->programmed_us * NVSTUSB_RATETRACK_MAX_ERROR) {
+    nvstusb_ratetrack_restart(rt);
+    return 0;
+  }
+  rt->period_us = period;
+
+  if (y < NVSTUSB_RATETRACK_MIN_SPAN_US) return 0;
+
+  double error_ppm = (period - rt->programmed_us) / rt->programmed_us * 1e6;
+  if (threshold_ppm <= 0 || fabs(error_ppm) < threshold_ppm) {
+    if (y >= NVSTUSB_RATETRACK_MAX_SPAN_US) nvstusb_ratetrack_restart(rt);
+    return 0;
+  }
+
+  /* the emitter runs at the fitted period from here, measure again */
+  rt->programmed_us = period;
+  nvstusb_ratetrack_restart(rt);
+  return period;
+}
@@ -0,0 +1,38 @@
+/* ratetrack.h
+ *
+ * Tracks the refresh rate the display really runs at, so the emitter's own
+ * frame timer can be retuned when the panel drifts from its modeline. The
+ * vblank predictor locks onto each vblank's phase but follows the period
+ * too loosely for a few ppm; this fits a line through the vblank times
+ * against their counter over a window of seconds instead, and only reports
+ * a lasting error above a threshold. Internal to the library.
+ * */
+
+#ifndef __NVSTUSB_RATETRACK_H__
+#define __NVSTUSB_RATETRACK_H__
+
+#include <stdint.h>
+
+struct nvstusb_ratetrack {
+  /* period the emitter is programmed for, and the latest fitted one (0
+   * until there is one) */
+  double programmed_us;
+  double period_us;
+
+  /* the window being fitted, relative to its first vblank */
+  int64_t msc0;
+  uint64_t t0;
+  int64_t last_x;
+  double sx, sy, sxx, sxy;
+  int samples;
+};
+
+/* start over for an emitter programmed for programmed_us */
+void nvstusb_ratetrack_init(struct nvstusb_ratetrack *rt, double programmed_us);
+
+/* feed vblank msc, seen at t. returns the period to program the emitter
+ * for once the fitted one is more than threshold_ppm off (and takes that as
+ * programmed from then on), 0 otherwise */
+double nvstusb_ratetrack_update(struct nvstusb_ratetrack *rt, int64_t msc, uint64_t t, double threshold_ppm);
+
+#endif // __NVSTUSB_RATETRACK_H__
@@ -0,0 +1,81 @@
+/* ring.h
+ *
+ * Wait-free single-producer/single-consumer ring of eye events, from the
+ * thread calling nvstusb_swap() to the emitter thread. Internal to the
+ * library.
+ * */
+
+#ifndef __NVSTUSB_RING_H__
+#define __NVSTUSB_RING_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "nvstusb.h"
+
+/* must be a power of two */
+#define NVSTUSB_RING_SIZE 64
+
+/* an eye command to send at a deadline */
+struct nvstusb_eye_event {
+  uint64_t submit_us;     /* when the swap posted it */
+  uint64_t deadline_us;   /* when it should go out */
+  enum nvstusb_eye eye;
+};
+
+struct nvstusb_ring {
+  /* next slot to pop, only written by the consumer */
+  _Alignas(64) atomic_uint head;
+
+  /* next slot to push, only written by the producer */
+  _Alignas(64) atomic_uint tail;
+
+  struct nvstusb_eye_event events[NVSTUSB_RING_SIZE];
+};
+
+static inline void
+nvstusb_ring_init(
+    struct nvstusb_ring *ring
+    ) {
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+}
+
+/* producer: append an event, false if the ring is full */
+static inline bool
+nvstusb_ring_push(
+    struct nvstusb_ring *ring,
+    const struct nvstusb_eye_event *event
+    ) {
+  unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  if (tail - head == NVSTUSB_RING_SIZE) return false;
+
+  ring->events[tail & (NVSTUSB_RING_SIZE - 1)] = *event;
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  return true;
+}
+
+/* consumer: the oldest event, 0 if the ring is empty */
+static inline const struct nvstusb_eye_event *
+nvstusb_ring_peek(
+    struct nvstusb_ring *ring
+    ) {
+  unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (head == tail) return 0;
+
+  return &ring->events[head & (NVSTUSB_RING_SIZE - 1)];
+}
+
+/* consumer: drop the event returned by nvstusb_ring_peek() */
+static inline void
+nvstusb_ring_pop(
+    struct nvstusb_ring *ring
+    ) {
+  unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+#endif // __NVSTUSB_RING_H__
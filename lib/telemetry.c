@@ -0,0 +1,182 @@
+/* telemetry.c
+ *
+ * Lock-free timing histograms for the swap path.
+ * */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "telemetry.h"
+
+static const char *nvstusb_timing_names[nvstusb_timing_count] = {
+  "vblank wait",
+  "eye submit",
+  "usb completion",
+  "swap",
+  "key poll",
+  "frame",
+  "eye jitter",
+  "vblank error",
+};
+
+uint64_t
+nvstusb_time_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000 + (uint64_t)ts.tv_nsec/1000;
+}
+
+/* bucket index of a value */
+static int
+nvstusb_histogram_bucket(
+    uint64_t us
+    ) {
+  if (us < 64) return us;
+
+  int msb = 63 - __builtin_clzll(us);
+  int shift = msb - NVSTUSB_HIST_SUB_BITS;
+  int bucket = 64 + (shift - 1) * 32 + (int)((us >> shift) - 32);
+  if (bucket >= NVSTUSB_HIST_BUCKETS) bucket = NVSTUSB_HIST_BUCKETS - 1;
+  return bucket;
+}
+
+/* value in the middle of a bucket */
+static uint64_t
+nvstusb_histogram_value(
+    int bucket
+    ) {
+  if (bucket < 64) return bucket;
+
+  int shift = (bucket - 64) / 32 + 1;
+  uint64_t sub = (bucket - 64) % 32 + 32;
+  return (sub << shift) + (1ull << (shift - 1));
+}
+
+void
+nvstusb_telemetry_init(
+    struct nvstusb_telemetry *tel
+    ) {
+  int i, j;
+
+  for (i = 0; i < nvstusb_timing_count; i++) {
+    atomic_init(&tel->hist[i].count, 0);
+    atomic_init(&tel->hist[i].sum, 0);
+    atomic_init(&tel->hist[i].max, 0);
+    for (j = 0; j < NVSTUSB_HIST_BUCKETS; j++) {
+      atomic_init(&tel->hist[i].buckets[j], 0);
+    }
+  }
+  atomic_init(&tel->missed_vblanks, 0);
+  atomic_init(&tel->dropped_frames, 0);
+  atomic_init(&tel->duplicated_frames, 0);
+  atomic_init(&tel->eye_resyncs, 0);
+  tel->last_swap = 0;
+  tel->dump_interval = 0;
+  tel->last_dump = 0;
+}
+
+void
+nvstusb_telemetry_reset(
+    struct nvstusb_telemetry *tel
+    ) {
+  int i, j;
+
+  for (i = 0; i < nvstusb_timing_count; i++) {
+    atomic_store_explicit(&tel->hist[i].count, 0, memory_order_relaxed);
+    atomic_store_explicit(&tel->hist[i].sum, 0, memory_order_relaxed);
+    atomic_store_explicit(&tel->hist[i].max, 0, memory_order_relaxed);
+    for (j = 0; j < NVSTUSB_HIST_BUCKETS; j++) {
+      atomic_store_explicit(&tel->hist[i].buckets[j], 0, memory_order_relaxed);
+    }
+  }
+  atomic_store_explicit(&tel->missed_vblanks, 0, memory_order_relaxed);
+  atomic_store_explicit(&tel->dropped_frames, 0, memory_order_relaxed);
+  atomic_store_explicit(&tel->duplicated_frames, 0, memory_order_relaxed);
+  atomic_store_explicit(&tel->eye_resyncs, 0, memory_order_relaxed);
+}
+
+/* add one sample, callable from any thread */
+void
+nvstusb_telemetry_record(
+    struct nvstusb_telemetry *tel,
+    enum nvstusb_timing which,
+    uint64_t us
+    ) {
+  struct nvstusb_histogram *h = &tel->hist[which];
+
+  atomic_fetch_add_explicit(&h->buckets[nvstusb_histogram_bucket(us)], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->sum, us, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+
+  uint_fast64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+  while (us > max &&
+         !atomic_compare_exchange_weak_explicit(&h->max, &max, us,
+           memory_order_relaxed, memory_order_relaxed));
+}
+
+/* summarize one histogram, the samples may still be coming in */
+void
+nvstusb_telemetry_stats(
+    struct nvstusb_telemetry *tel,
+    enum nvstusb_timing which,
+    struct nvstusb_timing_stats *stats
+    ) {
+  struct nvstusb_histogram *h = &tel->hist[which];
+  uint64_t counts[NVSTUSB_HIST_BUCKETS];
+  uint64_t total = 0;
+  int i;
+
+  for (i = 0; i < NVSTUSB_HIST_BUCKETS; i++) {
+    counts[i] = atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+    total += counts[i];
+  }
+
+  memset(stats, 0, sizeof(*stats));
+  stats->count = total;
+  stats->max_us = atomic_load_explicit(&h->max, memory_order_relaxed);
+  if (0 == total) return;
+
+  stats->mean_us = (double) atomic_load_explicit(&h->sum, memory_order_relaxed) /
+                   atomic_load_explicit(&h->count, memory_order_relaxed);
+
+  uint64_t p50 = (total * 50 + 99) / 100;
+  uint64_t p99 = (total * 99 + 99) / 100;
+  uint64_t seen = 0;
+  for (i = 0; i < NVSTUSB_HIST_BUCKETS; i++) {
+    if (0 == counts[i]) continue;
+    seen += counts[i];
+    if (0 == stats->p50_us && seen >= p50) stats->p50_us = nvstusb_histogram_value(i);
+    if (seen >= p99) {
+      stats->p99_us = nvstusb_histogram_value(i);
+      break;
+    }
+  }
+  if (stats->p50_us > stats->max_us) stats->p50_us = stats->max_us;
+  if (stats->p99_us > stats->max_us) stats->p99_us = stats->max_us;
+}
+
+/* print every histogram to stderr */
+void
+nvstusb_telemetry_print(
+    struct nvstusb_telemetry *tel
+    ) {
+  int i;
+
+  for (i = 0; i < nvstusb_timing_count; i++) {
+    struct nvstusb_timing_stats s;
+    nvstusb_telemetry_stats(tel, i, &s);
+    if (0 == s.count) continue;
+    fprintf(stderr, "nvstusb: %-14s n=%-8llu mean %8.1f us  p50 %6llu us  p99 %6llu us  max %6llu us\n",
+      nvstusb_timing_names[i], (unsigned long long) s.count, s.mean_us,
+      (unsigned long long) s.p50_us, (unsigned long long) s.p99_us,
+      (unsigned long long) s.max_us);
+  }
+  fprintf(stderr, "nvstusb: missed vblanks: %llu\n",
+    (unsigned long long) atomic_load_explicit(&tel->missed_vblanks, memory_order_relaxed));
+  fprintf(stderr, "nvstusb: dropped frames %llu, duplicated %llu, eye resyncs %llu\n",
+    (unsigned long long) atomic_load_explicit(&tel->dropped_frames, memory_order_relaxed),
+    (unsigned long long) atomic_load_explicit(&tel->duplicated_frames, memory_order_relaxed),
+    (unsigned long long) atomic_load_explicit(&tel->eye_resyncs, memory_order_relaxed));
+}
@@ -0,0 +1,66 @@
+/* telemetry.h
+ *
+ * Lock-free timing histograms for the swap path. Internal to the library, the
+ * public query API is in nvstusb.h.
+ * */
+
+#ifndef __NVSTUSB_TELEMETRY_H__
+#define __NVSTUSB_TELEMETRY_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "nvstusb.h"
+
+/* log-linear buckets: values below 64 us are exact, above that every power of
+ * two is split into 32 buckets (about 3% resolution), up to ~2^40 us */
+#define NVSTUSB_HIST_SUB_BITS     5
+#define NVSTUSB_HIST_BUCKETS      (64 + 35 * 32)
+
+struct nvstusb_histogram {
+  atomic_uint_fast64_t count;
+  atomic_uint_fast64_t sum;
+  atomic_uint_fast64_t max;
+  atomic_uint_fast32_t buckets[NVSTUSB_HIST_BUCKETS];
+};
+
+struct nvstusb_telemetry {
+  struct nvstusb_histogram hist[nvstusb_timing_count];
+  atomic_uint_fast64_t missed_vblanks;
+
+  /* alternating frames checked against the vblank counter, see eyeseq.h */
+  atomic_uint_fast64_t dropped_frames;
+  atomic_uint_fast64_t duplicated_frames;
+  atomic_uint_fast64_t eye_resyncs;
+
+  /* end of the previous swap, only touched by the swapping thread */
+  uint64_t last_swap;
+
+  /* periodic dump to stderr, 0 = off */
+  uint64_t dump_interval;
+  uint64_t last_dump;
+};
+
+/* monotonic time in microseconds */
+uint64_t nvstusb_time_us(void);
+
+void nvstusb_telemetry_init(struct nvstusb_telemetry *tel);
+void nvstusb_telemetry_reset(struct nvstusb_telemetry *tel);
+void nvstusb_telemetry_record(struct nvstusb_telemetry *tel, enum nvstusb_timing which, uint64_t us);
+void nvstusb_telemetry_stats(struct nvstusb_telemetry *tel, enum nvstusb_timing which, struct nvstusb_timing_stats *stats);
+void nvstusb_telemetry_print(struct nvstusb_telemetry *tel);
+
+/* records the time since start and returns the current time, so consecutive
+ * phases can be chained: t = nvstusb_telemetry_lap(tel, a, t); ... */
+static inline uint64_t
+nvstusb_telemetry_lap(
+    struct nvstusb_telemetry *tel,
+    enum nvstusb_timing which,
+    uint64_t start
+    ) {
+  uint64_t now = nvstusb_time_us();
+  nvstusb_telemetry_record(tel, which, now - start);
+  return now;
+}
+
+#endif // __NVSTUSB_TELEMETRY_H__
@@ -0,0 +1,152 @@
+/* usb.c
+ *
+ * Dispatches the nvstusb_usb_* calls to the backends.
+ * */
+
+#include "usb.h"
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+static const struct nvstusb_usb_backend *nvstusb_usb_backends[] = {
+  &nvstusb_usb_libusb_backend,
+  &nvstusb_usb_mock_backend,
+  &nvstusb_usb_daemon_backend,
+  0
+};
+
+/* share the emitter of a running daemon rather than fighting it for the
+ * device, unless select asks for another one */
+static const char *
+nvstusb_usb_default_backend(
+  const char *select
+) {
+  struct nvstusb_device_info info;
+  if (nvstusb_usb_daemon_backend.enumerate(&info, 1) > 0 &&
+      nvstusb_usb_select_matches(select, &info)) {
+    return "daemon";
+  }
+  return "libusb";
+}
+
+/* look up a backend by name */
+const struct nvstusb_usb_backend *
+nvstusb_usb_get_backend(
+  const char *backend
+) {
+  int i;
+
+  if (0 == backend) backend = nvstusb_usb_default_backend(0);
+  for (i = 0; nvstusb_usb_backends[i] != 0; i++) {
+    if (strcmp(nvstusb_usb_backends[i]->name, backend) == 0) {
+      return nvstusb_usb_backends[i];
+    }
+  }
+  fprintf(stderr, "nvstusb: Unknown usb backend '%s'\n", backend);
+  return 0;
+}
+
+int
+nvstusb_usb_enumerate(
+  const char *backend,
+  struct nvstusb_device_info *devices,
+  int max
+) {
+  const struct nvstusb_usb_backend *found = nvstusb_usb_get_backend(backend);
+  if (0 == found) return -1;
+  return found->enumerate(devices, max);
+}
+
+struct nvstusb_usb_device *
+nvstusb_usb_open_device(
+  const char *backend,
+  const char *firmware,
+  const char *select
+) {
+  if (0 == backend) backend = nvstusb_usb_default_backend(select);
+
+  const struct nvstusb_usb_backend *found = nvstusb_usb_get_backend(backend);
+  if (0 == found) return 0;
+  return found->open_device(firmware, select);
+}
+
+bool
+nvstusb_usb_select_by_serial(
+  const char *select
+) {
+  return 0 != select && 0 == strncmp(select, "serial:", 7);
+}
+
+/* no selection picks the first device, "serial:<serial>" a serial number,
+ * anything else is a port */
+bool
+nvstusb_usb_select_matches(
+  const char *select,
+  const struct nvstusb_device_info *info
+) {
+  if (0 == select || 0 == select[0]) return true;
+  if (nvstusb_usb_select_by_serial(select)) {
+    return 0 != info->serial[0] && 0 == strcmp(select + 7, info->serial);
+  }
+  return 0 == strcmp(select, info->port);
+}
+
+void
+nvstusb_usb_close_device(
+  struct nvstusb_usb_device *dev
+) {
+  if (0 == dev) return;
+  dev->backend->close_device(dev);
+}
+
+int
+nvstusb_usb_write_bulk(
+  struct nvstusb_usb_device *dev,
+  int endpoint,
+  const void *data,
+  int size
+) {
+  assert(dev != 0);
+  return dev->backend->write_bulk(dev, endpoint, data, size);
+}
+
+int
+nvstusb_usb_read_bulk(
+  struct nvstusb_usb_device *dev,
+  int endpoint,
+  void *data,
+  int size
+) {
+  assert(dev != 0);
+  return dev->backend->read_bulk(dev, endpoint, data, size);
+}
+
+int
+nvstusb_usb_write_bulk_async(
+  struct nvstusb_usb_device *dev,
+  int endpoint,
+  const void *data,
+  int size
+) {
+  assert(dev != 0);
+  return dev->backend->write_bulk_async(dev, endpoint, data, size);
+}
+
+void
+nvstusb_usb_set_completion_callback(
+  struct nvstusb_usb_device *dev,
+  nvstusb_usb_completion_func func,
+  void *user
+) {
+  assert(dev != 0);
+  dev->backend->set_completion_callback(dev, func, user);
+}
+
+void
+nvstusb_usb_get_async_stats(
+  struct nvstusb_usb_device *dev,
+  struct nvstusb_usb_async_stats *stats
+) {
+  assert(dev != 0);
+  dev->backend->get_async_stats(dev, stats);
+}
@@ -4,15 +4,97 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-struct nvstusb_usb_device;
+#include "nvstusb.h"
 
-bool nvstusb_usb_init();
-void nvstusb_usb_deinit();
+struct nvstusb_usb_backend;
 
-struct nvstusb_usb_device *nvstusb_usb_open_device(const char *firmware);
+/* every backend's device structure starts with this */
+struct nvstusb_usb_device {
+  const struct nvstusb_usb_backend *backend;
+};
+
+/* errors returned by the backends, same values as libusb uses */
+#define NVSTUSB_USB_ERROR_IO          (-1)
+#define NVSTUSB_USB_ERROR_ACCESS      (-3)
+#define NVSTUSB_USB_ERROR_NO_DEVICE   (-4)
+#define NVSTUSB_USB_ERROR_BUSY        (-6)
+#define NVSTUSB_USB_ERROR_TIMEOUT     (-7)
+
+/* look up a backend by name (0 = "daemon" if nvstusbd is running, "libusb"
+ * otherwise), 0 if there is none */
+const struct nvstusb_usb_backend *nvstusb_usb_get_backend(const char *backend);
+
+/* list the emitters on a backend, see nvstusb_enumerate() */
+int nvstusb_usb_enumerate(const char *backend, struct nvstusb_device_info *devices, int max);
+
+/* open the emitter that select picks (see nvstusb_init_device_async()),
+ * loading the firmware if it isn't running yet. with no backend named that
+ * is the daemon's if it serves the one select asks for, libusb otherwise. devices share no state, each
+ * can be opened and used from its own thread */
+struct nvstusb_usb_device *nvstusb_usb_open_device(const char *backend, const char *firmware, const char *select);
 void nvstusb_usb_close_device(struct nvstusb_usb_device *dev);
 
+/* whether a device is the one select asks for, for the backends */
+bool nvstusb_usb_select_matches(const char *select, const struct nvstusb_device_info *info);
+
+/* whether select names a device by serial number */
+bool nvstusb_usb_select_by_serial(const char *select);
+
 int nvstusb_usb_write_bulk(struct nvstusb_usb_device *dev, int endpoint, const void *data, int size);
 int nvstusb_usb_read_bulk(struct nvstusb_usb_device *dev, int endpoint, void *data, int size);
 
+/* asynchronous writes: the data is copied into one of a fixed set of
+ * preallocated transfers and submitted, a per-device event thread handles the
+ * completions. returns 0 on submit, a negative error otherwise (busy if all
+ * transfers are in flight). never blocks on the device. */
+#define NVSTUSB_USB_ASYNC_TRANSFERS   16
+#define NVSTUSB_USB_ASYNC_MAX_SIZE    64
+
+int nvstusb_usb_write_bulk_async(struct nvstusb_usb_device *dev, int endpoint, const void *data, int size);
+
+/* called from the event thread for every finished asynchronous write, status
+ * is 0 or a negative error, latency is submit to completion */
+typedef void (*nvstusb_usb_completion_func)(void *user, int endpoint, int status, uint64_t latency_us);
+void nvstusb_usb_set_completion_callback(struct nvstusb_usb_device *dev, nvstusb_usb_completion_func func, void *user);
+
+struct nvstusb_usb_async_stats {
+  uint64_t submitted;
+  uint64_t completed;
+  uint64_t failed;            /* completed with an error */
+  uint64_t dropped;           /* no free transfer at submit time */
+  uint64_t last_latency_us;
+  uint64_t max_latency_us;
+  uint64_t total_latency_us;  /* sum over all completed transfers */
+};
+void nvstusb_usb_get_async_stats(struct nvstusb_usb_device *dev, struct nvstusb_usb_async_stats *stats);
+
+/* a usb backend, the functions above dispatch to the named backend
+ * (enumerate, open_device) or the one that opened the device */
+struct nvstusb_usb_backend {
+  const char *name;
+
+  int (*enumerate)(struct nvstusb_device_info *devices, int max);
+  struct nvstusb_usb_device *(*open_device)(const char *firmware, const char *select);
+  void (*close_device)(struct nvstusb_usb_device *dev);
+
+  int (*write_bulk)(struct nvstusb_usb_device *dev, int endpoint, const void *data, int size);
+  int (*read_bulk)(struct nvstusb_usb_device *dev, int endpoint, void *data, int size);
+  int (*write_bulk_async)(struct nvstusb_usb_device *dev, int endpoint, const void *data, int size);
+  void (*set_completion_callback)(struct nvstusb_usb_device *dev, nvstusb_usb_completion_func func, void *user);
+  void (*get_async_stats)(struct nvstusb_usb_device *dev, struct nvstusb_usb_async_stats *stats);
+};
+
+/* talks to a real emitter through libusb-1.0 */
+extern const struct nvstusb_usb_backend nvstusb_usb_libusb_backend;
+
+/* in-process emulation of the emitter, no hardware needed. the latency of
+ * every transfer is taken from NVSTUSB_MOCK_LATENCY_US (default 250), the
+ * number of emitters on the emulated bus from NVSTUSB_MOCK_DEVICES (default
+ * 1) */
+extern const struct nvstusb_usb_backend nvstusb_usb_mock_backend;
+
+/* the emitter of a running nvstusbd, shared with other applications. picked
+ * instead of libusb when no backend is named and the daemon is reachable */
+extern const struct nvstusb_usb_backend nvstusb_usb_daemon_backend;
+
 #endif // __NVSTUSB_USB_H__
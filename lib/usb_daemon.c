@@ -0,0 +1,427 @@
+/* usb_daemon.c
+ *
+ * Client side of nvstusbd: the emitter is owned by the daemon, this backend
+ * hands it the transfers. Eye commands go through a shared memory ring, the
+ * rare register writes over the socket, and key reads are answered from
+ * what the daemon polled, so several applications can share one emitter.
+ * See nvstusbd.h for the protocol.
+ * */
+
+#include "nvstusbd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+
+/* same command bits as in nvstusb.c */
+#define DAEMON_CMD_READ         (0x02)
+
+struct nvstusb_daemon_device {
+  struct nvstusb_usb_device base;
+
+  int sock;
+  struct nvstusbd_shm *shm;
+
+  /* socket requests and completion reporting */
+  pthread_mutex_t lock;
+  nvstusb_usb_completion_func completion_func;
+  void *completion_user;
+  struct nvstusb_usb_async_stats stats;
+
+  /* reply to the last NVSTUSB_CMD_READ, for the following read_bulk */
+  uint8_t reply[4 + NVSTUSB_USB_ASYNC_MAX_SIZE];
+  int reply_size;
+
+  /* delivers the completions */
+  pthread_t thread;
+  int thread_running;
+  atomic_int stop;
+};
+
+const char *
+nvstusbd_socket_path(
+) {
+  static char path[PATH_MAX];
+  const char *env = getenv("NVSTUSBD_SOCKET");
+  if (0 != env && 0 != env[0]) return env;
+
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  if (0 == dir || 0 == dir[0]) dir = "/tmp";
+  snprintf(path, sizeof(path), "%s/%s", dir, NVSTUSBD_SOCKET_NAME);
+  return path;
+}
+
+void
+nvstusbd_futex_wait(
+  atomic_uint *word,
+  unsigned value,
+  int timeout_ms
+) {
+  struct timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+  syscall(SYS_futex, word, FUTEX_WAIT, value, timeout_ms > 0 ? &ts : NULL, NULL, 0);
+}
+
+void
+nvstusbd_futex_wake(
+  atomic_uint *word
+) {
+  syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* connect to the daemon, -1 if it isn't running */
+static int
+nvstusb_daemon_connect(
+) {
+  const char *path = nvstusbd_socket_path();
+  struct sockaddr_un addr;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock < 0) return -1;
+  if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+/* the daemon owns a single emitter, 0 if it isn't running */
+static int
+nvstusb_daemon_enumerate(
+  struct nvstusb_device_info *devices,
+  int max
+) {
+  int sock = nvstusb_daemon_connect();
+  if (sock < 0) return 0;
+
+  struct nvstusbd_msg msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.type = NVSTUSBD_INFO;
+  int found = send(sock, &msg, sizeof(msg), MSG_NOSIGNAL) == sizeof(msg) &&
+              recv(sock, &msg, sizeof(msg), 0) == sizeof(msg) && msg.result == 0;
+  close(sock);
+
+  if (found && max > 0) devices[0] = msg.info;
+  return found;
+}
+
+/* hand the finished transfers to the completion callback */
+static void *
+nvstusb_daemon_thread(
+  void *arg
+) {
+  struct nvstusb_daemon_device *dev = (struct nvstusb_daemon_device *) arg;
+  struct nvstusbd_shm *shm = dev->shm;
+
+  while (!atomic_load(&dev->stop) && !atomic_load(&shm->closed)) {
+    unsigned head = atomic_load_explicit(&shm->cq_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&shm->cq_tail, memory_order_acquire);
+
+    if (head == tail) {
+      atomic_store(&shm->cq_waiting, 1);
+      atomic_thread_fence(memory_order_seq_cst);
+      if (atomic_load(&shm->cq_tail) == tail && !atomic_load(&dev->stop)) {
+        nvstusbd_futex_wait(&shm->cq_tail, tail, 100);
+      }
+      atomic_store(&shm->cq_waiting, 0);
+      continue;
+    }
+
+    struct nvstusbd_completion c = shm->cq[head & (NVSTUSBD_CQ_SIZE - 1)];
+    atomic_store_explicit(&shm->cq_head, head + 1, memory_order_release);
+
+    pthread_mutex_lock(&dev->lock);
+    dev->stats.completed++;
+    if (c.status < 0) dev->stats.failed++;
+    dev->stats.last_latency_us = c.latency_us;
+    if (c.latency_us > dev->stats.max_latency_us) dev->stats.max_latency_us = c.latency_us;
+    dev->stats.total_latency_us += c.latency_us;
+    nvstusb_usb_completion_func func = dev->completion_func;
+    void *user = dev->completion_user;
+    pthread_mutex_unlock(&dev->lock);
+
+    if (0 != func) func(user, c.endpoint, c.status, c.latency_us);
+  }
+  return NULL;
+}
+
+static void nvstusb_daemon_close_device(struct nvstusb_usb_device *base);
+
+/* connect to the daemon and map the shared memory it hands out, if its
+ * emitter is the one select asks for. the daemon loaded the firmware */
+static struct nvstusb_usb_device *
+nvstusb_daemon_open_device(
+  const char *firmware,
+  const char *select
+) {
+  (void) firmware;
+
+  int sock = nvstusb_daemon_connect();
+  if (sock < 0) {
+    fprintf(stderr, "nvstusb: nvstusbd is not running at %s\n", nvstusbd_socket_path());
+    return 0;
+  }
+
+  struct nvstusb_daemon_device *dev = (struct nvstusb_daemon_device *) calloc(1, sizeof(*dev));
+  if (0 == dev) {
+    close(sock);
+    return 0;
+  }
+  dev->base.backend = &nvstusb_usb_daemon_backend;
+  dev->sock = sock;
+  pthread_mutex_init(&dev->lock, NULL);
+  atomic_init(&dev->stop, 0);
+
+  struct nvstusbd_msg msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.type = NVSTUSBD_HELLO;
+  if (send(sock, &msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg)) {
+    fprintf(stderr, "nvstusb: Could not talk to nvstusbd\n");
+    nvstusb_daemon_close_device(&dev->base);
+    return 0;
+  }
+
+  /* the reply carries the shared memory */
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = { &msg, sizeof(msg) };
+  struct msghdr hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+  hdr.msg_control = control;
+  hdr.msg_controllen = sizeof(control);
+
+  int fd = -1;
+  if (recvmsg(sock, &hdr, MSG_CMSG_CLOEXEC) == sizeof(msg) && msg.result == 0) {
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    if (0 != cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+  }
+  if (fd < 0) {
+    fprintf(stderr, "nvstusb: nvstusbd refused the connection\n");
+    nvstusb_daemon_close_device(&dev->base);
+    return 0;
+  }
+  if (!nvstusb_usb_select_matches(select, &msg.info)) {
+    fprintf(stderr, "nvstusb: nvstusbd serves the emitter on port %s, not %s\n", msg.info.port, select);
+    close(fd);
+    nvstusb_daemon_close_device(&dev->base);
+    return 0;
+  }
+
+  void *p = mmap(0, sizeof(struct nvstusbd_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (MAP_FAILED == p) {
+    perror("nvstusb: Could not map nvstusbd shared memory");
+    nvstusb_daemon_close_device(&dev->base);
+    return 0;
+  }
+  dev->shm = (struct nvstusbd_shm *) p;
+  if (dev->shm->magic != NVSTUSBD_MAGIC || dev->shm->version != NVSTUSBD_VERSION) {
+    fprintf(stderr, "nvstusb: nvstusbd speaks another protocol version\n");
+    nvstusb_daemon_close_device(&dev->base);
+    return 0;
+  }
+
+  if (pthread_create(&dev->thread, NULL, nvstusb_daemon_thread, dev) != 0) {
+    fprintf(stderr, "nvstusb: Unable to start nvstusbd completion thread\n");
+    nvstusb_daemon_close_device(&dev->base);
+    return 0;
+  }
+  dev->thread_running = 1;
+
+  fprintf(stderr, "nvstusb: Using the 3d stereo controller of nvstusbd at %s...\n", nvstusbd_socket_path());
+  return &dev->base;
+}
+
+static void
+nvstusb_daemon_close_device(
+  struct nvstusb_usb_device *base
+) {
+  struct nvstusb_daemon_device *dev = (struct nvstusb_daemon_device *) base;
+
+  if (dev->thread_running) {
+    atomic_store(&dev->stop, 1);
+    nvstusbd_futex_wake(&dev->shm->cq_tail);
+    pthread_join(dev->thread, NULL);
+  }
+  if (0 != dev->shm) {
+    atomic_store(&dev->shm->closed, 1);
+    nvstusbd_futex_wake(&dev->shm->tx_tail);
+    munmap(dev->shm, sizeof(*dev->shm));
+  }
+  close(dev->sock);
+  pthread_mutex_destroy(&dev->lock);
+  free(dev);
+}
+
+/* take what the daemon accumulated for this client */
+static char
+nvstusb_daemon_take(
+  atomic_int *value
+) {
+  int v = atomic_exchange(value, 0);
+  if (v > 127) return 127;
+  if (v < -128) return -128;
+  return v;
+}
+
+/* register reads are answered from the keys the daemon polled, everything
+ * else is done by the daemon */
+static int
+nvstusb_daemon_write_bulk(
+  struct nvstusb_usb_device *base,
+  int endpoint,
+  const void *data,
+  int size
+) {
+  struct nvstusb_daemon_device *dev = (struct nvstusb_daemon_device *) base;
+  const uint8_t *cmd = (const uint8_t *) data;
+
+  if (endpoint == 2 && size >= 4 && (cmd[0] & DAEMON_CMD_READ)) {
+    int count = cmd[2];
+    if (count > NVSTUSB_USB_ASYNC_MAX_SIZE) count = NVSTUSB_USB_ASYNC_MAX_SIZE;
+    memset(dev->reply, 0, sizeof(dev->reply));
+    dev->reply[0] = cmd[1];
+    dev->reply[1] = count;
+    dev->reply[2] = size >> 8;
+    dev->reply[3] = size;
+
+    /* the key status at 0x201F, see nvstusb_read_keys() */
+    if (cmd[1] == 0x18 && count >= 3) {
+      dev->reply[4] = nvstusb_daemon_take(&dev->shm->wheel);
+      dev->reply[5] = nvstusb_daemon_take(&dev->shm->pressed_wheel);
+      dev->reply[6] = atomic_exchange(&dev->shm->toggled, 0) ? 0x01 : 0x00;
+    }
+    dev->reply_size = 4 + count;
+    return 0;
+  }
+
+  if (size > NVSTUSB_USB_ASYNC_MAX_SIZE) return NVSTUSB_USB_ERROR_IO;
+
+  struct nvstusbd_msg msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.type = NVSTUSBD_WRITE;
+  msg.endpoint = endpoint;
+  msg.size = size;
+  memcpy(msg.data, data, size);
+
+  pthread_mutex_lock(&dev->lock);
+  int res = NVSTUSB_USB_ERROR_NO_DEVICE;
+  if (send(dev->sock, &msg, sizeof(msg), MSG_NOSIGNAL) == sizeof(msg) &&
+      recv(dev->sock, &msg, sizeof(msg), 0) == sizeof(msg)) {
+    res = msg.result;
+  }
+  pthread_mutex_unlock(&dev->lock);
+  return res;
+}
+
+static int
+nvstusb_daemon_read_bulk(
+  struct nvstusb_usb_device *base,
+  int endpoint,
+  void *data,
+  int size
+) {
+  struct nvstusb_daemon_device *dev = (struct nvstusb_daemon_device *) base;
+
+  if (endpoint != 4 || 0 == dev->reply_size) return 0;
+
+  int n = size < dev->reply_size ? size : dev->reply_size;
+  memcpy(data, dev->reply, n);
+  dev->reply_size = 0;
+  return n;
+}
+
+/* queue a write for the daemon, only one thread may call this */
+static int
+nvstusb_daemon_write_bulk_async(
+  struct nvstusb_usb_device *base,
+  int endpoint,
+  const void *data,
+  int size
+) {
+  struct nvstusb_daemon_device *dev = (struct nvstusb_daemon_device *) base;
+  struct nvstusbd_shm *shm = dev->shm;
+  assert(size <= NVSTUSB_USB_ASYNC_MAX_SIZE);
+
+  if (atomic_load(&shm->closed)) return NVSTUSB_USB_ERROR_NO_DEVICE;
+
+  unsigned tail = atomic_load_explicit(&shm->tx_tail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit(&shm->tx_head, memory_order_acquire);
+  if (tail - head == NVSTUSBD_TX_SIZE) {
+    pthread_mutex_lock(&dev->lock);
+    dev->stats.dropped++;
+    pthread_mutex_unlock(&dev->lock);
+    return NVSTUSB_USB_ERROR_BUSY;
+  }
+
+  struct nvstusbd_transfer *t = &shm->tx[tail & (NVSTUSBD_TX_SIZE - 1)];
+  t->endpoint = endpoint;
+  t->size = size;
+  memcpy(t->data, data, size);
+  atomic_store_explicit(&shm->tx_tail, tail + 1, memory_order_release);
+
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&shm->tx_waiting, memory_order_relaxed)) {
+    nvstusbd_futex_wake(&shm->tx_tail);
+  }
+
+  pthread_mutex_lock(&dev->lock);
+  dev->stats.submitted++;
+  pthread_mutex_unlock(&dev->lock);
+  return 0;
+}
+
+static void
+nvstusb_daemon_set_completion_callback(
+  struct nvstusb_usb_device *base,
+  nvstusb_usb_completion_func func,
+  void *user
+) {
+  struct nvstusb_daemon_device *dev = (struct nvstusb_daemon_device *) base;
+
+  pthread_mutex_lock(&dev->lock);
+  dev->completion_func = func;
+  dev->completion_user = user;
+  pthread_mutex_unlock(&dev->lock);
+}
+
+static void
+nvstusb_daemon_get_async_stats(
+  struct nvstusb_usb_device *base,
+  struct nvstusb_usb_async_stats *stats
+) {
+  struct nvstusb_daemon_device *dev = (struct nvstusb_daemon_device *) base;
+
+  pthread_mutex_lock(&dev->lock);
+  *stats = dev->stats;
+  pthread_mutex_unlock(&dev->lock);
+}
+
+const struct nvstusb_usb_backend nvstusb_usb_daemon_backend = {
+  "daemon",
+  nvstusb_daemon_enumerate,
+  nvstusb_daemon_open_device,
+  nvstusb_daemon_close_device,
+  nvstusb_daemon_write_bulk,
+  nvstusb_daemon_read_bulk,
+  nvstusb_daemon_write_bulk_async,
+  nvstusb_daemon_set_completion_callback,
+  nvstusb_daemon_get_async_stats,
+};
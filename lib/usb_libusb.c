@@ -1,16 +1,56 @@
 #include "usb.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <libusb-1.0/libusb.h>
 
-static struct libusb_context *nvstusb_usb_context = 0;
 static const int nvstusb_usb_debug_level = 3;
 
-struct nvstusb_usb_device {
+/* how long a transfer to the emitter may take before it counts as lost, an
+ * emitter that stopped answering must not hang the thread talking to it */
+#define NVSTUSB_TRANSFER_TIMEOUT_MS 1000
+
+struct nvstusb_usb_async_slot {
+  struct nvstusb_libusb_device *dev;
+  struct libusb_transfer *transfer;
+  uint64_t submit_time;
+  int busy;
+  struct nvstusb_usb_async_slot *next;
+  uint8_t buf[NVSTUSB_USB_ASYNC_MAX_SIZE];
+};
+
+struct nvstusb_libusb_device {
+  struct nvstusb_usb_device base;
+
+  /* every device has its own libusb context, so devices driven from
+   * different threads never contend for libusb's event handling */
+  struct libusb_context *usb_ctx;
   struct libusb_device_handle *handle;
+  char port[32];
+
+  /* asynchronous transfers, free ones are kept in a list */
+  struct nvstusb_usb_async_slot slots[NVSTUSB_USB_ASYNC_TRANSFERS];
+  struct nvstusb_usb_async_slot *free_slots;
+  int in_flight;
+  pthread_mutex_t lock;
+
+  /* completion reporting, protected by lock */
+  nvstusb_usb_completion_func completion_func;
+  void *completion_user;
+  struct nvstusb_usb_async_stats stats;
+
+  /* event handling thread */
+  pthread_t event_thread;
+  int event_thread_running;
+  int stop_events;
 };
 
  /* convert a libusb error to a readable string */
@@ -37,38 +77,114 @@ libusb_error_to_string(
   return "Unknown error";
 }  
 
-/* initialize usb */
-bool 
-nvstusb_usb_init(
+/* create a libusb context */
+static struct libusb_context *
+nvstusb_libusb_new_context(
 ) {
-  if (0 != nvstusb_usb_context) {
-    return true;
-  }
-
   struct libusb_context *ctx = 0;
   libusb_init(&ctx);
   if (0 == ctx) {
     fprintf(stderr, "nvstusb: Could not initialize libusb\n");
-    return false;
+    return 0;
   }
 
   libusb_set_debug(ctx, nvstusb_usb_debug_level);
-  fprintf(stderr, "nvstusb: libusb initialized, debug level %d\n", nvstusb_usb_debug_level);
+  return ctx;
+}
+
+/* the port path of a device like the kernel names it, "bus-port.port..." */
+static void
+nvstusb_libusb_port_name(
+  struct libusb_device *device,
+  char *name,
+  size_t size
+) {
+  uint8_t ports[8];
+  int count = libusb_get_port_numbers(device, ports, sizeof(ports));
+  int i, len;
 
-  nvstusb_usb_context = ctx;
+  len = snprintf(name, size, "%d", libusb_get_bus_number(device));
+  for (i = 0; i < count && len > 0 && (size_t) len < size; i++) {
+    len += snprintf(name + len, size - len, "%c%d", i ? '.' : '-', ports[i]);
+  }
+}
+
+/* describe an emitter, reading the serial number needs opening it */
+static bool
+nvstusb_libusb_device_info(
+  struct libusb_device *device,
+  bool want_serial,
+  struct nvstusb_device_info *info
+) {
+  struct libusb_device_descriptor desc;
+  if (libusb_get_device_descriptor(device, &desc) < 0 ||
+      desc.idVendor != 0x0955 || desc.idProduct != 0x0007) {
+    return false;
+  }
+
+  memset(info, 0, sizeof(*info));
+  nvstusb_libusb_port_name(device, info->port, sizeof(info->port));
+
+  struct libusb_device_handle *handle = 0;
+  if (want_serial && 0 != desc.iSerialNumber && libusb_open(device, &handle) == 0) {
+    libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber,
+      (unsigned char *) info->serial, sizeof(info->serial));
+    libusb_close(handle);
+  }
   return true;
 }
 
-/* shutdown usb */
-void
-nvstusb_usb_deinit(
+/* open the first emitter select matches, 0 if there is none */
+static struct libusb_device_handle *
+nvstusb_libusb_find_device(
+  struct libusb_context *ctx,
+  const char *select
 ) {
-  if (0 == nvstusb_usb_context) return;
+  struct libusb_device **list = 0;
+  struct libusb_device_handle *handle = 0;
+  ssize_t count = libusb_get_device_list(ctx, &list);
+  ssize_t i;
+
+  for (i = 0; i < count && 0 == handle; i++) {
+    struct nvstusb_device_info info;
+    if (!nvstusb_libusb_device_info(list[i], nvstusb_usb_select_by_serial(select), &info) ||
+        !nvstusb_usb_select_matches(select, &info)) {
+      continue;
+    }
+    int res = libusb_open(list[i], &handle);
+    if (res < 0) {
+      fprintf(stderr, "nvstusb: Could not open the controller on port %s... Error %d: %s\n", info.port, res, libusb_error_to_string(res));
+      handle = 0;
+    }
+  }
+  if (count >= 0) libusb_free_device_list(list, 1);
+  return handle;
+}
 
-  libusb_exit(nvstusb_usb_context);
-  fprintf(stderr, "nvstusb: libusb deinitialized\n");
+/* list the emitters on the bus */
+static int
+nvstusb_libusb_enumerate(
+  struct nvstusb_device_info *devices,
+  int max
+) {
+  struct libusb_context *ctx = nvstusb_libusb_new_context();
+  if (0 == ctx) return -1;
+
+  struct libusb_device **list = 0;
+  ssize_t count = libusb_get_device_list(ctx, &list);
+  ssize_t i;
+  int found = 0;
+
+  for (i = 0; i < count; i++) {
+    struct nvstusb_device_info info;
+    if (!nvstusb_libusb_device_info(list[i], true, &info)) continue;
+    if (found < max) devices[found] = info;
+    found++;
+  }
+  if (count >= 0) libusb_free_device_list(list, 1);
 
-  nvstusb_usb_context = 0;
+  libusb_exit(ctx);
+  return found;
 }
     
 /* get the number of endpoints on a device */
@@ -94,7 +210,7 @@ nvstusb_usb_get_numendpoints(
 
 static bool
 nvstusb_usb_needs_firmware(
-  struct nvstusb_usb_device *dev
+  struct nvstusb_libusb_device *dev
 ) {
   assert(dev != 0);
   assert(dev->handle != 0);
@@ -103,126 +219,490 @@ nvstusb_usb_needs_firmware(
 }
 
 
+/* monotonic time in microseconds */
+static uint64_t
+nvstusb_usb_time_us(
+) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000 + (uint64_t)ts.tv_nsec/1000;
+}
+
+/* completion of an asynchronous transfer, runs on the event thread */
+static void
+nvstusb_usb_async_done(
+  struct libusb_transfer *transfer
+) {
+  struct nvstusb_usb_async_slot *slot = (struct nvstusb_usb_async_slot *) transfer->user_data;
+  struct nvstusb_libusb_device *dev = slot->dev;
+  uint64_t latency = nvstusb_usb_time_us() - slot->submit_time;
+  int status = 0;
+
+  switch (transfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED: status = 0;                      break;
+    case LIBUSB_TRANSFER_TIMED_OUT: status = LIBUSB_ERROR_TIMEOUT;   break;
+    case LIBUSB_TRANSFER_CANCELLED: status = LIBUSB_ERROR_INTERRUPTED; break;
+    case LIBUSB_TRANSFER_STALL:     status = LIBUSB_ERROR_PIPE;      break;
+    case LIBUSB_TRANSFER_NO_DEVICE: status = LIBUSB_ERROR_NO_DEVICE; break;
+    case LIBUSB_TRANSFER_OVERFLOW:  status = LIBUSB_ERROR_OVERFLOW;  break;
+    default:                        status = LIBUSB_ERROR_IO;        break;
+  }
+
+  pthread_mutex_lock(&dev->lock);
+  dev->stats.completed++;
+  if (status < 0) dev->stats.failed++;
+  dev->stats.last_latency_us = latency;
+  dev->stats.total_latency_us += latency;
+  if (latency > dev->stats.max_latency_us) dev->stats.max_latency_us = latency;
+  nvstusb_usb_completion_func func = dev->completion_func;
+  void *user = dev->completion_user;
+
+  slot->busy = 0;
+  slot->next = dev->free_slots;
+  dev->free_slots = slot;
+  dev->in_flight--;
+  pthread_mutex_unlock(&dev->lock);
+
+  if (status < 0 && status != LIBUSB_ERROR_INTERRUPTED) {
+    fprintf(stderr, "nvstusb: Asynchronous transfer failed... Error %d: %s\n", status, libusb_error_to_string(status));
+  }
+  if (0 != func) {
+    func(user, transfer->endpoint & ~LIBUSB_ENDPOINT_IN, status, latency);
+  }
+}
+
+/* handle libusb events until asked to stop */
+static void *
+nvstusb_usb_event_thread(
+  void *arg
+) {
+  struct nvstusb_libusb_device *dev = (struct nvstusb_libusb_device *) arg;
+
+  while (!dev->stop_events) {
+    struct timeval tv = { 0, 100000 };
+    libusb_handle_events_timeout_completed(dev->usb_ctx, &tv, &dev->stop_events);
+  }
+  return NULL;
+}
+
+/* preallocate the asynchronous transfers and start the event thread */
+static bool
+nvstusb_usb_async_init(
+  struct nvstusb_libusb_device *dev
+) {
+  int i;
+
+  pthread_mutex_init(&dev->lock, NULL);
+  dev->free_slots = 0;
+  dev->in_flight = 0;
+  dev->completion_func = 0;
+  dev->completion_user = 0;
+  memset(&dev->stats, 0, sizeof(dev->stats));
+  dev->event_thread_running = 0;
+  dev->stop_events = 0;
+
+  for (i = 0; i < NVSTUSB_USB_ASYNC_TRANSFERS; i++) {
+    struct nvstusb_usb_async_slot *slot = &dev->slots[i];
+    slot->dev = dev;
+    slot->transfer = libusb_alloc_transfer(0);
+    if (0 == slot->transfer) {
+      fprintf(stderr, "nvstusb: Could not allocate asynchronous transfers...\n");
+      return false;
+    }
+    slot->next = dev->free_slots;
+    dev->free_slots = slot;
+  }
+
+  if (pthread_create(&dev->event_thread, NULL, nvstusb_usb_event_thread, dev) != 0) {
+    fprintf(stderr, "nvstusb: Unable to start usb event thread\n");
+    return false;
+  }
+  dev->event_thread_running = 1;
+  return true;
+}
+
+/* cancel whatever is in flight, stop the event thread, free the transfers */
+static void
+nvstusb_usb_async_deinit(
+  struct nvstusb_libusb_device *dev
+) {
+  int i;
+
+  if (dev->event_thread_running) {
+    pthread_mutex_lock(&dev->lock);
+    for (i = 0; i < NVSTUSB_USB_ASYNC_TRANSFERS; i++) {
+      if (dev->slots[i].busy) libusb_cancel_transfer(dev->slots[i].transfer);
+    }
+    pthread_mutex_unlock(&dev->lock);
+
+    /* give the cancellations a moment to come back through the event thread */
+    for (i = 0; i < 100; i++) {
+      pthread_mutex_lock(&dev->lock);
+      int in_flight = dev->in_flight;
+      pthread_mutex_unlock(&dev->lock);
+      if (0 == in_flight) break;
+      usleep(1000);
+    }
+
+    dev->stop_events = 1;
+    pthread_join(dev->event_thread, NULL);
+    dev->event_thread_running = 0;
+  }
+
+  for (i = 0; i < NVSTUSB_USB_ASYNC_TRANSFERS; i++) {
+    if (0 != dev->slots[i].transfer) libusb_free_transfer(dev->slots[i].transfer);
+    dev->slots[i].transfer = 0;
+  }
+  pthread_mutex_destroy(&dev->lock);
+}
+
+/* the largest control transfer usbfs accepts, coalesced firmware records are
+ * split at this size */
+#define NVSTUSB_FW_MAX_TRANSFER 4096
+
+/* how long to wait for the emitter to come back after a reset */
+#define NVSTUSB_REENUMERATE_TIMEOUT_MS 5000
+#define NVSTUSB_REENUMERATE_POLL_MS 5
+
+/* one control transfer of the firmware upload */
+struct nvstusb_fw_transfer {
+  uint16_t addr;
+  uint16_t length;
+  uint32_t offset;    /* into nvstusb_fw_plan.data */
+};
+
+/* a firmware file parsed into the transfers that upload it */
+struct nvstusb_fw_plan {
+  char *filename;
+  dev_t device;
+  ino_t inode;
+  off_t size;
+  time_t mtime;
+  uint8_t *data;
+  struct nvstusb_fw_transfer *transfers;
+  int count;
+  int records;
+};
+
+/* parsed once per process, reused as long as the file doesn't change.
+ * emitters coming up at the same time take turns uploading it */
+static struct nvstusb_fw_plan nvstusb_fw_cache;
+static pthread_mutex_t nvstusb_fw_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+nvstusb_usb_free_firmware(
+  struct nvstusb_fw_plan *plan
+) {
+  free(plan->filename);
+  free(plan->data);
+  free(plan->transfers);
+  memset(plan, 0, sizeof(*plan));
+}
+
+/* Parse a firmware file into an upload plan. The file is a sequence of
+ * records, a big endian 16 bit length and 16 bit address followed by the
+ * data. Records that continue where the previous one stopped are merged into
+ * one transfer; records are never reordered, so writes to the CPU control
+ * register still happen where the file puts them. */
+static const struct nvstusb_fw_plan *
+nvstusb_usb_parse_firmware(
+  const char *filename
+) {
+  struct nvstusb_fw_plan *plan = &nvstusb_fw_cache;
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) { perror(filename); return 0; }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) { perror(filename); close(fd); return 0; }
+
+  if (0 != plan->filename && 0 == strcmp(plan->filename, filename) &&
+      plan->device == st.st_dev && plan->inode == st.st_ino &&
+      plan->size == st.st_size && plan->mtime == st.st_mtime) {
+    close(fd);
+    return plan;
+  }
+  nvstusb_usb_free_firmware(plan);
+
+  const uint8_t *file = 0;
+  if (st.st_size > 0) {
+    file = (const uint8_t *) mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (0 == file || MAP_FAILED == file) {
+    fprintf(stderr, "nvstusb: Could not map firmware file %s\n", filename);
+    return 0;
+  }
+
+  /* every record has a header, so the data and the transfers both fit in
+   * what a file of this size could hold */
+  size_t max_records = st.st_size / 4;
+  plan->data = (uint8_t *) malloc(st.st_size);
+  plan->transfers = (struct nvstusb_fw_transfer *) malloc(max_records * sizeof(struct nvstusb_fw_transfer));
+  if (0 == plan->data || 0 == plan->transfers) {
+    fprintf(stderr, "nvstusb: Out of memory parsing firmware\n");
+    munmap((void *) file, st.st_size);
+    nvstusb_usb_free_firmware(plan);
+    return 0;
+  }
+
+  uint32_t used = 0;
+  off_t pos = 0;
+  while (pos + 4 <= st.st_size) {
+    uint16_t length = (file[pos]<<8) | file[pos+1];
+    uint16_t addr   = (file[pos+2]<<8) | file[pos+3];
+    pos += 4;
+
+    if (pos + length > st.st_size) {
+      fprintf(stderr, "nvstusb: Firmware file %s is truncated\n", filename);
+      munmap((void *) file, st.st_size);
+      nvstusb_usb_free_firmware(plan);
+      return 0;
+    }
+
+    struct nvstusb_fw_transfer *last = plan->count > 0 ? &plan->transfers[plan->count-1] : 0;
+    if (0 != last && last->addr + last->length == addr &&
+        last->length + length <= NVSTUSB_FW_MAX_TRANSFER) {
+      last->length += length;
+    } else {
+      struct nvstusb_fw_transfer *t = &plan->transfers[plan->count++];
+      t->addr = addr;
+      t->length = length;
+      t->offset = used;
+    }
+
+    memcpy(plan->data + used, file + pos, length);
+    used += length;
+    pos += length;
+    plan->records++;
+  }
+  munmap((void *) file, st.st_size);
+
+  plan->filename = strdup(filename);
+  plan->device = st.st_dev;
+  plan->inode = st.st_ino;
+  plan->size = st.st_size;
+  plan->mtime = st.st_mtime;
+  return plan;
+}
+
 /* upload firmware file */
 static int
 nvstusb_usb_load_firmware(
-  struct nvstusb_usb_device *dev,
+  struct nvstusb_libusb_device *dev,
   const char *filename
 ) {
   assert(dev != 0);
   assert(dev->handle != 0);
 
-  FILE *fw = fopen(filename, "rb");
-  if (!fw) { perror(filename); return -1; }
-  
-  fprintf(stderr, "nvstusb: Loading firmware...\n");
-
-  uint8_t lenPos[4];
-  uint8_t buf[1024];
-
-  while(fread(lenPos, 4, 1, fw) == 1) {
-    uint16_t length = (lenPos[0]<<8) | lenPos[1];
-    uint16_t pos    = (lenPos[2]<<8) | lenPos[3];
+  pthread_mutex_lock(&nvstusb_fw_lock);
+  const struct nvstusb_fw_plan *plan = nvstusb_usb_parse_firmware(filename);
+  if (0 == plan) {
+    pthread_mutex_unlock(&nvstusb_fw_lock);
+    return LIBUSB_ERROR_OTHER;
+  }
   
-    if (fread(buf, length, 1, fw) != 1) { 
-      perror(filename); 
-      return LIBUSB_ERROR_OTHER; 
-    }
+  fprintf(stderr, "nvstusb: Loading firmware on port %s, %d records in %d transfers...\n", dev->port, plan->records, plan->count);
 
+  int i;
+  for (i = 0; i < plan->count; i++) {
+    const struct nvstusb_fw_transfer *t = &plan->transfers[i];
     int res = libusb_control_transfer(
       dev->handle,
       LIBUSB_REQUEST_TYPE_VENDOR, 
       0xA0, /* 'Firmware load' */
-      pos, 0x0000,
-      buf, length,
-      0
+      t->addr, 0x0000,
+      plan->data + t->offset, t->length,
+      NVSTUSB_TRANSFER_TIMEOUT_MS
     );
     if (res < 0) {
       fprintf(stderr, "nvstusb: Error uploading firmware... Error %d: %s\n", res, libusb_error_to_string(res));
+      pthread_mutex_unlock(&nvstusb_fw_lock);
       return res;
     }
   }
 
-  fclose(fw);
+  pthread_mutex_unlock(&nvstusb_fw_lock);
   return 0;
 }       
 
-/* open 3d controller */
-struct nvstusb_usb_device *
-nvstusb_usb_open_device(
-  const char *firmware
+/* Wait for the emitter to (re)appear running its firmware, that is with
+ * endpoints. It gets a new address but stays on its port, so other emitters
+ * aren't mistaken for it. Polls instead of sleeping for a fixed time, so this
+ * returns as soon as the device has re-enumerated. */
+static struct libusb_device_handle *
+nvstusb_usb_wait_for_device(
+  struct nvstusb_libusb_device *dev
 ) {
-  assert(nvstusb_usb_context != 0);
+  uint64_t deadline = nvstusb_usb_time_us() + NVSTUSB_REENUMERATE_TIMEOUT_MS * 1000;
+
+  do {
+    struct libusb_device_handle *handle = nvstusb_libusb_find_device(dev->usb_ctx, dev->port);
+    if (0 != handle) {
+      struct libusb_config_descriptor *cfgDesc = 0;
+      int res = libusb_get_active_config_descriptor(libusb_get_device(handle), &cfgDesc);
+      if (res == 0) {
+        int num = cfgDesc->interface->altsetting->bNumEndpoints;
+        libusb_free_config_descriptor(cfgDesc);
+        if (num > 0) return handle;
+      }
+      libusb_close(handle);
+    }
+    usleep(NVSTUSB_REENUMERATE_POLL_MS * 1000);
+  } while (nvstusb_usb_time_us() < deadline);
+
+  fprintf(stderr, "nvstusb: NVIDIA 3d stereo controller on port %s did not come back after %d ms\n", dev->port, NVSTUSB_REENUMERATE_TIMEOUT_MS);
+  return 0;
+}
+
+static void nvstusb_libusb_close_device(struct nvstusb_usb_device *base);
 
+/* open 3d controller */
+static struct nvstusb_usb_device *
+nvstusb_libusb_open_device(
+  const char *firmware,
+  const char *select
+) {
   int res; 
-  struct libusb_device_handle *handle = 
-    libusb_open_device_with_vid_pid(nvstusb_usb_context, 0x0955, 0x0007);
+  uint64_t t_start = nvstusb_usb_time_us();
+  uint64_t t_firmware = 0, t_reenumerate = 0;
 
+  struct libusb_context *usb_ctx = nvstusb_libusb_new_context();
+  if (0 == usb_ctx) return 0;
+
+  struct libusb_device_handle *handle = nvstusb_libusb_find_device(usb_ctx, select);
   if (0 == handle) {
-    fprintf(stderr, "nvstusb: No NVIDIA 3d stereo controller found...\n");
+    if (0 != select && 0 != select[0]) {
+      fprintf(stderr, "nvstusb: No NVIDIA 3d stereo controller matching '%s' found...\n", select);
+    } else {
+      fprintf(stderr, "nvstusb: No NVIDIA 3d stereo controller found...\n");
+    }
+    libusb_exit(usb_ctx);
     return 0;
   }
 
-  fprintf(stderr, "nvstusb: Found NVIDIA 3d stereo controller...\n");
-
-  struct nvstusb_usb_device *dev = (struct nvstusb_usb_device *) malloc(sizeof(*dev));
+  struct nvstusb_libusb_device *dev = (struct nvstusb_libusb_device *) calloc(1, sizeof(*dev));
+  dev->base.backend = &nvstusb_usb_libusb_backend;
+  dev->usb_ctx = usb_ctx;
   dev->handle = handle;
+  nvstusb_libusb_port_name(libusb_get_device(handle), dev->port, sizeof(dev->port));
+  fprintf(stderr, "nvstusb: Found NVIDIA 3d stereo controller on port %s...\n", dev->port);
+  uint64_t t_open = nvstusb_usb_time_us();
 
   if (nvstusb_usb_needs_firmware(dev)) {
     if (nvstusb_usb_load_firmware(dev, firmware) < 0) {
-      free(dev);
+      nvstusb_libusb_close_device(&dev->base);
       return 0;
     }
+    t_firmware = nvstusb_usb_time_us();
+
+    /* the reset makes the device drop off the bus and come back running the
+     * firmware, with a new address */
     libusb_reset_device(dev->handle);
     libusb_close(dev->handle);
-    usleep(250000);
-    handle = dev->handle = libusb_open_device_with_vid_pid(nvstusb_usb_context, 0x0955, 0x0007);
-    libusb_reset_device(dev->handle);
-    usleep(250000);
+    handle = dev->handle = nvstusb_usb_wait_for_device(dev);
+    if (0 == handle) {
+      nvstusb_libusb_close_device(&dev->base);
+      return 0;
+    }
+
+    /* reset the freshly started firmware as well, if that makes the device
+     * re-enumerate again the handle is stale and has to be reopened */
+    res = libusb_reset_device(dev->handle);
+    if (res == LIBUSB_ERROR_NOT_FOUND || res == LIBUSB_ERROR_NO_DEVICE) {
+      libusb_close(dev->handle);
+      handle = dev->handle = nvstusb_usb_wait_for_device(dev);
+      if (0 == handle) {
+        nvstusb_libusb_close_device(&dev->base);
+        return 0;
+      }
+    }
+    t_reenumerate = nvstusb_usb_time_us();
   }
-  libusb_set_configuration(dev->handle, 1); // TODO: error checking
-  libusb_claim_interface(dev->handle, 0);   // TODO: error checking
 
-  return dev;
+  /* only set the configuration if it isn't already active, setting it again
+   * would needlessly reset the device state (and fails if a driver has it) */
+  int config = 0;
+  res = libusb_get_configuration(dev->handle, &config);
+  if (res == 0 && config != 1) {
+    res = libusb_set_configuration(dev->handle, 1);
+  }
+  if (res < 0) {
+    fprintf(stderr, "nvstusb: Could not set configuration... Error %d: %s\n", res, libusb_error_to_string(res));
+    nvstusb_libusb_close_device(&dev->base);
+    return 0;
+  }
+
+  res = libusb_claim_interface(dev->handle, 0);
+  if (res < 0) {
+    fprintf(stderr, "nvstusb: Could not claim interface... Error %d: %s\n", res, libusb_error_to_string(res));
+    nvstusb_libusb_close_device(&dev->base);
+    return 0;
+  }
+  uint64_t t_configure = nvstusb_usb_time_us();
+
+  if (!nvstusb_usb_async_init(dev)) {
+    nvstusb_libusb_close_device(&dev->base);
+    return 0;
+  }
+  uint64_t t_end = nvstusb_usb_time_us();
+
+  /* startup time of each phase, the firmware ones are 0 if it was running */
+  uint64_t t_loaded = t_firmware ? t_firmware : t_open;
+  uint64_t t_ready = t_reenumerate ? t_reenumerate : t_loaded;
+  fprintf(stderr, "nvstusb: Startup took %.1f ms (open %.1f, firmware %.1f, re-enumeration %.1f, configure %.1f, async %.1f)\n",
+    (t_end - t_start) / 1000.0, (t_open - t_start) / 1000.0,
+    (t_loaded - t_open) / 1000.0, (t_ready - t_loaded) / 1000.0,
+    (t_configure - t_ready) / 1000.0, (t_end - t_configure) / 1000.0);
+
+  return &dev->base;
 }
 
 /* close the device */
-void
-nvstusb_usb_close_device(
-  struct nvstusb_usb_device *dev
+static void
+nvstusb_libusb_close_device(
+  struct nvstusb_usb_device *base
 ) {
+  struct nvstusb_libusb_device *dev = (struct nvstusb_libusb_device *) base;
   if (0 == dev) return;
 
+  nvstusb_usb_async_deinit(dev);
+
   if (0 != dev->handle) {
     libusb_close(dev->handle);
   }
+  if (0 != dev->usb_ctx) {
+    libusb_exit(dev->usb_ctx);
+  }
   free(dev);
 }
 
 /* send data to an endpoint, bulk transfer */
-int
-nvstusb_usb_write_bulk(
-  struct nvstusb_usb_device *dev,
+static int
+nvstusb_libusb_write_bulk(
+  struct nvstusb_usb_device *base,
   int endpoint,
   const void *data,
   int size
 ) {
+  struct nvstusb_libusb_device *dev = (struct nvstusb_libusb_device *) base;
   int sent = 0;
   
   assert(dev         != 0);
   assert(dev->handle != 0);
 
-  return libusb_bulk_transfer(dev->handle, endpoint | LIBUSB_ENDPOINT_OUT, (unsigned char*)data, size, &sent, 0);
+  return libusb_bulk_transfer(dev->handle, endpoint | LIBUSB_ENDPOINT_OUT, (unsigned char*)data, size, &sent, NVSTUSB_TRANSFER_TIMEOUT_MS);
 }
 
 /* receive data from an endpoint */
-int
-nvstusb_usb_read_bulk(
-  struct nvstusb_usb_device *dev,
+static int
+nvstusb_libusb_read_bulk(
+  struct nvstusb_usb_device *base,
   int endpoint,
   void *data,
   int size
 ) {
+  struct nvstusb_libusb_device *dev = (struct nvstusb_libusb_device *) base;
   int recvd = 0;
   int res;
   
@@ -233,4 +713,90 @@ nvstusb_usb_read_bulk(
   return recvd;
 }
 
- 
+/* send data to an endpoint without waiting for the device */
+static int
+nvstusb_libusb_write_bulk_async(
+  struct nvstusb_usb_device *base,
+  int endpoint,
+  const void *data,
+  int size
+) {
+  struct nvstusb_libusb_device *dev = (struct nvstusb_libusb_device *) base;
+  assert(dev         != 0);
+  assert(dev->handle != 0);
+  assert(size <= NVSTUSB_USB_ASYNC_MAX_SIZE);
+
+  pthread_mutex_lock(&dev->lock);
+  struct nvstusb_usb_async_slot *slot = dev->free_slots;
+  if (0 == slot) {
+    dev->stats.dropped++;
+    pthread_mutex_unlock(&dev->lock);
+    return LIBUSB_ERROR_BUSY;
+  }
+  dev->free_slots = slot->next;
+  slot->busy = 1;
+  dev->in_flight++;
+  dev->stats.submitted++;
+  pthread_mutex_unlock(&dev->lock);
+
+  memcpy(slot->buf, data, size);
+  libusb_fill_bulk_transfer(slot->transfer, dev->handle, endpoint | LIBUSB_ENDPOINT_OUT,
+    slot->buf, size, nvstusb_usb_async_done, slot, NVSTUSB_TRANSFER_TIMEOUT_MS);
+  slot->submit_time = nvstusb_usb_time_us();
+
+  int res = libusb_submit_transfer(slot->transfer);
+  if (res < 0) {
+    pthread_mutex_lock(&dev->lock);
+    slot->busy = 0;
+    slot->next = dev->free_slots;
+    dev->free_slots = slot;
+    dev->in_flight--;
+    dev->stats.submitted--;
+    dev->stats.dropped++;
+    pthread_mutex_unlock(&dev->lock);
+  }
+  return res;
+}
+
+/* set the function called for every finished asynchronous write */
+static void
+nvstusb_libusb_set_completion_callback(
+  struct nvstusb_usb_device *base,
+  nvstusb_usb_completion_func func,
+  void *user
+) {
+  struct nvstusb_libusb_device *dev = (struct nvstusb_libusb_device *) base;
+  assert(dev != 0);
+
+  pthread_mutex_lock(&dev->lock);
+  dev->completion_func = func;
+  dev->completion_user = user;
+  pthread_mutex_unlock(&dev->lock);
+}
+
+/* copy out the asynchronous transfer statistics */
+static void
+nvstusb_libusb_get_async_stats(
+  struct nvstusb_usb_device *base,
+  struct nvstusb_usb_async_stats *stats
+) {
+  struct nvstusb_libusb_device *dev = (struct nvstusb_libusb_device *) base;
+  assert(dev   != 0);
+  assert(stats != 0);
+
+  pthread_mutex_lock(&dev->lock);
+  *stats = dev->stats;
+  pthread_mutex_unlock(&dev->lock);
+}
+
+const struct nvstusb_usb_backend nvstusb_usb_libusb_backend = {
+  "libusb",
+  nvstusb_libusb_enumerate,
+  nvstusb_libusb_open_device,
+  nvstusb_libusb_close_device,
+  nvstusb_libusb_write_bulk,
+  nvstusb_libusb_read_bulk,
+  nvstusb_libusb_write_bulk_async,
+  nvstusb_libusb_set_completion_callback,
+  nvstusb_libusb_get_async_stats,
+};
@@ -0,0 +1,389 @@
+/* usb_mock.c
+ *
+ * In-process emulation of the 3D Vision emitter, so the swap path can be run
+ * and benchmarked without hardware. Emulates the endpoints the library uses:
+ *
+ *   1 (out)  NVSTUSB_CMD_SET_EYE packets
+ *   2 (out)  NVSTUSB_CMD_WRITE / NVSTUSB_CMD_READ register commands
+ *   4 (in)   replies to NVSTUSB_CMD_READ
+ *
+ * Every transfer takes NVSTUSB_MOCK_LATENCY_US microseconds (default 250).
+ * NVSTUSB_MOCK_DEVICES emitters (default 1) are on the emulated bus, on
+ * ports 0-1, 0-2, ... with serial numbers MOCK0001, MOCK0002, ...
+ * */
+
+#include "usb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+/* same command bytes as in nvstusb.c */
+#define MOCK_CMD_WRITE          (0x01)
+#define MOCK_CMD_READ           (0x02)
+#define MOCK_CMD_CLEAR          (0x40)
+#define MOCK_CMD_SET_EYE        (0xAA)
+
+/* register file starting at 0x2007 */
+#define MOCK_REGISTERS          (0x40)
+#define MOCK_READ_TIMEOUT_US    (200000)
+
+struct nvstusb_mock_async {
+  uint64_t submit_time;
+  int endpoint;
+  int size;
+  uint8_t buf[NVSTUSB_USB_ASYNC_MAX_SIZE];
+};
+
+struct nvstusb_mock_device {
+  struct nvstusb_usb_device base;
+  struct nvstusb_device_info info;
+
+  uint64_t latency_us;
+  uint8_t regs[MOCK_REGISTERS];
+
+  /* pending reply on endpoint 4 */
+  uint8_t reply[4 + MOCK_REGISTERS];
+  int reply_size;
+
+  /* emulated traffic */
+  uint64_t eyes[2];
+  uint64_t writes;
+  uint64_t reads;
+
+  /* asynchronous writes in submission order */
+  struct nvstusb_mock_async queue[NVSTUSB_USB_ASYNC_TRANSFERS];
+  int queue_head;
+  int queue_count;
+  struct nvstusb_usb_async_stats stats;
+  nvstusb_usb_completion_func completion_func;
+  void *completion_user;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+  int stop;
+};
+
+/* monotonic time in microseconds */
+static uint64_t
+nvstusb_mock_time_us(
+) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000 + (uint64_t)ts.tv_nsec/1000;
+}
+
+static void
+nvstusb_mock_timespec(
+  uint64_t us,
+  struct timespec *ts
+) {
+  ts->tv_sec = us / 1000000;
+  ts->tv_nsec = (us % 1000000) * 1000;
+}
+
+/* sleep until the given monotonic time */
+static void
+nvstusb_mock_sleep_until(
+  uint64_t us
+) {
+  struct timespec ts;
+  nvstusb_mock_timespec(us, &ts);
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+/* act on a packet the host sent, called with the lock held */
+static void
+nvstusb_mock_process(
+  struct nvstusb_mock_device *dev,
+  int endpoint,
+  const uint8_t *data,
+  int size
+) {
+  if (1 == endpoint) {
+    if (size >= 2 && MOCK_CMD_SET_EYE == data[0]) {
+      dev->eyes[data[1] == 0xFE ? 1 : 0]++;
+    }
+    return;
+  }
+  if (2 != endpoint) return;
+
+  /* register commands, several may follow each other in one packet */
+  while (size >= 4) {
+    int addr = data[1];
+    int count = data[2] | (data[3] << 8);
+
+    if (MOCK_CMD_WRITE == data[0]) {
+      if (size < 4 + count) count = size - 4;
+      if (addr + count <= MOCK_REGISTERS) {
+        memcpy(dev->regs + addr, data + 4, count);
+      }
+      dev->writes++;
+      data += 4 + count;
+      size -= 4 + count;
+    } else if (MOCK_CMD_READ == (data[0] & ~MOCK_CMD_CLEAR)) {
+      if (addr + count > MOCK_REGISTERS) count = MOCK_REGISTERS - addr;
+      dev->reply[0] = addr;
+      dev->reply[1] = count;
+      dev->reply[2] = 0;
+      dev->reply[3] = 4;
+      memcpy(dev->reply + 4, dev->regs + addr, count);
+      dev->reply_size = 4 + count;
+      if (data[0] & MOCK_CMD_CLEAR) {
+        memset(dev->regs + addr, 0, count);
+      }
+      dev->reads++;
+      pthread_cond_broadcast(&dev->cond);
+      data += 4;
+      size -= 4;
+    } else {
+      fprintf(stderr, "nvstusb: mock emitter got unknown command 0x%02x\n", data[0]);
+      return;
+    }
+  }
+}
+
+/* completes the asynchronous writes once their latency has passed */
+static void *
+nvstusb_mock_thread(
+  void *arg
+) {
+  struct nvstusb_mock_device *dev = (struct nvstusb_mock_device *) arg;
+
+  pthread_mutex_lock(&dev->lock);
+  while (!dev->stop) {
+    if (0 == dev->queue_count) {
+      pthread_cond_wait(&dev->cond, &dev->lock);
+      continue;
+    }
+
+    struct nvstusb_mock_async *a = &dev->queue[dev->queue_head];
+    uint64_t due = a->submit_time + dev->latency_us;
+    pthread_mutex_unlock(&dev->lock);
+    nvstusb_mock_sleep_until(due);
+    uint64_t latency = nvstusb_mock_time_us() - a->submit_time;
+    pthread_mutex_lock(&dev->lock);
+
+    nvstusb_mock_process(dev, a->endpoint, a->buf, a->size);
+    int endpoint = a->endpoint;
+    dev->queue_head = (dev->queue_head + 1) % NVSTUSB_USB_ASYNC_TRANSFERS;
+    dev->queue_count--;
+    dev->stats.completed++;
+    dev->stats.last_latency_us = latency;
+    dev->stats.total_latency_us += latency;
+    if (latency > dev->stats.max_latency_us) dev->stats.max_latency_us = latency;
+    nvstusb_usb_completion_func func = dev->completion_func;
+    void *user = dev->completion_user;
+
+    pthread_mutex_unlock(&dev->lock);
+    if (0 != func) func(user, endpoint, 0, latency);
+    pthread_mutex_lock(&dev->lock);
+  }
+  pthread_mutex_unlock(&dev->lock);
+  return NULL;
+}
+
+/* the emulated emitters */
+static int
+nvstusb_mock_enumerate(
+  struct nvstusb_device_info *devices,
+  int max
+) {
+  const char *env = getenv("NVSTUSB_MOCK_DEVICES");
+  int count = env ? atoi(env) : 1;
+  int i;
+
+  for (i = 0; i < count && i < max; i++) {
+    memset(&devices[i], 0, sizeof(devices[i]));
+    snprintf(devices[i].port, sizeof(devices[i].port), "0-%d", i + 1);
+    snprintf(devices[i].serial, sizeof(devices[i].serial), "MOCK%04d", i + 1);
+  }
+  return count;
+}
+
+/* "open" an emulated emitter, there is never any firmware to load */
+static struct nvstusb_usb_device *
+nvstusb_mock_open_device(
+  const char *firmware,
+  const char *select
+) {
+  struct nvstusb_device_info infos[64];
+  int count = nvstusb_mock_enumerate(infos, 64);
+  int i;
+
+  fprintf(stderr, "nvstusb: Using the mock emitter, no hardware will be touched\n");
+  for (i = 0; i < count && i < 64; i++) {
+    if (nvstusb_usb_select_matches(select, &infos[i])) break;
+  }
+  if (i == count || i == 64) {
+    fprintf(stderr, "nvstusb: No mock 3d stereo controller matching '%s' found...\n", select ? select : "");
+    return 0;
+  }
+
+  struct nvstusb_mock_device *dev = (struct nvstusb_mock_device *) calloc(1, sizeof(*dev));
+  if (0 == dev) return 0;
+
+  dev->base.backend = &nvstusb_usb_mock_backend;
+  dev->info = infos[i];
+  dev->latency_us = 250;
+  const char *latency = getenv("NVSTUSB_MOCK_LATENCY_US");
+  if (0 != latency) dev->latency_us = strtoull(latency, 0, 10);
+
+  pthread_mutex_init(&dev->lock, NULL);
+  pthread_cond_init(&dev->cond, NULL);
+  if (pthread_create(&dev->thread, NULL, nvstusb_mock_thread, dev) != 0) {
+    fprintf(stderr, "nvstusb: Unable to start mock emitter thread\n");
+    pthread_cond_destroy(&dev->cond);
+    pthread_mutex_destroy(&dev->lock);
+    free(dev);
+    return 0;
+  }
+
+  fprintf(stderr, "nvstusb: Found mock 3d stereo controller on port %s, %d us latency...\n", dev->info.port, (int) dev->latency_us);
+  return &dev->base;
+}
+
+static void
+nvstusb_mock_close_device(
+  struct nvstusb_usb_device *base
+) {
+  struct nvstusb_mock_device *dev = (struct nvstusb_mock_device *) base;
+
+  pthread_mutex_lock(&dev->lock);
+  dev->stop = 1;
+  pthread_cond_broadcast(&dev->cond);
+  pthread_mutex_unlock(&dev->lock);
+  pthread_join(dev->thread, NULL);
+
+  fprintf(stderr, "nvstusb: mock emitter %s saw %llu eye commands (%llu left, %llu right), %llu register writes, %llu reads\n",
+    dev->info.port, (unsigned long long)(dev->eyes[0] + dev->eyes[1]),
+    (unsigned long long)dev->eyes[0], (unsigned long long)dev->eyes[1],
+    (unsigned long long)dev->writes, (unsigned long long)dev->reads);
+
+  pthread_cond_destroy(&dev->cond);
+  pthread_mutex_destroy(&dev->lock);
+  free(dev);
+}
+
+static int
+nvstusb_mock_write_bulk(
+  struct nvstusb_usb_device *base,
+  int endpoint,
+  const void *data,
+  int size
+) {
+  struct nvstusb_mock_device *dev = (struct nvstusb_mock_device *) base;
+
+  nvstusb_mock_sleep_until(nvstusb_mock_time_us() + dev->latency_us);
+
+  pthread_mutex_lock(&dev->lock);
+  nvstusb_mock_process(dev, endpoint, (const uint8_t *) data, size);
+  pthread_mutex_unlock(&dev->lock);
+  return 0;
+}
+
+static int
+nvstusb_mock_read_bulk(
+  struct nvstusb_usb_device *base,
+  int endpoint,
+  void *data,
+  int size
+) {
+  struct nvstusb_mock_device *dev = (struct nvstusb_mock_device *) base;
+  struct timespec timeout;
+  int recvd = 0;
+
+  if (4 != endpoint) return 0;
+
+  nvstusb_mock_sleep_until(nvstusb_mock_time_us() + dev->latency_us);
+
+  /* condition variables time out on CLOCK_REALTIME */
+  clock_gettime(CLOCK_REALTIME, &timeout);
+  timeout.tv_nsec += MOCK_READ_TIMEOUT_US * 1000;
+  timeout.tv_sec += timeout.tv_nsec / 1000000000;
+  timeout.tv_nsec %= 1000000000;
+
+  pthread_mutex_lock(&dev->lock);
+  while (0 == dev->reply_size) {
+    if (pthread_cond_timedwait(&dev->cond, &dev->lock, &timeout) == ETIMEDOUT) break;
+  }
+  if (dev->reply_size > 0) {
+    recvd = dev->reply_size < size ? dev->reply_size : size;
+    memcpy(data, dev->reply, recvd);
+    dev->reply_size = 0;
+  }
+  pthread_mutex_unlock(&dev->lock);
+  return recvd;
+}
+
+static int
+nvstusb_mock_write_bulk_async(
+  struct nvstusb_usb_device *base,
+  int endpoint,
+  const void *data,
+  int size
+) {
+  struct nvstusb_mock_device *dev = (struct nvstusb_mock_device *) base;
+  assert(size <= NVSTUSB_USB_ASYNC_MAX_SIZE);
+
+  pthread_mutex_lock(&dev->lock);
+  if (NVSTUSB_USB_ASYNC_TRANSFERS == dev->queue_count) {
+    dev->stats.dropped++;
+    pthread_mutex_unlock(&dev->lock);
+    return NVSTUSB_USB_ERROR_BUSY;
+  }
+
+  int tail = (dev->queue_head + dev->queue_count) % NVSTUSB_USB_ASYNC_TRANSFERS;
+  struct nvstusb_mock_async *a = &dev->queue[tail];
+  a->submit_time = nvstusb_mock_time_us();
+  a->endpoint = endpoint;
+  a->size = size;
+  memcpy(a->buf, data, size);
+  dev->queue_count++;
+  dev->stats.submitted++;
+  pthread_cond_broadcast(&dev->cond);
+  pthread_mutex_unlock(&dev->lock);
+  return 0;
+}
+
+static void
+nvstusb_mock_set_completion_callback(
+  struct nvstusb_usb_device *base,
+  nvstusb_usb_completion_func func,
+  void *user
+) {
+  struct nvstusb_mock_device *dev = (struct nvstusb_mock_device *) base;
+
+  pthread_mutex_lock(&dev->lock);
+  dev->completion_func = func;
+  dev->completion_user = user;
+  pthread_mutex_unlock(&dev->lock);
+}
+
+static void
+nvstusb_mock_get_async_stats(
+  struct nvstusb_usb_device *base,
+  struct nvstusb_usb_async_stats *stats
+) {
+  struct nvstusb_mock_device *dev = (struct nvstusb_mock_device *) base;
+
+  pthread_mutex_lock(&dev->lock);
+  *stats = dev->stats;
+  pthread_mutex_unlock(&dev->lock);
+}
+
+const struct nvstusb_usb_backend nvstusb_usb_mock_backend = {
+  "mock",
+  nvstusb_mock_enumerate,
+  nvstusb_mock_open_device,
+  nvstusb_mock_close_device,
+  nvstusb_mock_write_bulk,
+  nvstusb_mock_read_bulk,
+  nvstusb_mock_write_bulk_async,
+  nvstusb_mock_set_completion_callback,
+  nvstusb_mock_get_async_stats,
+};
@@ -0,0 +1,97 @@
+/* vblank.c
+ *
+ * Software vblank predictor. With MSC the period is measured directly over
+ * the counter distance; from swap completion times it is tracked with an
+ * alpha-beta filter, since each sample is late by a varying amount.
+ * */
+
+#include "vblank.h"
+#include <math.h>
+
+/* how much a single sample moves the estimates */
+#define NVSTUSB_VBLANK_PHASE_GAIN   0.1
+#define NVSTUSB_VBLANK_PERIOD_GAIN  0.01
+
+void
+nvstusb_vblank_init(
+  struct nvstusb_vblank *vb,
+  double period_us
+) {
+  vb->period_us = period_us;
+  vb->base_us = 0;
+  vb->base_msc = 0;
+  vb->samples = 0;
+}
+
+int64_t
+nvstusb_vblank_observe_msc(
+  struct nvstusb_vblank *vb,
+  uint64_t ust,
+  int64_t msc
+) {
+  int64_t error = 0;
+
+  if (vb->samples > 0 && msc > vb->base_msc) {
+    double expected = vb->base_us + (msc - vb->base_msc) * vb->period_us;
+    error = (int64_t) ust - (int64_t) expected;
+
+    /* the counter distance makes this a direct measurement, only smooth out
+     * the timestamp noise */
+    double measured = (ust - vb->base_us) / (msc - vb->base_msc);
+    vb->period_us += (measured - vb->period_us) * (vb->samples == 1 ? 1.0 : 0.25);
+  }
+
+  /* timestamps are exact, so they always become the new base */
+  if (vb->samples == 0 || msc != vb->base_msc) {
+    vb->base_us = ust;
+    vb->base_msc = msc;
+    vb->samples++;
+  }
+  return error;
+}
+
+int64_t
+nvstusb_vblank_observe_swap(
+  struct nvstusb_vblank *vb,
+  uint64_t t
+) {
+  if (vb->samples == 0) {
+    vb->base_us = t;
+    vb->base_msc = 0;
+    vb->samples = 1;
+    return 0;
+  }
+
+  /* which vblank this was, relative to the base */
+  double n = floor((t - vb->base_us) / vb->period_us + 0.5);
+  if (n < 1) return 0;
+
+  double expected = vb->base_us + n * vb->period_us;
+  double error = t - expected;
+
+  /* more than half a period off means we lost track, start from here */
+  if (fabs(error) > vb->period_us / 2) {
+    vb->base_us = t;
+    vb->base_msc += (int64_t) n;
+    vb->samples = 1;
+    return (int64_t) error;
+  }
+
+  vb->base_us = expected + error * NVSTUSB_VBLANK_PHASE_GAIN;
+  vb->period_us += error * NVSTUSB_VBLANK_PERIOD_GAIN / n;
+  vb->base_msc += (int64_t) n;
+  vb->samples++;
+  return (int64_t) error;
+}
+
+uint64_t
+nvstusb_vblank_next(
+  const struct nvstusb_vblank *vb,
+  uint64_t now
+) {
+  if (vb->samples == 0) return 0;
+
+  double n = floor((now - vb->base_us) / vb->period_us) + 1;
+  if (n < 1) n = 1;
+  return (uint64_t) (vb->base_us + n * vb->period_us);
+}
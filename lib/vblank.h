@@ -0,0 +1,41 @@
+/* vblank.h
+ *
+ * Predicts when the display will flip next, from vblank timestamps
+ * (GLX_OML_sync_control UST/MSC pairs) or, without those, from the times
+ * swaps completed. Internal to the library.
+ * */
+
+#ifndef __NVSTUSB_VBLANK_H__
+#define __NVSTUSB_VBLANK_H__
+
+#include <stdint.h>
+
+struct nvstusb_vblank {
+  /* estimated refresh period */
+  double period_us;
+
+  /* a vblank that happened (or is estimated to have happened) and its
+   * counter, every prediction is an integer number of periods from it */
+  double base_us;
+  int64_t base_msc;
+
+  /* observations so far, predictions are only made after the first */
+  int samples;
+};
+
+/* start over, assuming the given refresh period until it is measured */
+void nvstusb_vblank_init(struct nvstusb_vblank *vb, double period_us);
+
+/* feed the vblank with counter msc that happened at ust (microseconds on
+ * CLOCK_MONOTONIC). returns how far it was from the prediction, in us */
+int64_t nvstusb_vblank_observe_msc(struct nvstusb_vblank *vb, uint64_t ust, int64_t msc);
+
+/* feed the time a vsynced swap completed, which is some (noisy) time after
+ * a vblank. the vblank counter is inferred. returns how far it was from the
+ * prediction, in us */
+int64_t nvstusb_vblank_observe_swap(struct nvstusb_vblank *vb, uint64_t t);
+
+/* the first vblank after now, 0 if nothing was observed yet */
+uint64_t nvstusb_vblank_next(const struct nvstusb_vblank *vb, uint64_t now);
+
+#endif // __NVSTUSB_VBLANK_H__
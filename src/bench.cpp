@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include "scene.h"
+#include "render.h"
+#include "singlepass.h"
+#include "bench_gl.h"
+
+// Headless benchmark of the draw path. Renders both eyes of every camera type
+// and geometry path (immediate mode, the retained mesh recorded per eye, both
+// eyes recorded in parallel the way the demo does, and both eyes in a single
+// pass through a layered or a side by side frame buffer) into offscreen frame buffers through an EGL surfaceless
+// context (llvmpipe is fine, no X display or emitter needed) and prints one
+// JSON object per run on stdout.
+//
+// usage: 3dvgl-bench [-n frames] [-w width] [-h height]
+
+// frames drawn before measuring, so the driver has settled
+static const int WARMUP = 10;
+
+enum Geometry {
+    IMMEDIATE,
+    RETAINED,
+    RECORDED,
+    LAYERED,
+    SIDE_BY_SIDE
+};
+
+static const char *GEOMETRY_NAMES[] = {
+    "immediate", "retained", "recorded", "single_pass_layered", "single_pass_sbs"
+};
+
+static int frames = 200;
+static int width = 800;
+static int height = 600;
+
+// one frame buffer per eye (1 = left, 0 = right)
+static GLuint fbo[2];
+static GLuint colour[2];
+static GLuint depth[2];
+
+static double Seconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1.0e9;
+}
+
+// creates a surfaceless desktop OpenGL context and makes it current
+static bool InitEGL() {
+    EGLDisplay display = EGL_NO_DISPLAY;
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay != NULL) {
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+    if (display == EGL_NO_DISPLAY) {
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL)) {
+        fprintf(stderr, "Could not initialize EGL!\n");
+        return false;
+    }
+
+    if (!eglBindAPI(EGL_OPENGL_API)) {
+        fprintf(stderr, "EGL has no desktop OpenGL support!\n");
+        return false;
+    }
+
+    // nothing is drawn to an EGL surface, but the default of window surfaces
+    // rules out every config of a surfaceless display
+    EGLint attribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint count = 0;
+    if (!eglChooseConfig(display, attribs, &config, 1, &count) || count == 0) {
+        fprintf(stderr, "No suitable EGL config!\n");
+        return false;
+    }
+
+    // the scene is fixed function, so this has to be a compatibility context
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+    if (context == EGL_NO_CONTEXT ||
+        !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+        fprintf(stderr, "Could not create a surfaceless OpenGL context!\n");
+        return false;
+    }
+
+    return true;
+}
+
+static bool InitFramebuffers() {
+    glGenFramebuffers(2, fbo);
+    glGenRenderbuffers(2, colour);
+    glGenRenderbuffers(2, depth);
+
+    for (int i = 0; i < 2; i++) {
+        glBindRenderbuffer(GL_RENDERBUFFER, colour[i]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, depth[i]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo[i]);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colour[i]);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth[i]);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            fprintf(stderr, "Offscreen frame buffer is incomplete!\n");
+            return false;
+        }
+    }
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    glViewport(0, 0, width, height);
+    return true;
+}
+
+// draws count stereo frames, left eye then right eye, like the demo does
+// (recording both eyes counts as the wall time the GL thread waits for it, a
+// single pass counts for both eyes)
+static double DrawFrames(const StereoHelper::Camera& cam, Geometry geometry,
+                         int count, double *eye_cpu) {
+    static float angle = 0.0f;
+    static DrawList::List lists[2];
+    static StereoHelper::StereoCache stereo;
+    const StereoHelper::StereoPair& pair = stereo.Get(cam, (float) width / height);
+
+    *eye_cpu = 0.0;
+    double start = Seconds(CLOCK_MONOTONIC);
+    for (int f = 0; f < count; f++) {
+        if (geometry == RECORDED) {
+            double wall = Seconds(CLOCK_MONOTONIC);
+            angle += 2.0f;
+            Render::RecordEyes(pair, angle, lists);
+            *eye_cpu += Seconds(CLOCK_MONOTONIC) - wall;
+        } else if (geometry == LAYERED || geometry == SIDE_BY_SIDE) {
+            double cpu = Seconds(CLOCK_THREAD_CPUTIME_ID);
+            angle += 2.0f;
+            Render::DrawStereo(pair, angle);
+            *eye_cpu += Seconds(CLOCK_THREAD_CPUTIME_ID) - cpu;
+        }
+        for (int eye = 1; eye >= 0; eye--) {
+            glBindFramebuffer(GL_FRAMEBUFFER, fbo[eye]);
+            double cpu = Seconds(CLOCK_THREAD_CPUTIME_ID);
+            if (geometry == LAYERED || geometry == SIDE_BY_SIDE) {
+                SinglePass::Present(eye, 0, 0, width, height);
+            } else if (geometry == RECORDED) {
+                Render::SubmitEye(lists[eye]);
+            } else {
+                angle += 1.0f;
+                Render::DrawEye(pair, eye, angle, geometry == RETAINED);
+            }
+            *eye_cpu += Seconds(CLOCK_THREAD_CPUTIME_ID) - cpu;
+        }
+
+        // wait for the GPU, a frame only counts once both eyes are done
+        glFinish();
+    }
+    return Seconds(CLOCK_MONOTONIC) - start;
+}
+
+static void Run(StereoHelper::CameraType type, const char *type_name, Geometry geometry) {
+    StereoHelper::Camera cam;
+    cam.type = type;
+    cam.eye = StereoHelper::Vec3(39.0f, 53.0f, 22.0f);
+    cam.look = StereoHelper::Vec3(0.0f, 0.0f, 0.0f);
+    cam.up = StereoHelper::Vec3(0.0f, 1.0f, 0.0f);
+    cam.focal = 70.0f;
+    cam.fov = 50.0f;
+    cam.iod = cam.focal / 30.0f;
+    cam.near = 1.0f;
+    cam.far = 200.0f;
+
+    // the single pass draws into its own frame buffer, the eyes are copied
+    // out of it like the demo presents them
+    if (geometry == LAYERED || geometry == SIDE_BY_SIDE) {
+        SinglePass::Free();
+        if (!SinglePass::Init(geometry == LAYERED ? SinglePass::LAYERED : SinglePass::SIDE_BY_SIDE)) {
+            return;
+        }
+        SinglePass::Resize(width, height);
+    }
+
+    double eye_cpu;
+    DrawFrames(cam, geometry, WARMUP, &eye_cpu);
+    BenchGL::Reset();
+    double elapsed = DrawFrames(cam, geometry, frames, &eye_cpu);
+
+    printf("{\"camera\": \"%s\", \"geometry\": \"%s\", \"width\": %d, \"height\": %d, "
+           "\"frames\": %d, \"fps\": %.2f, \"frame_ms\": %.3f, \"cpu_us_per_eye\": %.1f, "
+           "\"gl_calls_per_frame\": %.1f, \"gl_calls\": {",
+           type_name, GEOMETRY_NAMES[geometry], width, height,
+           frames, frames / elapsed, elapsed * 1000.0 / frames,
+           eye_cpu * 1.0e6 / (frames * 2), (double) BenchGL::Total() / frames);
+    bool first = true;
+    for (int i = 0; i < BenchGL::Count(); i++) {
+        if (BenchGL::Calls(i) == 0) continue;
+        printf("%s\"%s\": %.1f", first ? "" : ", ", BenchGL::Name(i),
+               (double) BenchGL::Calls(i) / frames);
+        first = false;
+    }
+    printf("}}\n");
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:w:h:")) != -1) {
+        switch (opt) {
+            case 'n': frames = atoi(optarg); break;
+            case 'w': width = atoi(optarg); break;
+            case 'h': height = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n frames] [-w width] [-h height]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (frames <= 0 || width <= 0 || height <= 0) {
+        fprintf(stderr, "Frames, width and height must be positive!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!InitEGL() || !InitFramebuffers()) {
+        exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "Benchmarking on %s.\n", (const char *) glGetString(GL_RENDERER));
+
+    Render::Init();
+    PaulBourke::MakeMesh();
+
+    Run(StereoHelper::TOE_IN, "toe_in", RETAINED);
+    Run(StereoHelper::TOE_IN, "toe_in", RECORDED);
+    Run(StereoHelper::TOE_IN, "toe_in", LAYERED);
+    Run(StereoHelper::TOE_IN, "toe_in", SIDE_BY_SIDE);
+    Run(StereoHelper::TOE_IN, "toe_in", IMMEDIATE);
+    Run(StereoHelper::PARALLEL_AXIS_ASYMMETRIC, "parallel_axis_asymmetric", RETAINED);
+    Run(StereoHelper::PARALLEL_AXIS_ASYMMETRIC, "parallel_axis_asymmetric", RECORDED);
+    Run(StereoHelper::PARALLEL_AXIS_ASYMMETRIC, "parallel_axis_asymmetric", LAYERED);
+    Run(StereoHelper::PARALLEL_AXIS_ASYMMETRIC, "parallel_axis_asymmetric", SIDE_BY_SIDE);
+    Run(StereoHelper::PARALLEL_AXIS_ASYMMETRIC, "parallel_axis_asymmetric", IMMEDIATE);
+
+    DrawList::StopWorkers();
+    SinglePass::Free();
+    PaulBourke::FreeMesh();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,71 @@
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include "bench_gl.h"
+
+// every entry point the draw path uses, as (name, parameters, arguments).
+// Keep BENCH_WRAP in the Makefile in sync with this list.
+#define GL_CALLS(X) \
+    X(glClear, (GLbitfield a), (a)) \
+    X(glMatrixMode, (GLenum a), (a)) \
+    X(glLoadMatrixf, (const GLfloat *a), (a)) \
+    X(glPushMatrix, (), ()) \
+    X(glPopMatrix, (), ()) \
+    X(glRotatef, (GLfloat a, GLfloat b, GLfloat c, GLfloat d), (a, b, c, d)) \
+    X(glBegin, (GLenum a), (a)) \
+    X(glEnd, (), ()) \
+    X(glVertex3f, (GLfloat a, GLfloat b, GLfloat c), (a, b, c)) \
+    X(glNormal3f, (GLfloat a, GLfloat b, GLfloat c), (a, b, c)) \
+    X(glColor3f, (GLfloat a, GLfloat b, GLfloat c), (a, b, c)) \
+    X(glMaterialfv, (GLenum a, GLenum b, const GLfloat *c), (a, b, c)) \
+    X(glLightfv, (GLenum a, GLenum b, const GLfloat *c), (a, b, c)) \
+    X(glLightModelfv, (GLenum a, const GLfloat *b), (a, b)) \
+    X(glLightModeli, (GLenum a, GLint b), (a, b)) \
+    X(glEnable, (GLenum a), (a)) \
+    X(glDisable, (GLenum a), (a)) \
+    X(glShadeModel, (GLenum a), (a)) \
+    X(glBindVertexArray, (GLuint a), (a)) \
+    X(glPrimitiveRestartIndex, (GLuint a), (a)) \
+    X(glDrawElements, (GLenum a, GLsizei b, GLenum c, const void *d), (a, b, c, d)) \
+    X(glDrawElementsInstanced, (GLenum a, GLsizei b, GLenum c, const void *d, GLsizei e), (a, b, c, d, e)) \
+    X(glBlitFramebuffer, (GLint a, GLint b, GLint c, GLint d, GLint e, GLint f, GLint g, GLint h, \
+                          GLbitfield i, GLenum j), (a, b, c, d, e, f, g, h, i, j))
+
+#define GL_CALL_ENUM(name, params, args) CALL_##name,
+#define GL_CALL_NAME(name, params, args) #name,
+#define GL_CALL_WRAP(name, params, args) \
+    extern "C" void __real_##name params; \
+    extern "C" void __wrap_##name params { \
+        calls[CALL_##name]++; \
+        __real_##name args; \
+    }
+
+enum { GL_CALLS(GL_CALL_ENUM) NUM_CALLS };
+
+static const char *names[NUM_CALLS] = { GL_CALLS(GL_CALL_NAME) };
+static unsigned long calls[NUM_CALLS];
+
+GL_CALLS(GL_CALL_WRAP)
+
+int BenchGL::Count() {
+    return NUM_CALLS;
+}
+
+const char *BenchGL::Name(int i) {
+    return names[i];
+}
+
+unsigned long BenchGL::Calls(int i) {
+    return calls[i];
+}
+
+unsigned long BenchGL::Total() {
+    unsigned long total = 0;
+    for (int i = 0; i < NUM_CALLS; i++) total += calls[i];
+    return total;
+}
+
+void BenchGL::Reset() {
+    for (int i = 0; i < NUM_CALLS; i++) calls[i] = 0;
+}
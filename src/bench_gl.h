@@ -0,0 +1,24 @@
+#ifndef __BENCH_GL_H__
+#define __BENCH_GL_H__
+
+// Counts the OpenGL calls made by the draw path. The benchmark is linked with
+// -Wl,--wrap for every entry point listed in bench_gl.cpp, so each call goes
+// through a counter on its way to the real function.
+
+namespace BenchGL {
+
+    // number of entry points being counted
+    int Count();
+
+    // name of entry point i, and how often it was called since Reset()
+    const char *Name(int i);
+    unsigned long Calls(int i);
+
+    // calls to all entry points since Reset()
+    unsigned long Total();
+
+    void Reset();
+
+}
+
+#endif // __BENCH_GL_H__
@@ -0,0 +1,194 @@
+#ifndef __CAMERA_H__
+#define __CAMERA_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "matrix.h"
+
+namespace StereoHelper {
+
+    /**
+     * Specifies the different types of stereo cameras we know how to project.
+     */
+    enum CameraType {
+        TOE_IN,
+        PARALLEL_AXIS_ASYMMETRIC
+    };
+
+    /**
+     * The camera from which stereo pairs are generated. Each element is as
+     * follows:
+     * 
+     * type     The method for generating stereo pairs. The toe-in method uses
+     *          uses two normal camera frusta with their eye positions separated
+     *          by the interoccular distance, focused on the same look at point.
+     *          It is generally less desirable than the other method, parallel
+     *          axis asymmetric frusta. The parallel axis methods keeps both
+     *          camera eye positions looking straight forward, but creates
+     *          asymmetric fustra such that the images align at the focal
+     *          distance of the lens.
+     *
+     * eye      The eye position of the camera (the actual left and right eye
+     *          are computed to be half the interoccular distance to the left
+     *          and right from this position.
+     *
+     * look     The look at point of the camera (or point of interest).
+     *
+     * up       The world up direction (usually positive y <0, 1, 0>).
+     *
+     * focal    The focal length of the camera, in world units. Objects that are
+     *          this far away from the camera will appear with zero parallax (at
+     *          screen depth). Objects closer will appear with negative parallax
+     *          (out of the screen) and objects farther away will appear with
+     *          positive parallax (into the screen).
+     *
+     * fov      The field of view of the camera. Just like OpenGL, this is
+     *          vertical field of view in degrees.
+     *
+     * iod      The interoccular distance, or distance between the generated
+     *          eyes. Generally for comfortable viewing you can set this to
+     *          1/30th the focal length.
+     *
+     * near     Distance to the near plane of the camera. To prevent extreme
+     *          negative parallax (think extraordinarily cheesy special effects
+     *          that fly out of the screen towards you) you can generally set
+     *          this to 1/5th the focal length.
+     *
+     * far      Distance to the far plane of the camera.
+     */
+    struct Camera {
+        CameraType type;
+        Vec3 eye;
+        Vec3 look;
+        Vec3 up;
+        float focal;
+        float fov;
+        float iod;
+        float near;
+        float far;
+    };
+
+    /**
+     * The combined projection * view matrices of both eyes of a camera.
+     */
+    struct StereoPair {
+        Mat4 left;
+        Mat4 right;
+    };
+
+    /**
+     * Computes the view-projection matrices of both eyes in one go, sharing
+     * the camera basis between them. StereoCache keeps the result while the
+     * camera stays the same.
+     *
+     * The matrices can be loaded directly with glLoadMatrixf() on the
+     * projection stack, or passed to a shader with glUniformMatrix4fv().
+     */
+    StereoPair ComputeStereoPair(const Camera& cam, float aspect);
+
+    /**
+     * The stereo pair of a camera, kept until the camera or the aspect ratio
+     * changes, so drawing the eyes one at a time computes it once instead of
+     * once per eye. Keep one per camera with the code that draws it; it isn't
+     * meant to be shared between threads.
+     */
+    class StereoCache {
+    public:
+        StereoCache() : valid(false), aspect(0.0f) {}
+
+        // the pair of cam at aspect, computed again only if either changed
+        const StereoPair& Get(const Camera& cam, float aspect);
+
+    private:
+        bool valid;
+        Camera cam;
+        float aspect;
+        StereoPair pair;
+    };
+
+    /**
+     * Places the camera transform of the active eye of a stereo pair on the
+     * projection stack (this means that your modelview stack should just be
+     * the identity matrix before any model transforms.
+     *
+     * Pass in the pair (see ComputeStereoPair() and StereoCache) and the
+     * current eye (1 = left, 0 = right).
+     * 
+     * After calling this function the modelview stack will be the currently
+     * selected matrix stack.
+     */
+    void ProjectCamera(const StereoPair& pair, int eye);
+
+// ============================================================================
+//     IMPLEMENTATIONS ONLY BELOW THIS LINE
+// ============================================================================
+
+    inline StereoPair ComputeStereoPair(const Camera& cam, float aspect) {
+        StereoPair pair;
+
+        // compute the camera basis
+        Vec3 dir = (cam.look - cam.eye).Normalize();
+        Vec3 right = dir.Cross(cam.up).Normalize();
+        
+        // occular shift, the left eye moves by -shift, the right by +shift
+        Vec3 shift = right * (cam.iod / 2.0f);
+        
+        // focus is the focal distance away along the camera view vector
+        Vec3 focus = cam.eye + (dir * cam.focal);
+        
+        if (cam.type == TOE_IN) {
+            // compute traditional perspective frusta, both eyes look at focus
+            Mat4 proj = Mat4::Perspective(cam.fov, aspect, cam.near, cam.far);
+            pair.left = proj * Mat4::LookAt(cam.eye - shift, focus, cam.up);
+            pair.right = proj * Mat4::LookAt(cam.eye + shift, focus, cam.up);
+        } else if (cam.type == PARALLEL_AXIS_ASYMMETRIC) {
+            // compute the bounds of the asymmetric frusta, each eye's window
+            // is the shared one at the focal plane, offset towards the middle,
+            // so the frusta are mirror images of each other
+            float top = cam.near * tanf((cam.fov / 2.0f) * (M_PI / 180.0f));
+            float offset = 0.5f * cam.iod * (cam.near / cam.focal);
+            float inner = aspect * top - offset;
+            float outer = aspect * top + offset;
+            
+            // note that for the parallel axis camera, we shift both the camera
+            // eye and the focus point (to keep the camera direction vector axis
+            // parallel between the eyes)
+            pair.left = Mat4::Frustum(-inner, outer, -top, top, cam.near, cam.far) *
+                        Mat4::LookAt(cam.eye - shift, focus - shift, cam.up);
+            pair.right = Mat4::Frustum(-outer, inner, -top, top, cam.near, cam.far) *
+                         Mat4::LookAt(cam.eye + shift, focus + shift, cam.up);
+        } else {
+            fprintf(stderr, "Unknown camera type in StereoHelper::ComputeStereoPair!\n");
+            exit(EXIT_FAILURE);
+        }
+
+        return pair;
+    }
+
+    inline const StereoPair& StereoCache::Get(const Camera& c, float a) {
+        if (!valid || a != aspect || c.type != cam.type ||
+            c.eye != cam.eye || c.look != cam.look || c.up != cam.up ||
+            c.focal != cam.focal || c.fov != cam.fov || c.iod != cam.iod ||
+            c.near != cam.near || c.far != cam.far) {
+            pair = ComputeStereoPair(c, a);
+            cam = c;
+            aspect = a;
+            valid = true;
+        }
+        return pair;
+    }
+
+    inline void ProjectCamera(const StereoPair& pair, int eye) {
+        // the entire camera transform goes on the projection stack
+        glMatrixMode(GL_PROJECTION);
+        glLoadMatrixf(eye ? pair.left.m : pair.right.m);
+        
+        // swap back to the modelview stack
+        glMatrixMode(GL_MODELVIEW);
+    }
+
+}
+
+#endif // __CAMERA_H__
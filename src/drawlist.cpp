@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <algorithm>
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include "drawlist.h"
+
+using StereoHelper::Mat4;
+
+// worker threads never outnumber the cores (minus the caller's)
+static const int MAX_WORKERS = 7;
+
+// the lists of one RecordParallel() call, on its stack. lists are taken in
+// index order, the job leaves the queue once all are taken
+struct Job {
+    const DrawList::Scene *scene;
+    const Mat4 *view_projection;
+    DrawList::List *lists;
+    int count;
+    int next;
+    int done;
+    Job *queued;        // next job in the queue
+};
+
+// jobs with lists left to take, oldest first. everything here is under
+// job_lock; work_cond signals a new job or the stop, done_cond a finished list
+static Job *job_queue = NULL;
+static pthread_t workers[MAX_WORKERS];
+static int worker_count = 0;
+static bool workers_stop = false;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+static bool SameMaterial(const DrawList::Material& a, const DrawList::Material& b) {
+    return memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+// state changes are what submitting costs, so packets sharing a vertex array
+// and a material go together; within that front to back, for early depth
+// rejection
+static bool PacketOrder(const DrawList::Packet& a, const DrawList::Packet& b) {
+    if (a.vao != b.vao) return a.vao < b.vao;
+    int m = memcmp(&a.material, &b.material, sizeof(a.material));
+    if (m != 0) return m < 0;
+    return a.depth < b.depth;
+}
+
+// true if the sphere is entirely outside one of the clip planes of m (model
+// space to clip space), the planes are normalized so the radius compares
+static bool Outside(const Mat4& m, const StereoHelper::Vec3& c, float radius) {
+    for (int row = 0; row < 3; row++) {
+        for (int sign = -1; sign <= 1; sign += 2) {
+            float a = m(3, 0) + sign * m(row, 0);
+            float b = m(3, 1) + sign * m(row, 1);
+            float d = m(3, 2) + sign * m(row, 2);
+            float w = m(3, 3) + sign * m(row, 3);
+            float len = sqrtf(a * a + b * b + d * d);
+            if (len > 0.0f && (a * c.x + b * c.y + d * c.z + w) / len < -radius) return true;
+        }
+    }
+    return false;
+}
+
+// records the objects visible from any of the views, sorted by the first
+static void RecordViews(const DrawList::Scene& scene, const Mat4 *view_projection,
+                        int views, DrawList::List& list) {
+    list.projection = view_projection[0];
+    list.packets.clear();
+    list.culled = 0;
+
+    for (size_t i = 0; i < scene.objects.size(); i++) {
+        const DrawList::Object& o = scene.objects[i];
+        Mat4 mvp = view_projection[0] * o.model;
+        bool outside = Outside(mvp, o.center, o.radius);
+        for (int v = 1; outside && v < views; v++) {
+            outside = Outside(view_projection[v] * o.model, o.center, o.radius);
+        }
+        if (outside) {
+            list.culled++;
+            continue;
+        }
+
+        DrawList::Packet p;
+        p.modelview = o.model;
+        p.vao = o.vao;
+        p.mode = o.mode;
+        p.count = o.count;
+        p.offset = o.offset;
+        p.restart = o.restart;
+        p.material = o.material;
+        p.depth = mvp(3, 0) * o.center.x + mvp(3, 1) * o.center.y +
+                  mvp(3, 2) * o.center.z + mvp(3, 3);
+        list.packets.push_back(p);
+    }
+
+    std::stable_sort(list.packets.begin(), list.packets.end(), PacketOrder);
+}
+
+void DrawList::Record(const Scene& scene, const Mat4& view_projection, List& list) {
+    RecordViews(scene, &view_projection, 1, list);
+}
+
+void DrawList::RecordStereo(const Scene& scene, const Mat4 view_projection[2], List& list) {
+    RecordViews(scene, view_projection, 2, list);
+}
+
+// takes one list off job and records it, with job_lock held on entry and exit
+static void RecordOne(Job *job) {
+    int i = job->next++;
+    if (job->next == job->count) {
+        Job **q = &job_queue;
+        while (*q != job) q = &(*q)->queued;
+        *q = job->queued;
+    }
+
+    pthread_mutex_unlock(&job_lock);
+    DrawList::Record(*job->scene, job->view_projection[i], job->lists[i]);
+    pthread_mutex_lock(&job_lock);
+
+    if (++job->done == job->count) pthread_cond_broadcast(&done_cond);
+}
+
+static void *WorkerThread(void *) {
+    pthread_mutex_lock(&job_lock);
+    for (;;) {
+        while (job_queue == NULL && !workers_stop) {
+            pthread_cond_wait(&work_cond, &job_lock);
+        }
+        if (workers_stop) break;
+        RecordOne(job_queue);
+    }
+    pthread_mutex_unlock(&job_lock);
+    return NULL;
+}
+
+// one worker per list beyond the caller's, as far as there are cores. with
+// job_lock held
+static void StartWorkers(int count) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = std::min(count - 1, MAX_WORKERS);
+    if (cores > 0) wanted = std::min(wanted, (int) cores - 1);
+
+    while (worker_count < wanted) {
+        if (pthread_create(&workers[worker_count], NULL, WorkerThread, NULL) != 0) {
+            fprintf(stderr, "Failed to start a draw list worker thread, recording on fewer.\n");
+            return;
+        }
+        worker_count++;
+    }
+}
+
+void DrawList::RecordParallel(const Scene& scene, const Mat4 *view_projection,
+                              List *lists, int count) {
+    if (count <= 0) return;
+
+    Job job = { &scene, view_projection, lists, count, 0, 0, NULL };
+
+    pthread_mutex_lock(&job_lock);
+    StartWorkers(count);
+    Job **q = &job_queue;
+    while (*q != NULL) q = &(*q)->queued;
+    *q = &job;
+    pthread_cond_broadcast(&work_cond);
+
+    // lend a hand, then wait for the lists the workers took
+    while (job.next < job.count) {
+        RecordOne(&job);
+    }
+    while (job.done < job.count) {
+        pthread_cond_wait(&done_cond, &job_lock);
+    }
+    pthread_mutex_unlock(&job_lock);
+}
+
+void DrawList::StopWorkers() {
+    pthread_mutex_lock(&job_lock);
+    workers_stop = true;
+    pthread_cond_broadcast(&work_cond);
+    pthread_mutex_unlock(&job_lock);
+
+    // a worker busy with a list finishes it first, its caller is waiting
+    for (int i = 0; i < worker_count; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    pthread_mutex_lock(&job_lock);
+    worker_count = 0;
+    workers_stop = false;
+    pthread_mutex_unlock(&job_lock);
+}
+
+void DrawList::Submit(const List& list, int instances) {
+    glMatrixMode(GL_PROJECTION);
+    glLoadMatrixf(list.projection.m);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+
+    GLuint vao = 0;
+    bool restart = false;
+    const Material *material = NULL;
+    for (size_t i = 0; i < list.packets.size(); i++) {
+        const Packet& p = list.packets[i];
+        if (material == NULL || !SameMaterial(*material, p.material)) {
+            glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, p.material.specular);
+            glMaterialfv(GL_FRONT_AND_BACK, GL_SHININESS, &p.material.shininess);
+            material = &p.material;
+        }
+        if (p.vao != vao) {
+            glBindVertexArray(p.vao);
+            vao = p.vao;
+        }
+        if (p.restart != restart) {
+            if (p.restart) {
+                glEnable(GL_PRIMITIVE_RESTART);
+                glPrimitiveRestartIndex(RESTART_INDEX);
+            } else {
+                glDisable(GL_PRIMITIVE_RESTART);
+            }
+            restart = p.restart;
+        }
+        glLoadMatrixf(p.modelview.m);
+        if (instances > 1) {
+            glDrawElementsInstanced(p.mode, p.count, GL_UNSIGNED_INT, (const GLvoid *) p.offset, instances);
+        } else {
+            glDrawElements(p.mode, p.count, GL_UNSIGNED_INT, (const GLvoid *) p.offset);
+        }
+    }
+
+    if (vao != 0) glBindVertexArray(0);
+    if (restart) glDisable(GL_PRIMITIVE_RESTART);
+    glPopMatrix();
+}
@@ -0,0 +1,95 @@
+#ifndef __DRAWLIST_H__
+#define __DRAWLIST_H__
+
+#include <stddef.h>
+#include <vector>
+
+#include <GL/gl.h>
+
+#include "matrix.h"
+
+// Per-eye command lists. The scene of a frame is described once and shared
+// read-only by both eyes; the draw packets of each eye (matrices, culling
+// against that eye's frustum, sorting by state) are recorded from it on
+// worker threads, and the GL thread then submits the lists in eye order.
+// Only submitting touches GL, so the context stays on one thread while the
+// CPU side of a frame spreads over the cores.
+
+namespace DrawList {
+
+    // index that separates strips in objects with restart set
+    const GLuint RESTART_INDEX = 0xffffffff;
+
+    struct Material {
+        float specular[4];
+        float shininess;
+    };
+
+    // One indexed draw (GL_UNSIGNED_INT indices) out of a vertex array.
+    // center and radius bound it in model space, for culling.
+    struct Object {
+        StereoHelper::Mat4 model;
+        StereoHelper::Vec3 center;
+        float radius;
+        GLuint vao;
+        GLenum mode;
+        GLsizei count;
+        size_t offset;      // in bytes, into the element buffer
+        bool restart;
+        Material material;
+    };
+
+    struct Scene {
+        std::vector<Object> objects;
+    };
+
+    // Everything the GL thread needs for one draw, copied out of the scene so
+    // a list can be submitted after the scene has moved on.
+    struct Packet {
+        StereoHelper::Mat4 modelview;
+        GLuint vao;
+        GLenum mode;
+        GLsizei count;
+        size_t offset;
+        bool restart;
+        Material material;
+        float depth;        // of the bounding sphere's center, for sorting
+    };
+
+    struct List {
+        StereoHelper::Mat4 projection;
+        std::vector<Packet> packets;
+        int culled;
+    };
+
+    // Records the packets of scene for the eye with the given view-projection
+    // matrix (see StereoHelper::ComputeStereoPair()) into list. Doesn't touch
+    // GL, safe to call from any thread.
+    void Record(const Scene& scene, const StereoHelper::Mat4& view_projection, List& list);
+
+    // Records one list for drawing both eyes in a single pass (see
+    // singlepass.h): an object is only culled when it is outside both
+    // frusta. The list's projection is the first eye's.
+    void RecordStereo(const Scene& scene, const StereoHelper::Mat4 view_projection[2], List& list);
+
+    // Records count lists, one per view-projection matrix, in parallel and
+    // returns once all are done. The worker threads are started on first use;
+    // the calling thread records lists itself too. Calls from several threads
+    // queue up and share the workers.
+    void RecordParallel(const Scene& scene, const StereoHelper::Mat4 *view_projection,
+                        List *lists, int count);
+
+    // Stops and joins the worker threads. No RecordParallel() may be running;
+    // the next one starts them again.
+    void StopWorkers();
+
+    // Issues a recorded list on the GL thread: loads its projection, then
+    // every packet's modelview, material and vertex array, binding only what
+    // changed since the previous packet. Leaves the modelview stack as it
+    // found it. With instances above 1 every packet is drawn instanced, for
+    // a shader that routes the instances to the views.
+    void Submit(const List& list, int instances = 1);
+
+}
+
+#endif // __DRAWLIST_H__
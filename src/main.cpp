@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <GL/glut.h>
 
@@ -9,7 +10,11 @@ extern "C" {
 
 #include "scene.h"
 #include "stereo_helper.h"
+#include "render.h"
 #include "screenshot.h"
+#include "recorder.h"
+#include "scheduler.h"
+#include "singlepass.h"
 
 // global width and height of the window
 int GW = 800;
@@ -20,6 +25,7 @@ struct nvstusb_context *nv_ctx = NULL;
 
 // 3D camera from stereo helper
 StereoHelper::Camera cam;
+StereoHelper::StereoCache stereo;
 
 // forces a particular eye to be displayed (for debugging)
 // 0 = normal swapping, 1 = left always, 2 = right always
@@ -28,49 +34,164 @@ int force_eye = 0;
 // controls whether or not the pulsar is rotating
 bool rotation = true;
 
-void draw(int eye) {
-    static float angle = 0.0f;
+// draw the pulsar from the retained mesh (true) or in immediate mode (false)
+bool retained = true;
 
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    
-    int show = 0;
+// render both eyes into a quad buffered (GL_STEREO) window each frame instead
+// of alternating eyes every frame (--quad on the command line)
+bool quad = false;
+
+// how long before a frame starts the scheduler stops sleeping and spins,
+// more costs CPU and takes out wakeup jitter (--spin-us on the command line)
+int spin_us = 250;
+
+// draw both eyes of the retained mesh in one pass, into a layered or a side
+// by side frame buffer (--single-pass layered|sbs), -1 = one eye at a time
+int single_pass = -1;
+
+// show both eyes side by side in the window instead of through the emitter,
+// for composited or side by side 3D displays (--composite, single pass only)
+bool composite = false;
+
+// which eye the alternating frame is on (1/0 for left/right)
+int current_eye = 0;
+
+// rotation of the pulsar, in degrees
+float angle = 0.0f;
+
+// draw lists of both eyes of the current stereo pair (1/0 for left/right),
+// recorded together on the worker threads when the pair starts
+DrawList::List eye_lists[2];
+bool pair_recorded = false;
+
+void recordPair() {
+    // both eyes of a pair show the same moment, so the pulsar turns by one
+    // step per eye drawn like it does in immediate mode
+    if (rotation) angle += 2.0f;
+    Render::RecordEyes(stereo.Get(cam, (float)GW / GH), angle, eye_lists);
+    pair_recorded = true;
+}
+
+// the eye to show in place of eye, see force_eye
+int shown(int eye) {
     switch (force_eye) {
-        case 0:
-            show = eye;
-            break;
-        
         case 1:
-            show = 1;
-            break;
+            return 1;
             
         case 2:
-            show = 0;
-            break;
+            return 0;
     }
+    return eye;
+}
+
+void draw(int eye) {
+    int show = shown(eye);
     
-    // do the camera projection
-    StereoHelper::ProjectCamera(cam, (float)GW / GH, show);
+    // draw Paul Bourke's test scene "pulsar" through the camera, the
+    // retained mesh from the recorded lists
+    if (retained) {
+        Render::SubmitEye(eye_lists[show]);
+    } else {
+        if (rotation) angle += 1.0f;
+        Render::DrawEye(stereo.Get(cam, (float)GW / GH), show, angle, false);
+    }
+}
+
+void presentFrame() {
+    // both eyes are drawn together when a pair starts, the output then takes
+    // them from the eye images
+    if (quad || composite || current_eye == 0 || !pair_recorded) {
+        if (rotation) angle += 2.0f;
+        Render::DrawStereo(stereo.Get(cam, (float)GW / GH), angle);
+        pair_recorded = true;
+    }
     
-    // draw Paul Bourke's test scene "pulsar"
-    if (rotation) angle += 1.0f;
-    PaulBourke::MakeLighting();
-    PaulBourke::MakeGeometry(angle);
+    if (composite) {
+        // squeezed into the halves of the window, left eye on the left, the
+        // way side by side displays expect it
+        glDrawBuffer(GL_BACK);
+        SinglePass::Present(shown(1), 0, 0, GW / 2, GH);
+        SinglePass::Present(shown(0), GW / 2, 0, GW - GW / 2, GH);
+    } else if (quad) {
+        glDrawBuffer(GL_BACK_LEFT);
+        SinglePass::Present(shown(1), 0, 0, GW, GH);
+        Recorder::CaptureEye(1);
+        
+        glDrawBuffer(GL_BACK_RIGHT);
+        SinglePass::Present(shown(0), 0, 0, GW, GH);
+        Recorder::CaptureEye(0);
+    } else {
+        SinglePass::Present(shown(current_eye), 0, 0, GW, GH);
+        Recorder::CaptureEye(current_eye);
+    }
 }
 
-void idle() {
-    // which eye are we on? (1/0 for left/right)
-    static int current_eye = 0;
- 
-    // draw the frame for the current eye
-    draw(current_eye);
+void drawFrame() {
+    // immediate mode can't go through the single pass
+    if (single_pass >= 0 && retained) {
+        presentFrame();
+    } else if (quad) {
+        // both eyes every frame, each into its own back buffer
+        if (retained) recordPair();
+        
+        glDrawBuffer(GL_BACK_LEFT);
+        draw(1);
+        Recorder::CaptureEye(1);
+        
+        glDrawBuffer(GL_BACK_RIGHT);
+        draw(0);
+        Recorder::CaptureEye(0);
+    } else {
+        // a pair starts with the right eye
+        if (retained && (current_eye == 0 || !pair_recorded)) recordPair();
+        
+        // draw the frame for the current eye
+        draw(current_eye);
+        
+        // grab the eye for the recording before it goes to the front buffer
+        Recorder::CaptureEye(current_eye);
+    }
+}
+
+void swapFrame() {
+    if (composite) {
+        // no shutters to drive, the swap interval main() set and the
+        // scheduler pace the frames
+        glutSwapBuffers();
+    } else if (quad) {
+        // one swap flips both eyes, the stereo thread started in main() keeps
+        // the shutters in step with the display
+        nvstusb_swap(nv_ctx, nvstusb_quad, glutSwapBuffers);
+    } else {
+        // this replaces our traditional glutSwapBuffers call (let the usb
+        // emitter code call it and keep track of things)
+        nvstusb_swap(nv_ctx, (nvstusb_eye) current_eye, glutSwapBuffers);
+        current_eye = (current_eye + 1) % 2;
+    }
+}
+
+void display() {
+    // nothing to do, the scheduler's next frame repaints the window anyway
+}
+
+void slack() {
+    // the first swap waited for the emitter to come up, bail if it didn't
+    // (composited output has no emitter)
+    if (nv_ctx != NULL && nvstusb_init_poll(nv_ctx) < 0) {
+        fprintf(stderr, "Could not initialize NVIDIA 3D Vision IR emitter!\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    // hand finished screenshot readbacks over to the writer thread
+    Screenshot::Update();
+    
+    // and copy finished recorded frames into the stream file
+    Recorder::Update();
     
-    // this replaces our traditional glutSwapBuffers call (let the usb emitter
-    // code call it and keep track of things)
-    nvstusb_swap(nv_ctx, (nvstusb_eye) current_eye, glutSwapBuffers);
-    current_eye = (current_eye + 1) % 2;
+    if (nv_ctx == NULL) return;
     
-    // get the status of the button/wheel on the emitter (you MUST do this,
-    // otherwise the whole system will stall out after just a couple of frames)
+    // get the status of the button/wheel on the emitter (the emitter thread
+    // in the library reads the device, this just picks up what it saw)
     struct nvstusb_keys k;
     nvstusb_get_keys(nv_ctx, &k);
     
@@ -97,6 +218,10 @@ void idle() {
 void keyboard(unsigned char key, int x, int y) {
     switch(key) {
         case 'q': case 'Q':
+            Recorder::Stop();
+            Scheduler::PrintStats();
+            DrawList::StopWorkers();
+            if (nv_ctx != NULL) nvstusb_stop_stereo_thread(nv_ctx);
             exit(EXIT_SUCCESS);
             break;
             
@@ -121,17 +246,73 @@ void keyboard(unsigned char key, int x, int y) {
             }
             break;
             
+        case 'e': case 'E': // swap the shutters, if the eyes came out inverted
+            if (nv_ctx == NULL) {
+                printf("No shutters to swap with --composite, use 'f' to check the eyes.\n");
+            } else {
+                nvstusb_invert_eyes(nv_ctx);
+                printf("Inverted eyes.\n");
+            }
+            break;
+            
+        case 'g': case 'G': // switch geometry path
+            retained = !retained;
+            pair_recorded = false;
+            if (retained) {
+                printf("Drawing the retained mesh.\n");
+            } else {
+                printf("Drawing in immediate mode.\n");
+            }
+            break;
+            
         case 's': case 'S': // take screenshot
             Screenshot::Screenshot(0, 0, GW, GH, "screenshot.tga");
-            printf("Wrote frame buffer to screenshot.tga.\n");
+            printf("Capturing frame buffer to screenshot.tga.\n");
+            break;
+            
+        case 'r': case 'R': // start/stop recording both eyes
+            if (composite) {
+                printf("Recording needs the eyes in their own frames, not with --composite.\n");
+            } else if (Recorder::Recording()) {
+                Recorder::Stop();
+            } else if (Recorder::Start("recording.3dv", GW, GH)) {
+                printf("Recording both eyes to recording.3dv.\n");
+            }
             break;
     }
 }
 
 void reshape(int w, int h) {
+    // the recording has a fixed frame size
+    if (Recorder::Recording() && (w != GW || h != GH)) {
+        Recorder::Stop();
+    }
+    
     GW = w;
     GH = h;
     glViewport(0, 0, GW, GH);
+    
+    // the eye images follow the window (nothing happens without single pass)
+    SinglePass::Resize(GW, GH);
+}
+
+// starts bringing up the usb emitter (enumeration, firmware upload and
+// resets take a while), that happens in the background while we create the
+// window and set up the scene; the first swap waits for it
+void startEmitter() {
+    nv_ctx = nvstusb_init_async(NULL);
+    if (nv_ctx == NULL) {
+        fprintf(stderr, "Could not initialize NVIDIA 3D Vision IR emitter!\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    // auto-config the vsync rate (handed to the emitter once it is up)
+    StereoHelper::ConfigRefreshRate(nv_ctx);
+    
+    // the emitter has to be polled for keys regularly, otherwise the whole
+    // system will stall out after just a couple of frames; let the library do
+    // that in the background so the render loop never waits on it
+    nvstusb_start_key_poller(nv_ctx, 60.0f);
 }
 
 int main(int argc, char *argv[]) {
@@ -139,35 +320,91 @@ int main(int argc, char *argv[]) {
     
     // initialize glut
     glutInit(&argc, argv);
-    glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE);
-    
-    // initialize communications with the usb emitter
-    nv_ctx = nvstusb_init();
-    if (nv_ctx == NULL) {
-        fprintf(stderr, "Could not initialize NVIDIA 3D Vision IR emitter!\n");
-        exit(EXIT_FAILURE);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quad") == 0) {
+            quad = true;
+        } else if (strcmp(argv[i], "--spin-us") == 0 && i + 1 < argc) {
+            spin_us = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--single-pass") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "layered") == 0) {
+                single_pass = SinglePass::LAYERED;
+            } else if (strcmp(argv[i], "sbs") == 0) {
+                single_pass = SinglePass::SIDE_BY_SIDE;
+            } else {
+                fprintf(stderr, "Unknown single pass target %s, use layered or sbs.\n", argv[i]);
+            }
+        } else if (strcmp(argv[i], "--composite") == 0) {
+            composite = true;
+        }
     }
     
-    // auto-config the vsync rate
-    StereoHelper::ConfigRefreshRate(nv_ctx);
+    // composited output is drawn in a single pass and shown in a plain
+    // window, it needs no emitter
+    if (composite) {
+        if (single_pass < 0) single_pass = SinglePass::SIDE_BY_SIDE;
+        quad = false;
+    } else {
+        startEmitter();
+    }
+    glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE);
+    if (quad) {
+        // quad buffering needs a stereo capable visual (a Quadro, or the
+        // stereo option in xorg.conf)
+        glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE | GLUT_STEREO);
+        if (!glutGet(GLUT_DISPLAY_MODE_POSSIBLE)) {
+            fprintf(stderr, "No quad buffered visual, alternating frames instead.\n");
+            glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE);
+            quad = false;
+        }
+    }
     
     // create glut windows
     glutInitWindowSize(GW, GH);
     glutInitWindowPosition(500, 500);
     glutCreateWindow("NVIDIA 3D Vision OpenGL on Linux Demo");
     
-    // set glut callbacks
-    glutIdleFunc(idle);
+    // in quad buffered mode the library drives the shutters from its own
+    // thread, the swaps only tell it when the left eye is on screen
+    if (quad) {
+        nvstusb_start_stereo_thread(nv_ctx);
+        printf("Using quad buffered stereo.\n");
+    }
+    
+    // set glut callbacks (there is no idle callback, glut sleeps in its event
+    // loop between the frames the scheduler starts)
+    glutDisplayFunc(display);
     glutReshapeFunc(reshape);
     glutKeyboardFunc(keyboard);
  
     // set up opengl state
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-    glEnable(GL_DEPTH_TEST);
-    glShadeModel(GL_SMOOTH);
-    glEnable(GL_COLOR_MATERIAL);
-    glColorMaterial(GL_FRONT_AND_BACK,GL_AMBIENT_AND_DIFFUSE);
+    Render::Init();
+    if (single_pass >= 0) {
+        if (SinglePass::Init((SinglePass::Target) single_pass)) {
+            SinglePass::Resize(GW, GH);
+            printf("Drawing both eyes in a single pass (%s).\n",
+                   single_pass == SinglePass::LAYERED ? "layered" : "side by side");
+        } else {
+            single_pass = -1;
+            if (composite) {
+                fprintf(stderr, "No composited output without single pass stereo, using the emitter.\n");
+                composite = false;
+                startEmitter();
+            }
+        }
+    }
+    
+    // without the emitter only the swaps pace the frames, so they wait for
+    // the vblank whatever the driver's default, and the scheduler gets the
+    // display's rate
+    if (composite) {
+        if (!StereoHelper::SetSwapInterval(1)) {
+            fprintf(stderr, "Could not set the swap interval, the frames may tear.\n");
+        }
+        Scheduler::SetRate(StereoHelper::DetectRefreshRate());
+    }
     Screenshot::Init();
+    PaulBourke::MakeMesh();
     
     // set up our 3D camera (see stereohelper.h for more documentation)
     cam.type = StereoHelper::PARALLEL_AXIS_ASYMMETRIC;
@@ -180,11 +417,22 @@ int main(int argc, char *argv[]) {
     cam.near = 1.0f;
     cam.far = 200.0f;
     
+    // pace the frames from the predicted vblanks, a refresh period apart
+    // until the swaps give a prediction (or without the emitter)
+    Scheduler::Start(nv_ctx, drawFrame, swapFrame, slack, spin_us);
+    
     // off we go!
     glutMainLoop();
     
-    // clean up usb emitter
-    nvstusb_deinit(nv_ctx);
+    // clean up the mesh, the eye images, the recording threads and the usb
+    // emitter
+    DrawList::StopWorkers();
+    SinglePass::Free();
+    PaulBourke::FreeMesh();
+    if (nv_ctx != NULL) {
+        nvstusb_stop_stereo_thread(nv_ctx);
+        nvstusb_deinit(nv_ctx);
+    }
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,135 @@
+#ifndef __MATRIX_H__
+#define __MATRIX_H__
+
+#include <math.h>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+namespace StereoHelper {
+
+    /**
+     * Simple 3-dimensional vector type.
+     */
+    struct Vec3 {
+        Vec3() : x(0.0f), y(0.0f), z(0.0f) {}
+        Vec3(float xv, float yv, float zv) : x(xv), y(yv), z(zv) {}
+
+        inline Vec3 operator +(const Vec3& rhs) const { return Vec3(x + rhs.x, y + rhs.y, z + rhs.z); }
+        inline Vec3 operator -(const Vec3& rhs) const { return Vec3(x - rhs.x, y - rhs.y, z - rhs.z); }
+        inline Vec3 operator *(float rhs) const { return Vec3(x * rhs, y * rhs, z * rhs); }
+        inline Vec3 operator /(float rhs) const { return Vec3(x / rhs, y / rhs, z / rhs); }
+        inline bool operator ==(const Vec3& rhs) const { return x == rhs.x && y == rhs.y && z == rhs.z; }
+        inline bool operator !=(const Vec3& rhs) const { return !(*this == rhs); }
+
+        inline float Dot(const Vec3& rhs) const { return x * rhs.x + y * rhs.y + z * rhs.z; }
+        inline Vec3 Normalize() const { return *this / sqrtf(x * x + y * y + z * z); }
+        inline Vec3 Cross(const Vec3& rhs) const {
+            return Vec3(y * rhs.z - rhs.y * z,
+                        z * rhs.x - rhs.z * x,
+                        x * rhs.y - rhs.x * y);
+        }
+
+        float x;
+        float y;
+        float z;
+    };
+
+    /**
+     * 4x4 float matrix, stored column-major exactly like OpenGL expects it, so
+     * m can be handed straight to glLoadMatrixf() or glUniformMatrix4fv().
+     * Element (row, col) lives at m[col * 4 + row].
+     */
+    struct Mat4 {
+        Mat4() { *this = Identity(); }
+
+        float& operator ()(int row, int col) { return m[col * 4 + row]; }
+        float operator ()(int row, int col) const { return m[col * 4 + row]; }
+
+        static inline Mat4 Identity() {
+            Mat4 r(0.0f);
+            r(0, 0) = r(1, 1) = r(2, 2) = r(3, 3) = 1.0f;
+            return r;
+        }
+
+        // same matrix as glFrustum()
+        static inline Mat4 Frustum(float l, float r, float b, float t, float n, float f) {
+            Mat4 o(0.0f);
+            o(0, 0) = 2.0f * n / (r - l);
+            o(0, 2) = (r + l) / (r - l);
+            o(1, 1) = 2.0f * n / (t - b);
+            o(1, 2) = (t + b) / (t - b);
+            o(2, 2) = -(f + n) / (f - n);
+            o(2, 3) = -2.0f * f * n / (f - n);
+            o(3, 2) = -1.0f;
+            return o;
+        }
+
+        // same matrix as gluPerspective(), fovy in degrees
+        static inline Mat4 Perspective(float fovy, float aspect, float n, float f) {
+            float t = n * tanf((fovy / 2.0f) * (M_PI / 180.0f));
+            return Frustum(-aspect * t, aspect * t, -t, t, n, f);
+        }
+
+        // same matrix as gluLookAt()
+        static inline Mat4 LookAt(const Vec3& eye, const Vec3& center, const Vec3& up) {
+            Vec3 fw = (center - eye).Normalize();
+            Vec3 s = fw.Cross(up).Normalize();
+            Vec3 u = s.Cross(fw);
+            Mat4 o;
+            o(0, 0) = s.x;   o(0, 1) = s.y;   o(0, 2) = s.z;   o(0, 3) = -s.Dot(eye);
+            o(1, 0) = u.x;   o(1, 1) = u.y;   o(1, 2) = u.z;   o(1, 3) = -u.Dot(eye);
+            o(2, 0) = -fw.x; o(2, 1) = -fw.y; o(2, 2) = -fw.z; o(2, 3) = fw.Dot(eye);
+            return o;
+        }
+
+        // same matrix as glRotatef(), angle in degrees around (x, y, z)
+        static inline Mat4 Rotate(float angle, float x, float y, float z) {
+            Vec3 a = Vec3(x, y, z).Normalize();
+            float c = cosf(angle * (M_PI / 180.0f));
+            float s = sinf(angle * (M_PI / 180.0f));
+            float t = 1.0f - c;
+            Mat4 o;
+            o(0, 0) = a.x * a.x * t + c;       o(0, 1) = a.x * a.y * t - a.z * s; o(0, 2) = a.x * a.z * t + a.y * s;
+            o(1, 0) = a.y * a.x * t + a.z * s; o(1, 1) = a.y * a.y * t + c;       o(1, 2) = a.y * a.z * t - a.x * s;
+            o(2, 0) = a.x * a.z * t - a.y * s; o(2, 1) = a.y * a.z * t + a.x * s; o(2, 2) = a.z * a.z * t + c;
+            return o;
+        }
+
+        inline Mat4 operator *(const Mat4& rhs) const {
+            Mat4 o(0.0f);
+#if defined(__SSE__)
+            // each column of the result is a linear combination of our columns
+            __m128 c0 = _mm_loadu_ps(m + 0);
+            __m128 c1 = _mm_loadu_ps(m + 4);
+            __m128 c2 = _mm_loadu_ps(m + 8);
+            __m128 c3 = _mm_loadu_ps(m + 12);
+            for (int j = 0; j < 4; j++) {
+                const float *b = rhs.m + j * 4;
+                __m128 r = _mm_mul_ps(c0, _mm_set1_ps(b[0]));
+                r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_set1_ps(b[1])));
+                r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_set1_ps(b[2])));
+                r = _mm_add_ps(r, _mm_mul_ps(c3, _mm_set1_ps(b[3])));
+                _mm_storeu_ps(o.m + j * 4, r);
+            }
+#else
+            for (int j = 0; j < 4; j++) {
+                for (int i = 0; i < 4; i++) {
+                    o(i, j) = (*this)(i, 0) * rhs(0, j) + (*this)(i, 1) * rhs(1, j) +
+                              (*this)(i, 2) * rhs(2, j) + (*this)(i, 3) * rhs(3, j);
+                }
+            }
+#endif
+            return o;
+        }
+
+        float m[16];
+
+    private:
+        explicit Mat4(float fill) { for (int i = 0; i < 16; i++) m[i] = fill; }
+    };
+
+}
+
+#endif // __MATRIX_H__
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/glut.h>
+#include <GL/glext.h>
+
+#include "recorder.h"
+
+using Recorder::RecorderHeader;
+using Recorder::RecorderIndex;
+
+static const uint64_t PAGE = 4096;
+
+// index entries reserved up front, about two and a half hours at 120 Hz
+static const uint32_t MAX_FRAMES = 1 << 20;
+
+// frames preallocated (and mapped) at a time
+static const uint32_t CHUNK_FRAMES = 32;
+
+// readbacks that can be in flight on the GPU at once
+static const int RING_SIZE = 4;
+
+struct Readback {
+    GLuint pbo;
+    int frames;             // frames since it was queued
+    uint32_t eye;
+    uint64_t timestamp_ns;
+};
+
+static bool recording = false;
+static int fd = -1;
+static int width, height;
+
+// header and index stay mapped for the whole recording
+static RecorderHeader *header = NULL;
+static RecorderIndex *entries = NULL;
+static size_t header_bytes = 0;
+
+// only the chunk currently being written is mapped
+static uint8_t *chunk = NULL;
+static int64_t chunk_number = -1;
+static size_t chunk_bytes = 0;
+
+// queued readbacks, oldest at ring_head
+static Readback ring[RING_SIZE];
+static int ring_head = 0;
+static int ring_count = 0;
+
+static uint64_t RoundUp(uint64_t v, uint64_t to) {
+    return (v + to - 1) / to * to;
+}
+
+static uint64_t NowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// makes sure the chunk holding frame i is preallocated and mapped
+static bool MapChunk(uint32_t i) {
+    int64_t c = i / CHUNK_FRAMES;
+    if (c == chunk_number) return true;
+
+    if (chunk != NULL) munmap(chunk, chunk_bytes);
+    chunk = NULL;
+    chunk_number = -1;
+
+    off_t offset = header->data_offset + c * chunk_bytes;
+    int err = posix_fallocate(fd, offset, chunk_bytes);
+    if (err != 0) {
+        fprintf(stderr, "Failed to preallocate recording: %s\n", strerror(err));
+        return false;
+    }
+
+    void *p = mmap(NULL, chunk_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+    if (p == MAP_FAILED) {
+        perror("Failed to map recording");
+        return false;
+    }
+    madvise(p, chunk_bytes, MADV_SEQUENTIAL);
+
+    chunk = (uint8_t *) p;
+    chunk_number = c;
+    return true;
+}
+
+// copies the oldest readback into the file
+static void Retire() {
+    Readback& rb = ring[ring_head];
+    ring_head = (ring_head + 1) % RING_SIZE;
+    ring_count--;
+
+    // the file stays open with what was written so far until Stop()
+    uint32_t i = header->count;
+    if (i >= header->max_frames) {
+        fprintf(stderr, "Recording is full, stopping.\n");
+        recording = false;
+        return;
+    }
+    if (!MapChunk(i)) {
+        fprintf(stderr, "Can't grow the recording, stopping.\n");
+        recording = false;
+        return;
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, rb.pbo);
+    const void *src = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    if (src != NULL) {
+        memcpy(chunk + (i % CHUNK_FRAMES) * header->frame_stride, src, header->frame_size);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    if (src == NULL) {
+        fprintf(stderr, "Failed to read back recorded frame!\n");
+        return;
+    }
+
+    entries[i].timestamp_ns = rb.timestamp_ns;
+    entries[i].eye = rb.eye;
+    entries[i].reserved = 0;
+
+    // publish the frame only after its pixels and index entry are in place
+    __atomic_store_n(&header->count, i + 1, __ATOMIC_RELEASE);
+}
+
+bool Recorder::Start(const char *filename, int w, int h) {
+    // a recording that stopped by itself is still open
+    if (header != NULL) Stop();
+
+    fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Failed to open recording file for writing!");
+        return false;
+    }
+
+    width = w;
+    height = h;
+    uint64_t frame_size = (uint64_t) w * h * 3;
+    uint64_t frame_stride = RoundUp(frame_size, PAGE);
+    uint64_t index_offset = PAGE;
+    uint64_t data_offset = RoundUp(index_offset + MAX_FRAMES * sizeof(RecorderIndex), PAGE);
+
+    // the index is reserved but stays sparse until it is written
+    header_bytes = data_offset;
+    chunk_bytes = CHUNK_FRAMES * frame_stride;
+    chunk_number = -1;
+    if (ftruncate(fd, header_bytes) != 0) {
+        perror("Failed to size recording file");
+        close(fd);
+        return false;
+    }
+
+    void *p = mmap(NULL, header_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        perror("Failed to map recording file");
+        close(fd);
+        return false;
+    }
+
+    header = (RecorderHeader *) p;
+    entries = (RecorderIndex *) ((uint8_t *) p + index_offset);
+    memcpy(header->magic, "3DVGLREC", 8);
+    header->version = 1;
+    header->width = w;
+    header->height = h;
+    header->format = 0;
+    header->frame_size = frame_size;
+    header->frame_stride = frame_stride;
+    header->index_offset = index_offset;
+    header->data_offset = data_offset;
+    header->max_frames = MAX_FRAMES;
+    header->count = 0;
+
+    for (int i = 0; i < RING_SIZE; i++) {
+        if (ring[i].pbo == 0) glGenBuffers(1, &ring[i].pbo);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, ring[i].pbo);
+        glBufferData(GL_PIXEL_PACK_BUFFER, frame_size, NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    ring_head = ring_count = 0;
+
+    recording = true;
+    return true;
+}
+
+void Recorder::CaptureEye(int eye) {
+    if (!recording) return;
+
+    // never drop a frame, if the GPU is that far behind wait for it
+    if (ring_count == RING_SIZE) Retire();
+    if (!recording) return;
+
+    Readback& rb = ring[(ring_head + ring_count) % RING_SIZE];
+    ring_count++;
+    rb.frames = 0;
+    rb.eye = eye;
+    rb.timestamp_ns = NowNs();
+
+    // read the buffer the eye was drawn into, GL_BACK_LEFT or GL_BACK_RIGHT
+    // with quad buffering
+    GLint buffer = GL_BACK;
+    glGetIntegerv(GL_DRAW_BUFFER, &buffer);
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, rb.pbo);
+    glReadBuffer(buffer);
+    glReadPixels(0, 0, width, height, GL_BGR, GL_UNSIGNED_BYTE, (GLvoid *) 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+void Recorder::Update() {
+    if (!recording) return;
+
+    for (int i = 0; i < ring_count; i++) {
+        ring[(ring_head + i) % RING_SIZE].frames++;
+    }
+
+    // give every copy a frame to finish so mapping doesn't stall
+    while (recording && ring_count > 0 && ring[ring_head].frames > 1) {
+        Retire();
+    }
+}
+
+void Recorder::Stop() {
+    if (header == NULL) return;
+
+    while (recording && ring_count > 0) Retire();
+    recording = false;
+    ring_count = 0;
+
+    uint32_t count = header->count;
+    uint64_t size = header->data_offset + (uint64_t) count * header->frame_stride;
+
+    if (chunk != NULL) munmap(chunk, chunk_bytes);
+    chunk = NULL;
+    chunk_number = -1;
+    munmap(header, header_bytes);
+    header = NULL;
+    entries = NULL;
+
+    // drop the preallocated frames that were never used
+    if (ftruncate(fd, size) != 0) {
+        perror("Failed to trim recording file");
+    }
+    close(fd);
+    fd = -1;
+
+    printf("Recorded %u frames.\n", count);
+}
+
+bool Recorder::Recording() {
+    return recording;
+}
@@ -0,0 +1,63 @@
+#ifndef __RECORDER_H__
+#define __RECORDER_H__
+
+#include <stdint.h>
+
+// Continuous capture of both eyes to a raw, seekable stream file.
+//
+// File layout (all integers little-endian):
+//
+//   0                 RecorderHeader, padded to 4096 bytes
+//   index_offset      RecorderIndex[max_frames], one entry per captured eye
+//   data_offset       frame i at data_offset + i * frame_stride, frame_size
+//                     bytes of BGR8 pixels, bottom row first (like targa)
+//
+// The index is reserved up front (the file is sparse until it is written),
+// the frame data is preallocated in chunks as the recording grows, so nothing
+// ever moves. count is only bumped once a frame and its index entry are
+// complete, so readers can open and seek the file while it is being written.
+
+namespace Recorder {
+
+    struct RecorderHeader {
+        char magic[8];          // "3DVGLREC"
+        uint32_t version;       // 1
+        uint32_t width;
+        uint32_t height;
+        uint32_t format;        // 0 = BGR8
+        uint64_t frame_size;    // width * height * 3
+        uint64_t frame_stride;  // frame_size rounded up to whole pages
+        uint64_t index_offset;
+        uint64_t data_offset;
+        uint32_t max_frames;    // entries reserved in the index
+        uint32_t count;         // frames written
+    };
+
+    struct RecorderIndex {
+        uint64_t timestamp_ns;  // CLOCK_MONOTONIC when the eye was captured
+        uint32_t eye;           // 1 = left, 0 = right, same as draw(eye)
+        uint32_t reserved;
+    };
+
+    // Starts recording w x h frames from the bottom left of the window into
+    // filename. Needs a current GL context. Returns false if the file can't
+    // be created.
+    bool Start(const char *filename, int w, int h);
+
+    // Queues an asynchronous readback of the current draw buffer for the
+    // given eye. Call after rendering the eye and before swapping.
+    void CaptureEye(int eye);
+
+    // Call once per frame. Copies the readbacks that finished into the file.
+    void Update();
+
+    // Writes out whatever is still in flight and closes the file.
+    void Stop();
+
+    // False once the recording stopped by itself (full, or the file couldn't
+    // grow); the file is still closed by Stop() or the next Start().
+    bool Recording();
+
+}
+
+#endif // __RECORDER_H__
@@ -0,0 +1,67 @@
+#include <GL/glut.h>
+
+#include "render.h"
+#include "scene.h"
+#include "singlepass.h"
+
+void Render::Init() {
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glEnable(GL_DEPTH_TEST);
+    glShadeModel(GL_SMOOTH);
+    glEnable(GL_COLOR_MATERIAL);
+    glColorMaterial(GL_FRONT_AND_BACK,GL_AMBIENT_AND_DIFFUSE);
+}
+
+void Render::DrawEye(const StereoHelper::StereoPair& pair, int eye, float angle,
+                     bool retained) {
+    // the retained mesh goes through a draw list, recorded right here
+    if (retained) {
+        static DrawList::Scene scene;
+        static DrawList::List list;
+        scene.objects.clear();
+        PaulBourke::DescribeMesh(angle, scene);
+        DrawList::Record(scene, eye ? pair.left : pair.right, list);
+        SubmitEye(list);
+        return;
+    }
+    
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    
+    // do the camera projection
+    StereoHelper::ProjectCamera(pair, eye);
+    
+    // draw Paul Bourke's test scene "pulsar"
+    PaulBourke::MakeLighting();
+    PaulBourke::MakeGeometry(angle);
+}
+
+void Render::RecordEyes(const StereoHelper::StereoPair& pair, float angle,
+                        DrawList::List lists[2]) {
+    static DrawList::Scene scene;
+    scene.objects.clear();
+    PaulBourke::DescribeMesh(angle, scene);
+
+    StereoHelper::Mat4 view_projection[2] = { pair.right, pair.left };
+    DrawList::RecordParallel(scene, view_projection, lists, 2);
+}
+
+void Render::DrawStereo(const StereoHelper::StereoPair& pair, float angle) {
+    static DrawList::Scene scene;
+    static DrawList::List list;
+    scene.objects.clear();
+    PaulBourke::DescribeMesh(angle, scene);
+
+    // one list for both eyes, anything either eye sees stays in
+    StereoHelper::Mat4 view_projection[2] = { pair.right, pair.left };
+    DrawList::RecordStereo(scene, view_projection, list);
+    SinglePass::Draw(list, pair);
+}
+
+void Render::SubmitEye(const DrawList::List& list) {
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    
+    // the lights are placed with the modelview stack as it is (identity), the
+    // list loads its own projection
+    PaulBourke::MakeLighting();
+    DrawList::Submit(list);
+}
@@ -0,0 +1,42 @@
+#ifndef __RENDER_H__
+#define __RENDER_H__
+
+#include "camera.h"
+#include "drawlist.h"
+
+// The per-eye draw path of the demo, shared by the interactive app and the
+// offscreen benchmark so both measure exactly the same thing.
+
+namespace Render {
+
+    // Sets up the OpenGL state the scene is drawn with. Needs a current GL
+    // context.
+    void Init();
+
+    // Clears the bound frame buffer and draws the pulsar, rotated by angle
+    // degrees, for one eye of a stereo pair (1 = left, 0 = right). Draws the
+    // retained mesh if retained is true, otherwise uses immediate mode. Take
+    // the pair from a StereoHelper::StereoCache, the eyes are drawn one at a
+    // time.
+    void DrawEye(const StereoHelper::StereoPair& pair, int eye, float angle,
+                 bool retained);
+
+    // Describes the retained pulsar, rotated by angle degrees, once and
+    // records the draw lists of both eyes from it in parallel (lists[1] for
+    // the left eye, lists[0] for the right), see drawlist.h. Both eyes show
+    // the scene at the same moment. Call from the GL thread.
+    void RecordEyes(const StereoHelper::StereoPair& pair, float angle,
+                    DrawList::List lists[2]);
+
+    // Clears the bound frame buffer and submits an eye recorded by
+    // RecordEyes().
+    void SubmitEye(const DrawList::List& list);
+
+    // Draws the retained pulsar, rotated by angle degrees, for both eyes in
+    // one pass into the eye images of SinglePass (see singlepass.h), which
+    // has to be set up. Present the eyes from there.
+    void DrawStereo(const StereoHelper::StereoPair& pair, float angle);
+
+}
+
+#endif // __RENDER_H__
@@ -1,7 +1,66 @@
 #include <math.h>
+#include <vector>
+
+#define GL_GLEXT_PROTOTYPES
 #include <GL/glut.h>
+#include <GL/glext.h>
 
 #include "scene.h"
+#include "tessellate.h"
+
+// marks the end of one strip in the index buffer
+static const GLuint RESTART = DrawList::RESTART_INDEX;
+
+// retained pulsar mesh, see MakeMesh()
+static GLuint mesh_vao = 0;
+static GLuint mesh_vbo = 0;
+static GLuint mesh_ibo = 0;
+static GLsizei mesh_strip_count = 0;   // indices of the triangle strips
+static GLsizei mesh_line_count = 0;    // indices of the field line strips
+
+// vertex attributes and indices while tessellating
+struct MeshBuilder {
+    Tessellate::Arrays points;
+    std::vector<GLfloat> colours;
+    std::vector<GLuint> strips;
+    std::vector<GLuint> lines;
+
+    // colours every point added since first
+    void Colour(int first, const PaulBourke::COLOUR& c) {
+        for (int i = first; i < points.Size(); i++) {
+            colours.push_back(c.r); colours.push_back(c.g); colours.push_back(c.b);
+        }
+    }
+
+    // indexes every point added since first as one strip
+    void Strip(std::vector<GLuint>& dst, int first) {
+        for (int i = first; i < points.Size(); i++) dst.push_back(i);
+        dst.push_back(RESTART);
+    }
+};
+
+/*
+   The light in the center is a sphere of 16 slices and 8 stacks, tessellated
+   like glutSolidSphere(5.0,16,8). Both paths draw it from here so neither
+   needs GLUT to be initialised. Appends one slice as a triangle strip and
+   returns the index of its first point.
+*/
+static const int LIGHT_SLICES = 16;
+static const int LIGHT_STACKS = 8;
+
+static int LightColumn(int i, Tessellate::Arrays& out)
+{
+   static const float lradius = 5;
+   static std::vector<float> radius,height;
+   const Tessellate::TrigTable& lslice = Tessellate::Table(0.0f, 360.0f / LIGHT_SLICES, LIGHT_SLICES + 1);
+   if (radius.empty()) {
+      Tessellate::Arc(Tessellate::Table(-90.0f, 180.0f / LIGHT_STACKS, LIGHT_STACKS + 1), lradius, radius, height);
+   }
+   return Tessellate::SweepStrip(&radius[0], &height[0], LIGHT_STACKS + 1,
+                                 lslice.cos[i+1], lslice.sin[i+1],
+                                 lslice.cos[i], lslice.sin[i],
+                                 1.0f / lradius, out);
+}
 
 /*
    Create the geometry for the pulsar
@@ -21,6 +80,11 @@ void PaulBourke::MakeGeometry(float rotateangle)
    GLfloat shiny[1] = {5.0};
    //char cmd[64];
 
+   static Tessellate::Arrays light;
+   if (light.Size() == 0) {
+      for (i=0;i<LIGHT_SLICES;i++) LightColumn(i, light);
+   }
+
    glMaterialfv(GL_FRONT_AND_BACK,GL_SPECULAR,specular);
    glMaterialfv(GL_FRONT_AND_BACK,GL_SHININESS,shiny);
 
@@ -52,7 +116,14 @@ void PaulBourke::MakeGeometry(float rotateangle)
 
    /* Light in center */
    glColor3f(white.r,white.g,white.b);
-   glutSolidSphere(5.0,16,8);
+   for (i=0;i<LIGHT_SLICES;i++) {
+      glBegin(GL_TRIANGLE_STRIP);
+      for (k=i*2*(LIGHT_STACKS+1);k<(i+1)*2*(LIGHT_STACKS+1);k++) {
+         glNormal3f(light.nx[k],light.ny[k],light.nz[k]);
+         glVertex3f(light.px[k],light.py[k],light.pz[k]);
+      }
+      glEnd();
+   }
 
    /* Spherical center */
    for (i=0;i<360;i+=5) {
@@ -146,6 +217,206 @@ void PaulBourke::MakeGeometry(float rotateangle)
    glPopMatrix(); /* Pulsar spin */
 }
 
+/*
+   Tessellate the pulsar once into GPU buffers. Produces the same vertices,
+   normals and colours as MakeGeometry() (at the default detail), but as
+   indexed triangle strips (one per sphere column, one per cone facet, one
+   per light sphere column) plus indexed line strips for the field lines.
+*/
+void PaulBourke::MakeMesh(const MeshDetail& detail)
+{
+   int i,j,first;
+   float cradius = 5.3;          /* Final radius of the cone */
+   float clength = 30;             /* Cone length */
+   float sradius = 10;             /* Final radius of sphere */
+   float r1,r2;                   /* Min and Max radius of field lines */
+   COLOUR red = {1.0,0.0,0.0};
+   COLOUR darkred = {0.5,0.0,0.0};
+   COLOUR green = {0.0,0.5,0.0};
+   COLOUR darkgreen = {0.0,0.2,0.0};
+   COLOUR grey = {0.7,0.7,0.7};
+   COLOUR white = {1.0,1.0,1.0};
+   std::vector<float> radius,height;
+   MeshBuilder mb;
+
+   FreeMesh();
+
+   int scount = (int) (360.0f / detail.sphere + 0.5f);
+   int srows = (int) (160.0f / detail.sphere + 0.5f);
+   int ccount = (int) (360.0f / detail.cone + 0.5f);
+   int fcount = (int) (280.0f / detail.field + 0.5f);
+   mb.points.Reserve(16 * 18 + scount * 2 * (srows + 1) + 2 * ccount * 3 + 18 * fcount);
+
+   /* Light in center */
+   for (i=0;i<LIGHT_SLICES;i++) {
+      first = LightColumn(i, mb.points);
+      mb.Colour(first, white);
+      mb.Strip(mb.strips, first);
+   }
+
+   /* Spherical center, one strip per column. The colour changes per column
+      so columns do not share vertices. */
+   const Tessellate::TrigTable& slon = Tessellate::Table(0.0f, detail.sphere, scount + 1);
+   Tessellate::Arc(Tessellate::Table(-80.0f, detail.sphere, srows + 1), sradius, radius, height);
+   for (i=0;i<scount;i++) {
+      first = Tessellate::SweepStrip(&radius[0], &height[0], srows + 1,
+                                     slon.cos[i+1], slon.sin[i+1],
+                                     slon.cos[i], slon.sin[i],
+                                     1.0f, mb.points);
+      mb.Colour(first, (fmodf(i * detail.sphere, 20.0f) < detail.sphere) ? red : darkred);
+      mb.Strip(mb.strips, first);
+   }
+
+   /* The cones, each facet has its own colour */
+   const Tessellate::TrigTable& clon = Tessellate::Table(0.0f, detail.cone, ccount + 1);
+   for (j=-1;j<=1;j+=2) {
+      for (i=0;i<ccount;i++) {
+         first = mb.points.Push(0, 0, 0, 0, -1, 0);
+         mb.points.Push(cradius * clon.cos[i], j * clength, cradius * clon.sin[i],
+                        cradius * clon.cos[i], 0, cradius * clon.sin[i]);
+         mb.points.Push(cradius * clon.cos[i+1], j * clength, cradius * clon.sin[i+1],
+                        cradius * clon.cos[i+1], 0, cradius * clon.sin[i+1]);
+         mb.Colour(first, (fmodf(i * detail.cone, 30.0f) < detail.cone) ? darkgreen : green);
+         mb.Strip(mb.strips, first);
+      }
+   }
+
+   /* The field lines, with the per line rotation baked in. Immediate mode
+      draws them with whatever normal the last cone vertex left behind, which
+      is (cradius,0,0) before the rotation. */
+   r1 = 12;
+   r2 = 16;
+   const Tessellate::TrigTable& fangle = Tessellate::Table(-140.0f, detail.field, fcount);
+   const Tessellate::TrigTable& frot = Tessellate::Table(0.0f, 20.0f, 18);
+   radius.resize(fcount);
+   height.resize(fcount);
+   for (i=0;i<fcount;i++) {
+      radius[i] = r1 + r1 * fangle.cos[i];
+      height[i] = r2 * fangle.sin[i];
+   }
+   for (j=0;j<18;j++) {
+      first = Tessellate::Sweep(&radius[0], &height[0], fcount,
+                                frot.cos[j], -frot.sin[j], 0.0f, mb.points);
+      mb.points.FillNormals(first, cradius * frot.cos[j], 0, -cradius * frot.sin[j]);
+      mb.Colour(first, grey);
+      mb.Strip(mb.lines, first);
+   }
+
+   /* Upload everything, attributes are stored back to back in one buffer */
+   GLsizeiptr psize = 3 * mb.points.Size() * sizeof(GLfloat);
+   GLsizeiptr nsize = psize;
+   GLsizeiptr csize = mb.colours.size() * sizeof(GLfloat);
+   mesh_strip_count = mb.strips.size();
+   mesh_line_count = mb.lines.size();
+
+   glGenVertexArrays(1, &mesh_vao);
+   glBindVertexArray(mesh_vao);
+
+   glGenBuffers(1, &mesh_vbo);
+   glBindBuffer(GL_ARRAY_BUFFER, mesh_vbo);
+   glBufferData(GL_ARRAY_BUFFER, psize + nsize + csize, NULL, GL_STATIC_DRAW);
+   GLfloat *dst = (GLfloat *) glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
+   mb.points.PackPositions(dst);
+   mb.points.PackNormals(dst + 3 * mb.points.Size());
+   glUnmapBuffer(GL_ARRAY_BUFFER);
+   glBufferSubData(GL_ARRAY_BUFFER, psize + nsize, csize, &mb.colours[0]);
+
+   glGenBuffers(1, &mesh_ibo);
+   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh_ibo);
+   glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                (mesh_strip_count + mesh_line_count) * sizeof(GLuint),
+                NULL, GL_STATIC_DRAW);
+   glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0,
+                   mesh_strip_count * sizeof(GLuint), &mb.strips[0]);
+   glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, mesh_strip_count * sizeof(GLuint),
+                   mesh_line_count * sizeof(GLuint), &mb.lines[0]);
+
+   glEnableClientState(GL_VERTEX_ARRAY);
+   glEnableClientState(GL_NORMAL_ARRAY);
+   glEnableClientState(GL_COLOR_ARRAY);
+   glVertexPointer(3, GL_FLOAT, 0, (const GLvoid *) 0);
+   glNormalPointer(GL_FLOAT, 0, (const GLvoid *) psize);
+   glColorPointer(3, GL_FLOAT, 0, (const GLvoid *) (psize + nsize));
+
+   glBindVertexArray(0);
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+/*
+   Draw the retained pulsar, only the rotation changes per call
+*/
+void PaulBourke::DrawMesh(float rotateangle)
+{
+   GLfloat specular[4] = {1.0,1.0,1.0,1.0};
+   GLfloat shiny[1] = {5.0};
+
+   if (mesh_vao == 0)
+      MakeMesh();
+
+   glMaterialfv(GL_FRONT_AND_BACK,GL_SPECULAR,specular);
+   glMaterialfv(GL_FRONT_AND_BACK,GL_SHININESS,shiny);
+
+   glPushMatrix();
+   glRotatef(rotateangle,0.0,1.0,0.0);
+   glRotatef(45.0,0.0,0.0,1.0);
+
+   glEnable(GL_PRIMITIVE_RESTART);
+   glPrimitiveRestartIndex(RESTART);
+   glBindVertexArray(mesh_vao);
+   glDrawElements(GL_TRIANGLE_STRIP, mesh_strip_count, GL_UNSIGNED_INT,
+                  (const GLvoid *) 0);
+   glDrawElements(GL_LINE_STRIP, mesh_line_count, GL_UNSIGNED_INT,
+                  (const GLvoid *) (mesh_strip_count * sizeof(GLuint)));
+   glBindVertexArray(0);
+   glDisable(GL_PRIMITIVE_RESTART);
+
+   glPopMatrix();
+}
+
+/*
+   The retained pulsar as scene objects, the same two draws DrawMesh() issues.
+   Nothing reaches further out than the cone tips (30.5 from the center).
+*/
+void PaulBourke::DescribeMesh(float rotateangle, DrawList::Scene& scene)
+{
+   static const DrawList::Material material = { {1.0,1.0,1.0,1.0}, 5.0 };
+   static const float radius = 31.0;
+
+   if (mesh_vao == 0)
+      MakeMesh();
+
+   DrawList::Object o;
+   o.model = StereoHelper::Mat4::Rotate(rotateangle,0.0,1.0,0.0) *
+             StereoHelper::Mat4::Rotate(45.0,0.0,0.0,1.0);
+   o.center = StereoHelper::Vec3(0.0,0.0,0.0);
+   o.radius = radius;
+   o.vao = mesh_vao;
+   o.restart = true;
+   o.material = material;
+
+   o.mode = GL_TRIANGLE_STRIP;
+   o.count = mesh_strip_count;
+   o.offset = 0;
+   scene.objects.push_back(o);
+
+   o.mode = GL_LINE_STRIP;
+   o.count = mesh_line_count;
+   o.offset = mesh_strip_count * sizeof(GLuint);
+   scene.objects.push_back(o);
+}
+
+/*
+   Release the retained pulsar
+*/
+void PaulBourke::FreeMesh()
+{
+   if (mesh_vao != 0) glDeleteVertexArrays(1, &mesh_vao);
+   if (mesh_vbo != 0) glDeleteBuffers(1, &mesh_vbo);
+   if (mesh_ibo != 0) glDeleteBuffers(1, &mesh_ibo);
+   mesh_vao = mesh_vbo = mesh_ibo = 0;
+   mesh_strip_count = mesh_line_count = 0;
+}
+
 /*
    Set up the lighing environment
 */
@@ -19,6 +19,8 @@
 // purposes of this demo, and it practice you *should not do that*. It hurts and
 // makes people cry. Please don't make people cry.
 
+#include "drawlist.h"
+
 namespace PaulBourke {
 
     typedef struct {
@@ -32,7 +34,30 @@ namespace PaulBourke {
     const float DTOR = 0.0174532925;
     const XYZ origin = {0.0,0.0,0.0};
 
+    // Immediate mode: rebuilds the whole pulsar with glBegin/glEnd every call.
     void MakeGeometry(float rotateangle);
+
+    // Angular steps (in degrees) used to tessellate the retained mesh. The
+    // defaults match the immediate mode path.
+    struct MeshDetail {
+        MeshDetail() : sphere(5.0f), cone(10.0f), field(1.0f) {}
+        float sphere;   // sphere rows and columns
+        float cone;     // cone facets
+        float field;    // field line segments
+    };
+
+    // Retained mode: MakeMesh() tessellates the pulsar once into vertex and
+    // index buffers (needs a current GL context), DrawMesh() then only sets
+    // up the rotation and issues the draws. FreeMesh() releases the buffers.
+    void MakeMesh(const MeshDetail& detail = MeshDetail());
+    void DrawMesh(float rotateangle);
+    void FreeMesh();
+
+    // Appends the draws of the retained mesh, rotated like DrawMesh(), to a
+    // scene for recording per-eye draw lists (see drawlist.h). Makes the mesh
+    // first if there isn't one, so call it from the GL thread.
+    void DescribeMesh(float rotateangle, DrawList::Scene& scene);
+
     void MakeLighting();
 }
 
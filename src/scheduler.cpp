@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+#include <GL/glut.h>
+
+#include "scheduler.h"
+
+// frames start this much earlier than the render time estimate asks for, for
+// the GPU and the driver to finish theirs
+static const int64_t SAFETY_US = 1500;
+
+// glut timers have millisecond resolution and fire late, they hand over to
+// the precise sleep this long before a frame starts
+static const int64_t TIMER_SLACK_US = 2000;
+
+// how fast the render time estimate comes back down after a slow frame (it
+// goes up right away)
+static const double RENDER_DECAY = 0.05;
+
+// refresh rate taken until the emitter has one, or without an emitter if
+// SetRate() wasn't called
+static const double DEFAULT_RATE_HZ = 60.0;
+
+static nvstusb_context *nv = NULL;
+static void (*draw_func)() = NULL;
+static void (*swap_func)() = NULL;
+static void (*slack_func)() = NULL;
+static int64_t spin = 0;
+static double rate_hz = 0.0;
+
+// when the next frame has to start, 0 = right away
+static int64_t deadline = 0;
+static double render_us = 0.0;
+
+// when the last swap returned, the nominal vblank is a period after it
+static int64_t last_swap = 0;
+
+static unsigned long long frames = 0;
+static unsigned long long paced = 0;
+static int64_t total_late_us = 0;
+static int64_t max_late_us = 0;
+static int64_t total_spun_us = 0;
+
+static int64_t Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void Frame(int);
+
+// the refresh period the emitter library knows of, best measured
+static double NominalPeriod() {
+    double hz = 0.0;
+    if (nv != NULL) {
+        nvstusb_rate_estimate estimate;
+        nvstusb_get_rate_estimate(nv, &estimate);
+        hz = estimate.measured_hz;
+        if (hz <= 0.0) hz = estimate.programmed_hz;
+        if (hz <= 0.0) hz = estimate.nominal_hz;
+    }
+    if (hz <= 0.0) hz = rate_hz;
+    if (hz <= 0.0) hz = DEFAULT_RATE_HZ;
+    return 1e6 / hz;
+}
+
+// plans the next frame off the vblank after the one just swapped for
+static void Schedule() {
+    int64_t vblank = (nv != NULL) ? (int64_t) nvstusb_predict_vblank(nv) : 0;
+    if (vblank == 0) {
+        // no prediction yet, the swap returned at about a vblank and the
+        // next one comes a period later
+        vblank = last_swap + (int64_t) NominalPeriod();
+    }
+
+    deadline = vblank - (int64_t) render_us - SAFETY_US;
+    int64_t wait = deadline - spin - TIMER_SLACK_US - Now();
+    glutTimerFunc(wait > 0 ? (unsigned int) (wait / 1000) : 0, Frame, 0);
+}
+
+// waits out the rest of the time to the deadline, sleeping as long as the
+// spin margin allows
+static void WaitForDeadline() {
+    int64_t now = Now();
+    int64_t sleep_until = deadline - spin;
+    if (now < sleep_until) {
+        struct timespec ts = { (time_t) (sleep_until / 1000000), (long) (sleep_until % 1000000) * 1000 };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+        now = Now();
+    }
+
+    int64_t spun = now;
+    while (now < deadline) now = Now();
+    total_spun_us += now - spun;
+
+    int64_t late = now - deadline;
+    total_late_us += late;
+    if (late > max_late_us) max_late_us = late;
+    paced++;
+}
+
+static void Frame(int) {
+    if (deadline > 0) WaitForDeadline();
+
+    int64_t start = Now();
+    draw_func();
+    double took = (double) (Now() - start);
+    if (took > render_us) {
+        render_us = took;
+    } else {
+        render_us += (took - render_us) * RENDER_DECAY;
+    }
+
+    swap_func();
+    last_swap = Now();
+    frames++;
+    slack_func();
+    Schedule();
+}
+
+void Scheduler::Start(nvstusb_context *ctx, void (*draw)(), void (*swap)(), void (*slack)(), int spin_us) {
+    nv = ctx;
+    draw_func = draw;
+    swap_func = swap;
+    slack_func = slack;
+    spin = (spin_us > 0) ? spin_us : 0;
+
+    deadline = 0;
+    glutTimerFunc(0, Frame, 0);
+}
+
+void Scheduler::SetRate(double hz) {
+    rate_hz = hz;
+}
+
+void Scheduler::PrintStats() {
+    if (paced == 0) {
+        printf("Scheduler: %llu frames, none paced.\n", frames);
+        return;
+    }
+    printf("Scheduler: %llu frames, started %.1f us late on average (%lld at most), "
+           "%.1f us spun per frame, render estimate %.1f us.\n",
+           frames, (double) total_late_us / paced, (long long) max_late_us,
+           (double) total_spun_us / paced, render_us);
+}
@@ -0,0 +1,41 @@
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+extern "C" {
+    #include "nvstusb.h"
+}
+
+// Paces the render loop from the emitter library's vblank prediction instead
+// of spinning in glutIdleFunc. After every swap the next frame is scheduled
+// to start just early enough to be drawn before the following vblank. Until
+// then glut sleeps in its event loop (input and reshapes are handled in that
+// slack), clock_nanosleep() gets close to the start and the last stretch is
+// spun for a precise wakeup. Until the swaps give a prediction, the next
+// vblank is taken to come a refresh period after the last swap.
+namespace Scheduler {
+
+    // Starts pacing frames through glut timers, call after the window is
+    // created. draw() renders a frame, swap() presents it (not counted as
+    // render time, it blocks for the vblank) and slack() runs right after the
+    // swap, where the frame has the most time to spare.
+    //
+    // spin_us trades CPU for jitter: the last spin_us before a frame starts
+    // are busy-waited instead of slept. 0 sleeps all the way (the least CPU,
+    // but wakeups are late by the kernel's timer slack), a few hundred
+    // microseconds hides that.
+    //
+    // ctx may be NULL when there is no emitter, the frames are then paced a
+    // refresh period (see SetRate()) after the swaps.
+    void Start(nvstusb_context *ctx, void (*draw)(), void (*swap)(), void (*slack)(), int spin_us);
+
+    // The refresh rate to pace at while the emitter library knows none, in
+    // Hz. 60 if not set.
+    void SetRate(double hz);
+
+    // Prints how the frames were paced: how late they started and the time
+    // spent spinning for them.
+    void PrintStats();
+
+}
+
+#endif // __SCHEDULER_H__
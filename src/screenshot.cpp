@@ -1,69 +1,206 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <deque>
+#include <string>
+
+#define GL_GLEXT_PROTOTYPES
 #include <GL/glut.h>
+#include <GL/glext.h>
 
 #include "screenshot.h"
 
+// number of captures that can be in flight on the GPU at once
+static const int RING_SIZE = 3;
+
+// a capture being read back into a pixel buffer
+struct Readback {
+    GLuint pbo;
+    bool pending;
+    int frames;         // frames since it was queued
+    int w, h;
+    std::string filename;
+};
+
+// a capture copied out of its pixel buffer, waiting to be written
+struct Job {
+    int w, h;
+    uint8_t *pixels;    // w * h BGR, bottom row first like targa wants it
+    std::string filename;
+};
+
+static Readback ring[RING_SIZE];
+static int ring_next = 0;
+
+static std::deque<Job> jobs;
+static int jobs_busy = 0;
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t writer;
+
+// writes a 24-bit uncompressed targa, header and pixels in one go
+static void WriteTarga(const Job& job) {
+    int fd = open(job.filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Failed to open screenshot file for writing!");
+        return;
+    }
+
+    // thanks to Paul Bourke (http://local.wasp.uwa.edu.au/~pbourke/dataformats/tga/)
+    uint8_t header[18] = {
+        0, 0,
+        2,                          // type is uncompressed RGB
+        0, 0, 0, 0, 0,
+        0, 0,                       // x origin
+        0, 0,                       // y origin
+        (uint8_t) (job.w & 0xff), (uint8_t) ((job.w & 0xff00) >> 8),
+        (uint8_t) (job.h & 0xff), (uint8_t) ((job.h & 0xff00) >> 8),
+        24,                         // 24-bit color depth
+        0
+    };
+
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = job.pixels;
+    iov[1].iov_len = (size_t) job.w * job.h * 3;
+
+    size_t total = iov[0].iov_len + iov[1].iov_len;
+    size_t written = 0;
+    int iovcnt = 2;
+    struct iovec *next = iov;
+    while (written < total) {
+        ssize_t n = writev(fd, next, iovcnt);
+        if (n < 0) {
+            perror("Failed to write screenshot file!");
+            break;
+        }
+        written += n;
+        // skip over whatever went out already
+        while (iovcnt > 0 && (size_t) n >= next->iov_len) {
+            n -= next->iov_len;
+            next++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            next->iov_base = (uint8_t *) next->iov_base + n;
+            next->iov_len -= n;
+        }
+    }
+
+    close(fd);
+    if (written == total) {
+        printf("Wrote frame buffer to %s.\n", job.filename.c_str());
+    }
+}
+
+static void *WriterThread(void *) {
+    pthread_mutex_lock(&jobs_lock);
+    for (;;) {
+        while (jobs.empty()) {
+            pthread_cond_wait(&jobs_cond, &jobs_lock);
+        }
+        Job job = jobs.front();
+        jobs.pop_front();
+        jobs_busy++;
+        pthread_mutex_unlock(&jobs_lock);
+
+        WriteTarga(job);
+        free(job.pixels);
+
+        pthread_mutex_lock(&jobs_lock);
+        jobs_busy--;
+        pthread_cond_broadcast(&jobs_cond);
+    }
+    return NULL;
+}
+
 void Screenshot::Init() {
     // byte alignment
     glPixelStorei(GL_PACK_ALIGNMENT, 1);
     glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    for (int i = 0; i < RING_SIZE; i++) {
+        glGenBuffers(1, &ring[i].pbo);
+        ring[i].pending = false;
+    }
+
+    if (pthread_create(&writer, NULL, WriterThread, NULL) != 0) {
+        fprintf(stderr, "Failed to start the screenshot writer thread!\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(writer);
+    atexit(Flush);
 }
 
 void Screenshot::Screenshot(int x, int y, int w, int h, const char *filename) {
-    // read from the front buffer
-    glReadBuffer(GL_FRONT);
-    
-    // grab the pixel data
-    uint8_t buffer[w * h * (3 * sizeof(uint8_t))];
-    glReadPixels(x, y, w, h, GL_RGB, GL_UNSIGNED_BYTE, buffer);
-    
-    // open the file for writing
-    FILE *fp = fopen(filename, "wb");
-    if (fp == NULL) {
-        perror("Failed to open screenshot file for writing!");
-        exit(EXIT_FAILURE);
+    Readback& rb = ring[ring_next];
+    if (rb.pending) {
+        fprintf(stderr, "Too many screenshots in flight, skipping %s.\n", filename);
+        return;
     }
-    
-    // write 24-bit uncompressed targa header
-    // thanks to Paul Bourke (http://local.wasp.uwa.edu.au/~pbourke/dataformats/tga/)
-    putc(0, fp);
-    putc(0, fp);
-    putc(2, fp); // type is uncompressed RGB
-    putc(0, fp);
-    putc(0, fp);
-    putc(0, fp);
-    putc(0, fp);
-    putc(0, fp);
-    putc(0, fp); // x origin, low byte
-    putc(0, fp); // x origin, high byte
-    putc(0, fp); // y origin, low byte
-    putc(0, fp); // y origin, high byte
-    putc(w & 0xff, fp); // width, low byte
-    putc((w & 0xff00) >> 8, fp); // width, high byte
-    putc(h & 0xff, fp); // height, low byte
-    putc((h & 0xff00) >> 8, fp); // height, high byte
-    putc(24, fp); // 24-bit color depth
-    putc(0, fp);
-    
-    // write the image data
-    for (int j = 0; j < h; j++) {
-        for (int i = 0; i < w; i++) {
-            // calculate the offset into the buffer
-            int offset = (i + j * w) * (3 * sizeof(uint8_t));
-            
-            // copy out the bytes
-            uint8_t r = buffer[offset + 0];
-            uint8_t g = buffer[offset + 1];
-            uint8_t b = buffer[offset + 2];
-            
-            // write out the bytes in BGR order
-            putc(b, fp);
-            putc(g, fp);
-            putc(r, fp);
+    ring_next = (ring_next + 1) % RING_SIZE;
+
+    // read from the front buffer into the pixel buffer, this only queues the
+    // copy on the GPU. BGR is what targa stores, so no swizzling later.
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, rb.pbo);
+    glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr) w * h * 3, NULL, GL_STREAM_READ);
+    glReadBuffer(GL_FRONT);
+    glReadPixels(x, y, w, h, GL_BGR, GL_UNSIGNED_BYTE, (GLvoid *) 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    rb.pending = true;
+    rb.frames = 0;
+    rb.w = w;
+    rb.h = h;
+    rb.filename = filename;
+}
+
+void Screenshot::Update() {
+    for (int i = 0; i < RING_SIZE; i++) {
+        Readback& rb = ring[i];
+        if (!rb.pending) continue;
+
+        // give the copy a frame to finish so mapping doesn't stall
+        if (rb.frames++ < 1) continue;
+
+        Job job;
+        job.w = rb.w;
+        job.h = rb.h;
+        job.filename = rb.filename;
+        job.pixels = (uint8_t *) malloc((size_t) rb.w * rb.h * 3);
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, rb.pbo);
+        const void *src = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+        if (src != NULL && job.pixels != NULL) {
+            memcpy(job.pixels, src, (size_t) rb.w * rb.h * 3);
         }
+        if (src != NULL) glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        rb.pending = false;
+
+        if (src == NULL || job.pixels == NULL) {
+            fprintf(stderr, "Failed to read back screenshot %s!\n", job.filename.c_str());
+            free(job.pixels);
+            continue;
+        }
+
+        pthread_mutex_lock(&jobs_lock);
+        jobs.push_back(job);
+        pthread_cond_broadcast(&jobs_cond);
+        pthread_mutex_unlock(&jobs_lock);
+    }
+}
+
+void Screenshot::Flush() {
+    pthread_mutex_lock(&jobs_lock);
+    while (!jobs.empty() || jobs_busy > 0) {
+        pthread_cond_wait(&jobs_cond, &jobs_lock);
     }
-    
-    fclose(fp);
+    pthread_mutex_unlock(&jobs_lock);
 }
@@ -3,14 +3,24 @@
 
 namespace Screenshot {
 
-    // Sets OpenGL state such that we can take screenshots later.
+    // Sets OpenGL state such that we can take screenshots later, creates the
+    // ring of pixel buffers the frame buffer is read back into and starts the
+    // background thread that writes the files.
     void Init();
 
-    // Writes the framebuffer to a targa file with the specified filename.
-    // Region is from (x, y) in the bottom left to (x + w, y + h) in the top
-    // right.
+    // Queues a capture of the front buffer to a targa file with the specified
+    // filename. Region is from (x, y) in the bottom left to (x + w, y + h) in
+    // the top right. Returns right away, the pixels are copied asynchronously
+    // into a pixel buffer and picked up by Update() a frame later.
     void Screenshot(int x, int y, int w, int h, const char *filename);
 
+    // Call once per frame. Hands the captures queued on previous frames over
+    // to the writer thread.
+    void Update();
+
+    // Blocks until every capture handed to the writer thread is on disk.
+    void Flush();
+
 }
 
 #endif // __SCREENSHOT_H__
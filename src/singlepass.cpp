@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <string.h>
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include "singlepass.h"
+#include "scene.h"
+
+// compiled with the extension line for what the GL has in front, and a define
+// for the target
+static const char *VERTEX_SHADER =
+    "#version 410 compatibility\n"
+    "%s\n"
+    "#define LAYERED %d\n"
+    "uniform mat4 view_projection[2];\n"
+    "out vec4 colour;\n"
+    "void main() {\n"
+    "    int eye = gl_InstanceID;\n"
+    "    gl_Position = view_projection[eye] * (gl_ModelViewMatrix * gl_Vertex);\n"
+    "#if LAYERED\n"
+    "    gl_Layer = eye;\n"
+    "#else\n"
+    "    gl_ViewportIndex = eye;\n"
+    "#endif\n"
+    "\n"
+    "    // light 0 with the vertex colour as ambient and diffuse material, like\n"
+    "    // GL_COLOR_MATERIAL; a light without a direction adds no diffuse\n"
+    "    vec3 n = normalize(gl_NormalMatrix * gl_Normal);\n"
+    "    vec3 l = gl_LightSource[0].position.xyz;\n"
+    "    float diffuse = (dot(l, l) > 0.0) ? max(dot(n, normalize(l)), 0.0) : 0.0;\n"
+    "    vec4 c = gl_FrontMaterial.emission +\n"
+    "             gl_Color * (gl_LightModel.ambient + gl_LightSource[0].ambient +\n"
+    "                         gl_LightSource[0].diffuse * diffuse);\n"
+    "    if (diffuse > 0.0) {\n"
+    "        vec3 v = normalize(-(gl_ModelViewMatrix * gl_Vertex).xyz);\n"
+    "        float h = max(dot(n, normalize(normalize(l) + v)), 0.0);\n"
+    "        c += gl_FrontMaterial.specular * gl_LightSource[0].specular *\n"
+    "             pow(h, gl_FrontMaterial.shininess);\n"
+    "    }\n"
+    "    colour = clamp(vec4(c.rgb, gl_Color.a), 0.0, 1.0);\n"
+    "}\n";
+
+static const char *FRAGMENT_SHADER =
+    "#version 410 compatibility\n"
+    "in vec4 colour;\n"
+    "void main() {\n"
+    "    gl_FragColor = colour;\n"
+    "}\n";
+
+static SinglePass::Target target = SinglePass::LAYERED;
+static GLuint program = 0;
+static GLint vp_location = -1;
+
+static GLuint fbo = 0;
+static GLuint read_fbo = 0;     // one layer at a time, for presenting
+static GLuint colour = 0;
+static GLuint depth = 0;
+static int eye_w = 0;
+static int eye_h = 0;
+
+static bool HasExtension(const char *name) {
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (GLint i = 0; i < count; i++) {
+        if (strcmp((const char *) glGetStringi(GL_EXTENSIONS, i), name) == 0) return true;
+    }
+    return false;
+}
+
+static GLuint Compile(GLenum type, const char *source) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+
+    GLint ok = GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+        char log[1024];
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        fprintf(stderr, "Single pass stereo shader doesn't compile:\n%s\n", log);
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+bool SinglePass::Init(Target t) {
+    target = t;
+
+    GLint major = 0, minor = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &major);
+    glGetIntegerv(GL_MINOR_VERSION, &minor);
+    if (major * 10 + minor < 41) {
+        fprintf(stderr, "Single pass stereo needs OpenGL 4.1, drawing the eyes one by one.\n");
+        return false;
+    }
+
+    // the vertex shader has to pick the layer or viewport
+    const char *extension = NULL;
+    if (HasExtension("GL_ARB_shader_viewport_layer_array")) {
+        extension = "#extension GL_ARB_shader_viewport_layer_array : require";
+    } else if (target == LAYERED && HasExtension("GL_AMD_vertex_shader_layer")) {
+        extension = "#extension GL_AMD_vertex_shader_layer : require";
+    } else if (target == SIDE_BY_SIDE && HasExtension("GL_AMD_vertex_shader_viewport_index")) {
+        extension = "#extension GL_AMD_vertex_shader_viewport_index : require";
+    }
+    if (extension == NULL) {
+        fprintf(stderr, "No %s from the vertex shader, drawing the eyes one by one.\n",
+                target == LAYERED ? "gl_Layer" : "gl_ViewportIndex");
+        return false;
+    }
+
+    char source[4096];
+    snprintf(source, sizeof(source), VERTEX_SHADER, extension, target == LAYERED ? 1 : 0);
+    GLuint vs = Compile(GL_VERTEX_SHADER, source);
+    GLuint fs = Compile(GL_FRAGMENT_SHADER, FRAGMENT_SHADER);
+    if (vs == 0 || fs == 0) {
+        if (vs != 0) glDeleteShader(vs);
+        if (fs != 0) glDeleteShader(fs);
+        return false;
+    }
+
+    program = glCreateProgram();
+    glAttachShader(program, vs);
+    glAttachShader(program, fs);
+    glLinkProgram(program);
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+
+    GLint ok = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &ok);
+    if (!ok) {
+        char log[1024];
+        glGetProgramInfoLog(program, sizeof(log), NULL, log);
+        fprintf(stderr, "Single pass stereo shader doesn't link:\n%s\n", log);
+        glDeleteProgram(program);
+        program = 0;
+        return false;
+    }
+    vp_location = glGetUniformLocation(program, "view_projection");
+
+    glGenFramebuffers(1, &fbo);
+    glGenFramebuffers(1, &read_fbo);
+    return true;
+}
+
+void SinglePass::Resize(int w, int h) {
+    if (program == 0 || (w == eye_w && h == eye_h)) return;
+    eye_w = w;
+    eye_h = h;
+
+    if (colour != 0) glDeleteTextures(1, &colour);
+    if (depth != 0) glDeleteTextures(1, &depth);
+    glGenTextures(1, &colour);
+    glGenTextures(1, &depth);
+
+    // one layer per eye, or both eyes next to each other in one image
+    GLenum tex = (target == LAYERED) ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D;
+    glBindTexture(tex, colour);
+    if (target == LAYERED) {
+        glTexImage3D(tex, 0, GL_RGBA8, w, h, 2, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    } else {
+        glTexImage2D(tex, 0, GL_RGBA8, 2 * w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    }
+    glTexParameteri(tex, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glBindTexture(tex, depth);
+    if (target == LAYERED) {
+        glTexImage3D(tex, 0, GL_DEPTH_COMPONENT24, w, h, 2, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+    } else {
+        glTexImage2D(tex, 0, GL_DEPTH_COMPONENT24, 2 * w, h, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+    }
+    glTexParameteri(tex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glBindTexture(tex, 0);
+
+    // layered attachments, so gl_Layer picks the eye
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, colour, 0);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depth, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "Single pass stereo frame buffer is incomplete!\n");
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void SinglePass::Draw(const DrawList::List& list, const StereoHelper::StereoPair& pair) {
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    if (target == LAYERED) {
+        glViewport(0, 0, eye_w, eye_h);
+    } else {
+        glViewport(0, 0, 2 * eye_w, eye_h);
+        glViewportIndexedf(1, 0.0f, 0.0f, eye_w, eye_h);
+        glViewportIndexedf(0, eye_w, 0.0f, eye_w, eye_h);
+    }
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    // the lights are placed with the modelview stack as it is (identity), the
+    // shader reads them from there
+    PaulBourke::MakeLighting();
+
+    GLfloat view_projection[32];
+    memcpy(view_projection, pair.right.m, sizeof(pair.right.m));
+    memcpy(view_projection + 16, pair.left.m, sizeof(pair.left.m));
+    glUseProgram(program);
+    glUniformMatrix4fv(vp_location, 2, GL_FALSE, view_projection);
+    DrawList::Submit(list, 2);
+    glUseProgram(0);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+}
+
+void SinglePass::Present(int eye, int x, int y, int w, int h) {
+    int src_x = 0;
+    if (target == LAYERED) {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, read_fbo);
+        glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, colour, 0, eye);
+    } else {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+        src_x = eye ? 0 : eye_w;
+    }
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+
+    bool scaled = (w != eye_w || h != eye_h);
+    glBlitFramebuffer(src_x, 0, src_x + eye_w, eye_h, x, y, x + w, y + h,
+                      GL_COLOR_BUFFER_BIT, scaled ? GL_LINEAR : GL_NEAREST);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+}
+
+void SinglePass::Free() {
+    if (colour != 0) glDeleteTextures(1, &colour);
+    if (depth != 0) glDeleteTextures(1, &depth);
+    if (fbo != 0) glDeleteFramebuffers(1, &fbo);
+    if (read_fbo != 0) glDeleteFramebuffers(1, &read_fbo);
+    if (program != 0) glDeleteProgram(program);
+    colour = depth = fbo = read_fbo = program = 0;
+    eye_w = eye_h = 0;
+}
@@ -0,0 +1,51 @@
+#ifndef __SINGLEPASS_H__
+#define __SINGLEPASS_H__
+
+#include "camera.h"
+#include "drawlist.h"
+
+// Single pass stereo: both eyes are drawn with one submission of the scene.
+// Every packet is drawn instanced twice and a vertex shader sends instance i
+// to eye i (1 = left, 0 = right) with that eye's view-projection matrix,
+// either into layer i of a layered frame buffer (gl_Layer) or into viewport
+// i of a side by side one (gl_ViewportIndex, the left eye on the left). The
+// eyes are then copied to whatever the output is: the back buffer of the eye
+// being shown, both back buffers of a quad buffered window, or both halves
+// of the window for composited side by side displays.
+//
+// Needs ARB_shader_viewport_layer_array (or the AMD_vertex_shader_layer and
+// AMD_vertex_shader_viewport_index pair) and, side by side, ARB_viewport_array.
+// The shader does MakeLighting()'s lighting on the fixed function state, so
+// it shades like the per-eye path.
+
+namespace SinglePass {
+
+    enum Target {
+        LAYERED,
+        SIDE_BY_SIDE
+    };
+
+    // Checks the GL can do it and builds the shader. Returns false (and says
+    // why) if it can't, the caller keeps drawing per eye. Needs a current GL
+    // context.
+    bool Init(Target target);
+
+    // Sizes the eye images to w x h each, call before the first Draw() and
+    // whenever the window changes.
+    void Resize(int w, int h);
+
+    // Draws both eyes of a list recorded with DrawList::RecordStereo() into
+    // the eye images, in one submission.
+    void Draw(const DrawList::List& list, const StereoHelper::StereoPair& pair);
+
+    // Copies an eye (1 = left, 0 = right) into the rectangle at (x, y) of the
+    // size given of the window's current draw buffer, scaling if it differs
+    // from the eye images.
+    void Present(int eye, int x, int y, int w, int h);
+
+    // Releases the frame buffers and the shader.
+    void Free();
+
+}
+
+#endif // __SINGLEPASS_H__
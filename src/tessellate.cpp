@@ -0,0 +1,170 @@
+#include <math.h>
+#include <list>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+#include "tessellate.h"
+
+static const double DTOR = M_PI / 180.0;
+
+const Tessellate::TrigTable& Tessellate::Table(float start, float step, int count) {
+    static std::list<TrigTable> cache;
+
+    for (std::list<TrigTable>::const_iterator it = cache.begin(); it != cache.end(); ++it) {
+        if (it->start == start && it->step == step && it->count == count) {
+            return *it;
+        }
+    }
+
+    TrigTable t;
+    t.start = start;
+    t.step = step;
+    t.count = count;
+    t.cos.resize(count);
+    t.sin.resize(count);
+    for (int i = 0; i < count; i++) {
+        double a = (start + (double) i * step) * DTOR;
+        t.cos[i] = cos(a);
+        t.sin[i] = sin(a);
+    }
+    cache.push_back(t);
+    return cache.back();
+}
+
+void Tessellate::Arrays::Reserve(int n) {
+    px.reserve(n); py.reserve(n); pz.reserve(n);
+    nx.reserve(n); ny.reserve(n); nz.reserve(n);
+}
+
+void Tessellate::Arrays::Resize(int n) {
+    px.resize(n); py.resize(n); pz.resize(n);
+    nx.resize(n); ny.resize(n); nz.resize(n);
+}
+
+int Tessellate::Arrays::Push(float x, float y, float z, float mx, float my, float mz) {
+    px.push_back(x); py.push_back(y); pz.push_back(z);
+    nx.push_back(mx); ny.push_back(my); nz.push_back(mz);
+    return Size() - 1;
+}
+
+void Tessellate::Arrays::FillNormals(int first, float mx, float my, float mz) {
+    for (int i = first; i < Size(); i++) {
+        nx[i] = mx;
+        ny[i] = my;
+        nz[i] = mz;
+    }
+}
+
+static void Pack(const std::vector<float>& x, const std::vector<float>& y,
+                 const std::vector<float>& z, float *dst) {
+    for (size_t i = 0; i < x.size(); i++) {
+        dst[3 * i + 0] = x[i];
+        dst[3 * i + 1] = y[i];
+        dst[3 * i + 2] = z[i];
+    }
+}
+
+void Tessellate::Arrays::PackPositions(float *dst) const {
+    Pack(px, py, pz, dst);
+}
+
+void Tessellate::Arrays::PackNormals(float *dst) const {
+    Pack(nx, ny, nz, dst);
+}
+
+void Tessellate::Arc(const TrigTable& angles, float r,
+                     std::vector<float>& radius, std::vector<float>& height) {
+    radius.resize(angles.count);
+    height.resize(angles.count);
+    for (int k = 0; k < angles.count; k++) {
+        radius[k] = r * angles.cos[k];
+        height[k] = r * angles.sin[k];
+    }
+}
+
+int Tessellate::Sweep(const float *radius, const float *height, int count,
+                      float c, float s, float nscale, Arrays& out) {
+    int first = out.Size();
+    out.Resize(first + count);
+
+    float *px = &out.px[first], *py = &out.py[first], *pz = &out.pz[first];
+    float *nx = &out.nx[first], *ny = &out.ny[first], *nz = &out.nz[first];
+    int k = 0;
+
+#if defined(__SSE__)
+    __m128 vc = _mm_set1_ps(c);
+    __m128 vs = _mm_set1_ps(s);
+    __m128 vn = _mm_set1_ps(nscale);
+    for (; k + 4 <= count; k += 4) {
+        __m128 r = _mm_loadu_ps(radius + k);
+        __m128 h = _mm_loadu_ps(height + k);
+        __m128 x = _mm_mul_ps(r, vc);
+        __m128 z = _mm_mul_ps(r, vs);
+        _mm_storeu_ps(px + k, x);
+        _mm_storeu_ps(py + k, h);
+        _mm_storeu_ps(pz + k, z);
+        _mm_storeu_ps(nx + k, _mm_mul_ps(x, vn));
+        _mm_storeu_ps(ny + k, _mm_mul_ps(h, vn));
+        _mm_storeu_ps(nz + k, _mm_mul_ps(z, vn));
+    }
+#endif
+
+    for (; k < count; k++) {
+        px[k] = radius[k] * c;
+        py[k] = height[k];
+        pz[k] = radius[k] * s;
+        nx[k] = px[k] * nscale;
+        ny[k] = py[k] * nscale;
+        nz[k] = pz[k] * nscale;
+    }
+    return first;
+}
+
+int Tessellate::SweepStrip(const float *radius, const float *height, int count,
+                           float c0, float s0, float c1, float s1, float nscale,
+                           Arrays& out) {
+    int first = out.Size();
+    out.Resize(first + 2 * count);
+
+    float *px = &out.px[first], *py = &out.py[first], *pz = &out.pz[first];
+    float *nx = &out.nx[first], *ny = &out.ny[first], *nz = &out.nz[first];
+    int k = 0;
+
+#if defined(__SSE__)
+    __m128 vc0 = _mm_set1_ps(c0), vs0 = _mm_set1_ps(s0);
+    __m128 vc1 = _mm_set1_ps(c1), vs1 = _mm_set1_ps(s1);
+    __m128 vn = _mm_set1_ps(nscale);
+    for (; k + 4 <= count; k += 4) {
+        __m128 r = _mm_loadu_ps(radius + k);
+        __m128 h = _mm_loadu_ps(height + k);
+        __m128 x0 = _mm_mul_ps(r, vc0), z0 = _mm_mul_ps(r, vs0);
+        __m128 x1 = _mm_mul_ps(r, vc1), z1 = _mm_mul_ps(r, vs1);
+
+        // interleave the two sweeps: x0[0] x1[0] x0[1] x1[1] ...
+        __m128 xl = _mm_unpacklo_ps(x0, x1), xh = _mm_unpackhi_ps(x0, x1);
+        __m128 hl = _mm_unpacklo_ps(h, h),   hh = _mm_unpackhi_ps(h, h);
+        __m128 zl = _mm_unpacklo_ps(z0, z1), zh = _mm_unpackhi_ps(z0, z1);
+
+        int o = 2 * k;
+        _mm_storeu_ps(px + o, xl); _mm_storeu_ps(px + o + 4, xh);
+        _mm_storeu_ps(py + o, hl); _mm_storeu_ps(py + o + 4, hh);
+        _mm_storeu_ps(pz + o, zl); _mm_storeu_ps(pz + o + 4, zh);
+        _mm_storeu_ps(nx + o, _mm_mul_ps(xl, vn)); _mm_storeu_ps(nx + o + 4, _mm_mul_ps(xh, vn));
+        _mm_storeu_ps(ny + o, _mm_mul_ps(hl, vn)); _mm_storeu_ps(ny + o + 4, _mm_mul_ps(hh, vn));
+        _mm_storeu_ps(nz + o, _mm_mul_ps(zl, vn)); _mm_storeu_ps(nz + o + 4, _mm_mul_ps(zh, vn));
+    }
+#endif
+
+    for (; k < count; k++) {
+        int o = 2 * k;
+        px[o] = radius[k] * c0;     px[o + 1] = radius[k] * c1;
+        py[o] = height[k];          py[o + 1] = height[k];
+        pz[o] = radius[k] * s0;     pz[o + 1] = radius[k] * s1;
+        nx[o] = px[o] * nscale;     nx[o + 1] = px[o + 1] * nscale;
+        ny[o] = py[o] * nscale;     ny[o + 1] = py[o + 1] * nscale;
+        nz[o] = pz[o] * nscale;     nz[o + 1] = pz[o + 1] * nscale;
+    }
+    return first;
+}
@@ -0,0 +1,82 @@
+#ifndef __TESSELLATE_H__
+#define __TESSELLATE_H__
+
+#include <vector>
+
+// Tessellation helpers for surfaces of revolution around the y axis. All the
+// pulsar primitives (sphere, light sphere, cones and field lines) are a
+// profile curve swept around y, so everything here works on a profile given
+// as (radius, height) pairs and an angle given as a (cos, sin) pair out of a
+// precomputed table.
+
+namespace Tessellate {
+
+    /**
+     * Cosine and sine of the angles start, start + step, ... (count of them,
+     * in degrees). Computed once in double precision and stored as floats.
+     */
+    struct TrigTable {
+        float start;
+        float step;
+        int count;
+        std::vector<float> cos;
+        std::vector<float> sin;
+    };
+
+    /**
+     * Returns the table for the given angles. Tables are built on first use
+     * and cached for the lifetime of the program, so repeated tessellation at
+     * the same density never calls cos/sin again.
+     */
+    const TrigTable& Table(float start, float step, int count);
+
+    /**
+     * Positions and normals in structure-of-arrays layout, one array per
+     * component.
+     */
+    struct Arrays {
+        std::vector<float> px, py, pz;
+        std::vector<float> nx, ny, nz;
+
+        int Size() const { return (int) px.size(); }
+        void Reserve(int n);
+        void Resize(int n);
+
+        // appends a single point, for the odd vertex that isn't worth a kernel
+        int Push(float x, float y, float z, float mx, float my, float mz);
+
+        // overwrites the normals of points [first, Size()) with n
+        void FillNormals(int first, float mx, float my, float mz);
+
+        // packs component i of every point as xyz triples into dst
+        void PackPositions(float *dst) const;
+        void PackNormals(float *dst) const;
+    };
+
+    /**
+     * Builds the profile of a circular arc: radius[k] = r * cos(angle k),
+     * height[k] = r * sin(angle k).
+     */
+    void Arc(const TrigTable& angles, float r,
+             std::vector<float>& radius, std::vector<float>& height);
+
+    /**
+     * Sweeps the profile to the angle (c, s) and appends the points
+     * (radius * c, height, radius * s). Normals are the points scaled by
+     * nscale. Returns the index of the first appended point.
+     */
+    int Sweep(const float *radius, const float *height, int count,
+              float c, float s, float nscale, Arrays& out);
+
+    /**
+     * Sweeps the profile to two angles at once and interleaves the results,
+     * (c0, s0) first, so the appended points form a triangle strip between
+     * the two. Returns the index of the first appended point.
+     */
+    int SweepStrip(const float *radius, const float *height, int count,
+                   float c0, float s0, float c1, float s1, float nscale,
+                   Arrays& out);
+
+}
+
+#endif // __TESSELLATE_H__